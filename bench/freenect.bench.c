@@ -0,0 +1,786 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth 
+ jmp@jmpelletier.com
+ 
+ This file is part of jit.freenect.grab.
+  
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ 
+ http://www.apache.org/licenses/LICENSE-2.0
+ 
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ 
+ */
+
+/*
+ Benchmarks for the plain C core, on fixed synthetic frames so runs can be compared.
+   freenect.bench [section] [frames]
+ Without a section every one is run, convert first as it times the scalar paths before the
+ kernels are selected. Times are per frame, averaged over frames runs after a
+ warm-up, GB/s counts the bytes read and written. Where a case has a reference, such as the scalar
+ path of a kernel, its time and the speedup over it end the line. Capture reports the share of a
+ core its thread uses instead, over frames times 10 ms.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include "freenect.convert.h"
+#include "freenect.capture.h"
+#include "freenect.pool.h"
+#include "freenect.cloud.h"
+#include "freenect_internal.h"
+
+#define DEPTH_WIDTH 640
+#define DEPTH_HEIGHT 480
+#define DEPTH_PIXELS (DEPTH_WIDTH * DEPTH_HEIGHT)
+#define VIDEO_MAX_WIDTH 1280
+#define VIDEO_MAX_HEIGHT 1024
+#define DEFAULT_FRAMES 100
+
+typedef void (*t_bench_func)(void *data);
+
+typedef struct _frames{
+	uint16_t *depth;      //Raw values, 5% holes
+	uint8_t  *packed[2];  //The same frame packed, 11 and 10 bits
+	uint8_t  *video;      //RGB24 or IR at up to 1280x1024
+	char     *out;        //Large enough for any output
+} t_frames;
+
+static long frames = DEFAULT_FRAMES;
+
+static double now_ms(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000. + ts.tv_nsec * 0.000001;
+}
+
+//Milliseconds per run of func
+static double time_runs(t_bench_func func, void *data){
+	double start;
+	long i;
+	
+	func(data);
+	start = now_ms();
+	for(i=0;i<frames;i++){
+		func(data);
+	}
+	return (now_ms() - start) / frames;
+}
+
+//One line per case, with the speedup over a reference time when there is one
+static void report(const char *name, double ms, long pixels, double bytes, double reference){
+	printf("%-32s %8.3f ms/frame %7.3f ns/pixel %7.2f GB/s", name, ms, ms * 1000000. / pixels, bytes / (ms * 1000000.));
+	if(reference > 0.){
+		printf("  %8.3f ms %5.2fx", reference, reference / ms);
+	}
+	printf("\n");
+}
+
+static uint32_t xorshift32(uint32_t *state){
+	uint32_t v = *state;
+	v ^= v << 13;
+	v ^= v >> 17;
+	v ^= v << 5;
+	return *state = v;
+}
+
+//Most significant bit first, like FREENECT_DEPTH_11BIT_PACKED
+static void pack_depth(const uint16_t *in, uint8_t *out, long count, int bits){
+	uint32_t acc = 0;
+	int nbits = 0;
+	long i;
+	
+	for(i=0;i<count;i++){
+		acc = (acc << bits) | (in[i] & ((1 << bits) - 1));
+		nbits += bits;
+		while(nbits >= 8){
+			nbits -= 8;
+			*out++ = (uint8_t)(acc >> nbits);
+		}
+	}
+	if(nbits){
+		*out = (uint8_t)(acc << (8 - nbits));
+	}
+}
+
+static int make_frames(t_frames *f){
+	uint32_t seed = 1;
+	long i;
+	
+	f->depth = (uint16_t *)malloc(DEPTH_PIXELS * sizeof(uint16_t));
+	f->packed[0] = (uint8_t *)malloc(DEPTH_PIXELS * 11 / 8);
+	f->packed[1] = (uint8_t *)malloc(DEPTH_PIXELS * 10 / 8);
+	f->video = (uint8_t *)malloc(VIDEO_MAX_WIDTH * VIDEO_MAX_HEIGHT * 3);
+	f->out = (char *)malloc(VIDEO_MAX_WIDTH * VIDEO_MAX_HEIGHT * 8);
+	if(!f->depth || !f->packed[0] || !f->packed[1] || !f->video || !f->out){
+		return 1;
+	}
+	//A smooth surface with noise, like a room, and holes
+	for(i=0;i<DEPTH_PIXELS;i++){
+		f->depth[i] = (xorshift32(&seed) % 20 == 0) ? 0x7FF : (uint16_t)(500 + (i % DEPTH_WIDTH) / 2 + (i / DEPTH_WIDTH) + xorshift32(&seed) % 8);
+	}
+	pack_depth(f->depth, f->packed[0], DEPTH_PIXELS, 11);
+	pack_depth(f->depth, f->packed[1], DEPTH_PIXELS, 10);
+	for(i=0;i<VIDEO_MAX_WIDTH*VIDEO_MAX_HEIGHT*3;i++){
+		f->video[i] = (uint8_t)xorshift32(&seed);
+	}
+	memset(f->out, 0, VIDEO_MAX_WIDTH * VIDEO_MAX_HEIGHT * 8);
+	return 0;
+}
+
+static void free_frames(t_frames *f){
+	free(f->depth);
+	free(f->packed[0]);
+	free(f->packed[1]);
+	free(f->video);
+	free(f->out);
+}
+
+/*
+ convert: every depth output type in modes 0-3 from unpacked and packed frames, and both video
+ formats at both resolutions. Each case runs with the scalar table lookups first, then with the
+ kernels convert_select_kernels picks for this CPU.
+*/
+
+static const char *type_names[] = {"none", "char", "long", "float32", "float64", "uint16", "float16"};
+
+typedef struct _depth_case{
+	const void      *in;
+	char            *out;
+	int             bits;
+	t_convert_depth conv;
+} t_depth_case;
+
+typedef struct _video_case{
+	const uint8_t *in;
+	char          *out;
+	long          width;
+	long          height;
+	long          planecount;
+} t_video_case;
+
+static void run_depth(void *data){
+	t_depth_case *c = (t_depth_case *)data;
+	
+	convert_depth_rows(c->in, c->out, DEPTH_WIDTH * convert_size(c->conv.type), DEPTH_WIDTH, DEPTH_HEIGHT, 0, c->bits, &c->conv);
+}
+
+static void run_video(void *data){
+	t_video_case *c = (t_video_case *)data;
+	
+	convert_rgb_rows(c->in, c->out, c->width * c->planecount, c->width, c->height, c->planecount);
+}
+
+#define CONVERT_TYPES 5
+#define CONVERT_MODES 4
+#define CONVERT_DEPTH_CASES (CONVERT_TYPES * CONVERT_MODES * 3)
+#define CONVERT_VIDEO_CASES 4
+
+static void bench_convert(t_frames *f){
+	static const int types[CONVERT_TYPES] = {CONVERT_LONG, CONVERT_FLOAT32, CONVERT_FLOAT64, CONVERT_UINT16, CONVERT_FLOAT16};
+	static const int bits[3] = {16, 11, 10};
+	double scalar[CONVERT_DEPTH_CASES + CONVERT_VIDEO_CASES];
+	t_lookup luts[CONVERT_TYPES][CONVERT_MODES];
+	t_depth_case depth;
+	t_video_case video;
+	char name[64];
+	double ms;
+	int pass, t, m, b, n, err;
+	
+	memset(luts, 0, sizeof(luts));
+	for(t=0;t<CONVERT_TYPES;t++){
+		for(m=0;m<CONVERT_MODES;m++){
+			err = convert_lut(&luts[t][m], types[t], m, 0.f, 0.f);
+			if((err != CONVERT_ERR_NONE) && (err != CONVERT_ERR_TYPE)){
+				printf("convert: could not build the %s table for mode %d\n", type_names[types[t]], m);
+				return;
+			}
+		}
+	}
+	
+	printf("convert: %ld frames, selected kernels against scalar\n", frames);
+	for(pass=0;pass<2;pass++){
+		if(pass){
+			convert_select_kernels();
+		}
+		n = 0;
+		for(t=0;t<CONVERT_TYPES;t++){
+			for(m=0;m<CONVERT_MODES;m++){
+				for(b=0;b<3;b++,n++){
+					if(!luts[t][m].f_ptr){
+						continue;  //Not a supported pair, uint16 in mode 3
+					}
+					memset(&depth, 0, sizeof(depth));
+					depth.in = (bits[b] == 16) ? (const void *)f->depth : (const void *)f->packed[(bits[b] == 11) ? 0 : 1];
+					depth.out = f->out;
+					depth.bits = bits[b];
+					depth.conv.lut = &luts[t][m];
+					depth.conv.type = types[t];
+					depth.conv.mode = m;
+					depth.conv.height = DEPTH_HEIGHT;
+					if(!pass){
+						scalar[n] = time_runs(run_depth, &depth);
+						continue;
+					}
+					snprintf(name, sizeof(name), "depth %s mode %d %d-bit", type_names[types[t]], m, bits[b]);
+					ms = time_runs(run_depth, &depth);
+					report(name, ms, DEPTH_PIXELS, DEPTH_PIXELS * (bits[b] / 8. + convert_size(types[t])), scalar[n]);
+				}
+			}
+		}
+		for(b=0;b<CONVERT_VIDEO_CASES;b++,n++){
+			video.in = f->video;
+			video.out = f->out;
+			video.width = (b & 2) ? VIDEO_MAX_WIDTH : DEPTH_WIDTH;
+			video.height = (b & 2) ? VIDEO_MAX_HEIGHT : DEPTH_HEIGHT;
+			video.planecount = (b & 1) ? 1 : 4;
+			if(!pass){
+				scalar[n] = time_runs(run_video, &video);
+				continue;
+			}
+			snprintf(name, sizeof(name), "video %s %ldx%ld", (b & 1) ? "ir" : "rgb", video.width, video.height);
+			ms = time_runs(run_video, &video);
+			report(name, ms, video.width * video.height, video.width * video.height * ((b & 1) ? 2. : 7.), scalar[n]);
+		}
+	}
+	
+	for(t=0;t<CONVERT_TYPES;t++){
+		for(m=0;m<CONVERT_MODES;m++){
+			free(luts[t][m].f_ptr);
+		}
+	}
+}
+
+/*
+ threads: the conversions matrix_calc splits across the worker pool, in bands of rows like
+ the threads attribute does, for 1 to POOL_MAX_THREADS threads against one. Jobs under
+ POOL_MIN_PIXELS stay on one thread, so the 640x480 cases should hold at about 1x.
+*/
+
+#define THREAD_CASES 4
+
+typedef struct _pool_case{
+	t_worker_pool *pool;
+	t_band_func   func;
+	void          *data;
+	long          rows;
+	long          pixels;
+} t_pool_case;
+
+static void depth_band(void *data, long start, long end){
+	t_depth_case *c = (t_depth_case *)data;
+	long stride = DEPTH_WIDTH * convert_size(c->conv.type);
+	
+	convert_depth_rows((const uint8_t *)c->in + start * DEPTH_WIDTH * c->bits / 8, c->out + stride * start, stride,
+					   DEPTH_WIDTH, end - start, start, c->bits, &c->conv);
+}
+
+static void video_band(void *data, long start, long end){
+	t_video_case *c = (t_video_case *)data;
+	long stride = c->width * c->planecount;
+	
+	convert_rgb_rows(c->in + start * c->width * ((c->planecount == 4) ? 3 : 1), c->out + stride * start, stride,
+					 c->width, end - start, c->planecount);
+}
+
+static void run_pool(void *data){
+	t_pool_case *c = (t_pool_case *)data;
+	
+	worker_pool_run(c->pool, c->func, c->data, c->rows, c->pixels);
+}
+
+static void bench_threads(t_frames *f){
+	t_lookup lut = {NULL};
+	t_worker_pool pool;
+	t_depth_case depth;
+	t_video_case video;
+	t_pool_case job;
+	char name[64];
+	double ms, single = 0.;
+	long n, pixels;
+	double bytes;
+	int c;
+	
+	convert_select_kernels();
+	if(convert_lut(&lut, CONVERT_FLOAT32, 3, 0.f, 0.f) != CONVERT_ERR_NONE){
+		printf("threads: could not build the float32 table\n");
+		return;
+	}
+	worker_pool_init(&pool);
+	
+	printf("threads: %ld frames, against one thread\n", frames);
+	for(c=0;c<THREAD_CASES;c++){
+		job.pool = &pool;
+		if(c < 2){
+			memset(&depth, 0, sizeof(depth));
+			depth.in = c ? (const void *)f->packed[0] : (const void *)f->depth;
+			depth.out = f->out;
+			depth.bits = c ? 11 : 16;
+			depth.conv.lut = &lut;
+			depth.conv.type = CONVERT_FLOAT32;
+			depth.conv.mode = 3;
+			depth.conv.height = DEPTH_HEIGHT;
+			job.func = depth_band;
+			job.data = &depth;
+			job.rows = DEPTH_HEIGHT;
+			pixels = DEPTH_PIXELS;
+			job.pixels = pixels;
+			bytes = DEPTH_PIXELS * (depth.bits / 8. + sizeof(float));
+		}
+		else{
+			video.in = f->video;
+			video.out = f->out;
+			video.width = (c == 3) ? VIDEO_MAX_WIDTH : DEPTH_WIDTH;
+			video.height = (c == 3) ? VIDEO_MAX_HEIGHT : DEPTH_HEIGHT;
+			video.planecount = 4;
+			job.func = video_band;
+			job.data = &video;
+			job.rows = video.height;
+			pixels = video.width * video.height;
+			job.pixels = pixels;
+			bytes = pixels * 7.;
+		}
+		for(n=1;n<=POOL_MAX_THREADS;n++){
+			if(worker_pool_resize(&pool, n) < n){
+				printf("threads: could not start %ld threads\n", n);
+				break;
+			}
+			ms = time_runs(run_pool, &job);
+			if(n == 1){
+				single = ms;
+			}
+			if(c < 2){
+				snprintf(name, sizeof(name), "depth float32 mode 3 %d-bit %ldt", depth.bits, n);
+			}
+			else{
+				snprintf(name, sizeof(name), "video rgb %ldx%ld %ldt", video.width, video.height, n);
+			}
+			report(name, ms, pixels, bytes, (n > 1) ? single : 0.);
+		}
+	}
+	
+	worker_pool_free(&pool);
+	convert_lut(&lut, CONVERT_NONE, 0, 0.f, 0.f);
+}
+
+/*
+ millimetres: mode 5 as uint16 and long, against the float32 metres of mode 3 it replaces, from
+ 16- and 11-bit frames. The disparity model is the device default.
+*/
+
+#define MILLIMETRE_TYPES 2
+
+static void bench_millimetres(t_frames *f){
+	static const int types[MILLIMETRE_TYPES] = {CONVERT_UINT16, CONVERT_LONG};
+	static const int bits[2] = {16, 11};
+	t_lookup metres = {NULL};
+	t_lookup luts[MILLIMETRE_TYPES];
+	t_depth_case depth;
+	char name[64];
+	double ms, reference;
+	int t, b;
+	
+	convert_select_kernels();
+	memset(luts, 0, sizeof(luts));
+	if(convert_lut(&metres, CONVERT_FLOAT32, 3, 0.f, 0.f) != CONVERT_ERR_NONE){
+		printf("millimetres: could not build the float32 table\n");
+		return;
+	}
+	for(t=0;t<MILLIMETRE_TYPES;t++){
+		if(convert_lut(&luts[t], types[t], 5, -0.0030711016f, 3.3309495161f) != CONVERT_ERR_NONE){
+			printf("millimetres: could not build the table for type %d\n", types[t]);
+			goto out;
+		}
+	}
+	
+	printf("millimetres: %ld frames, against float32 mode 3\n", frames);
+	for(b=0;b<2;b++){
+		memset(&depth, 0, sizeof(depth));
+		depth.in = b ? (const void *)f->packed[0] : (const void *)f->depth;
+		depth.out = f->out;
+		depth.bits = bits[b];
+		depth.conv.lut = &metres;
+		depth.conv.type = CONVERT_FLOAT32;
+		depth.conv.mode = 3;
+		depth.conv.height = DEPTH_HEIGHT;
+		reference = time_runs(run_depth, &depth);
+		snprintf(name, sizeof(name), "float32 mode 3 %d-bit", bits[b]);
+		report(name, reference, DEPTH_PIXELS, DEPTH_PIXELS * (bits[b] / 8. + sizeof(float)), 0.);
+		
+		for(t=0;t<MILLIMETRE_TYPES;t++){
+			depth.conv.lut = &luts[t];
+			depth.conv.type = types[t];
+			depth.conv.mode = 5;
+			depth.conv.scale = -0.0030711016f;
+			depth.conv.offset = 3.3309495161f;
+			ms = time_runs(run_depth, &depth);
+			snprintf(name, sizeof(name), "%s mode 5 %d-bit", types[t] == CONVERT_UINT16 ? "uint16" : "long", bits[b]);
+			report(name, ms, DEPTH_PIXELS, DEPTH_PIXELS * (bits[b] / 8. + convert_size(types[t])), reference);
+		}
+	}
+	
+out:
+	for(t=0;t<MILLIMETRE_TYPES;t++)
+		convert_lut(&luts[t], CONVERT_NONE, 0, 0.f, 0.f);
+	convert_lut(&metres, CONVERT_NONE, 0, 0.f, 0.f);
+}
+
+/*
+ fused: depth and video converted together in tiles of CONVERT_TILE_ROWS, against the two passes
+ one after the other. float32 metres and RGB at both video resolutions. matrix_calc only fuses
+ 1280x1024 video with unpacked depth, the one case this may show a gain in.
+*/
+
+typedef struct _fused_case{
+	t_convert_frame depth;
+	t_convert_frame video;
+	t_convert_depth conv;
+} t_fused_case;
+
+static void run_two_pass(void *data){
+	t_fused_case *c = (t_fused_case *)data;
+	
+	convert_depth_rows(c->depth.in, c->depth.out_bp, c->depth.stride, c->depth.width, c->depth.height, 0, c->depth.bits, &c->conv);
+	convert_rgb_rows((const uint8_t *)c->video.in, c->video.out_bp, c->video.stride, c->video.width, c->video.height, c->video.planecount);
+}
+
+static void run_fused(void *data){
+	t_fused_case *c = (t_fused_case *)data;
+	
+	convert_fused_rows(&c->depth, &c->video, 0, c->depth.height, &c->conv);
+}
+
+static void bench_fused(t_frames *f){
+	t_lookup lut = {NULL};
+	t_fused_case c;
+	char name[64];
+	double ms, two_pass, bytes;
+	long pixels;
+	int b, v;
+	
+	convert_select_kernels();
+	if(convert_lut(&lut, CONVERT_FLOAT32, 3, 0.f, 0.f) != CONVERT_ERR_NONE){
+		printf("fused: could not build the float32 table\n");
+		return;
+	}
+	
+	printf("fused: %ld frames, against two passes\n", frames);
+	for(v=0;v<2;v++){
+		for(b=0;b<2;b++){
+			memset(&c, 0, sizeof(c));
+			c.depth.in = b ? (const void *)f->packed[0] : (const void *)f->depth;
+			c.depth.out_bp = f->out;
+			c.depth.stride = DEPTH_WIDTH * sizeof(float);
+			c.depth.width = DEPTH_WIDTH;
+			c.depth.height = DEPTH_HEIGHT;
+			c.depth.bits = b ? 11 : 16;
+			c.video.in = f->video;
+			c.video.out_bp = f->out + DEPTH_PIXELS * sizeof(double);
+			c.video.width = v ? VIDEO_MAX_WIDTH : DEPTH_WIDTH;
+			c.video.height = v ? VIDEO_MAX_HEIGHT : DEPTH_HEIGHT;
+			c.video.stride = c.video.width * 4;
+			c.video.planecount = 4;
+			c.conv.lut = &lut;
+			c.conv.type = CONVERT_FLOAT32;
+			c.conv.mode = 3;
+			c.conv.height = DEPTH_HEIGHT;
+			pixels = DEPTH_PIXELS + c.video.width * c.video.height;
+			bytes = DEPTH_PIXELS * (c.depth.bits / 8. + sizeof(float)) + c.video.width * c.video.height * 7.;
+			
+			two_pass = time_runs(run_two_pass, &c);
+			snprintf(name, sizeof(name), "two pass %d-bit rgb %ldx%ld", c.depth.bits, c.video.width, c.video.height);
+			report(name, two_pass, pixels, bytes, 0.);
+			ms = time_runs(run_fused, &c);
+			snprintf(name, sizeof(name), "fused %d-bit rgb %ldx%ld", c.depth.bits, c.video.width, c.video.height);
+			report(name, ms, pixels, bytes, two_pass);
+		}
+	}
+	
+	convert_lut(&lut, CONVERT_NONE, 0, 0.f, 0.f);
+}
+
+/*
+ cloud: the point cloud of mode 4 in each layout against copying the same frame out as float32
+ metres, which is what the depth output costs without it. GB/s counts the raw frame and the
+ vertices written, MB/frame the vertices alone. Then a consumer that only needs positions, like
+ most shaders, reads x, y and z of every vertex from each layout against the full one.
+*/
+
+typedef struct _cloud_case{
+	t_cloud        *cloud;
+	t_cloud_source source;
+	int            layout;
+} t_cloud_case;
+
+static void run_cloud(void *data){
+	t_cloud_case *c = (t_cloud_case *)data;
+	
+	cloud_build(c->cloud, &c->source, c->layout);
+}
+
+static volatile float positions_sum;
+
+static void run_positions(void *data){
+	t_cloud_case *c = (t_cloud_case *)data;
+	const float *p = c->cloud->points;
+	long n = c->cloud->count;
+	float sum = 0.f;
+	long i;
+	
+	if(c->layout == CLOUD_PLANES){
+		for(i=0;i<n;i++){
+			sum += p[i] + p[CLOUD_SIZE + i] + p[CLOUD_SIZE * 2 + i];
+		}
+	}
+	else{
+		long stride = (c->layout == CLOUD_FULL) ? sizeof(t_point3D) / sizeof(float) : CLOUD_COMPACT_PLANES;
+		for(i=0;i<n;i++,p+=stride){
+			sum += p[0] + p[1] + p[2];
+		}
+	}
+	positions_sum = sum;
+}
+
+static void bench_cloud(t_frames *f){
+	static const char *layout_names[] = {"full", "compact", "planes"};
+	static const long layout_bytes[] = {sizeof(t_point3D), CLOUD_COMPACT_PLANES * sizeof(float), CLOUD_COMPACT_PLANES * sizeof(float)};
+	t_lookup lut = {NULL};
+	t_cloud cloud = {NULL};
+	t_depth_case depth;
+	t_cloud_case c;
+	float *rays;
+	char name[64];
+	double ms, copy, full = 0.;
+	long i;
+	int l;
+	
+	convert_select_kernels();
+	rays = (float *)malloc(DEPTH_PIXELS * 2 * sizeof(float));
+	if(!rays || cloud_allocate(&cloud) || (convert_lut(&lut, CONVERT_FLOAT32, 3, 0.f, 0.f) != CONVERT_ERR_NONE)){
+		printf("cloud: out of memory\n");
+		free(rays);
+		cloud_release(&cloud);
+		return;
+	}
+	//A pinhole camera with the default depth intrinsics
+	for(i=0;i<DEPTH_PIXELS;i++){
+		rays[i * 2] = ((i % DEPTH_WIDTH) - 319.5f) / 594.2f;
+		rays[i * 2 + 1] = (239.5f - (i / DEPTH_WIDTH)) / 591.0f;
+	}
+	
+	memset(&depth, 0, sizeof(depth));
+	depth.in = f->depth;
+	depth.out = f->out;
+	depth.bits = 16;
+	depth.conv.lut = &lut;
+	depth.conv.type = CONVERT_FLOAT32;
+	depth.conv.mode = 3;
+	depth.conv.height = DEPTH_HEIGHT;
+	
+	printf("cloud: %ld frames, against the float32 depth copy\n", frames);
+	copy = time_runs(run_depth, &depth);
+	report("depth copy float32 metres", copy, DEPTH_PIXELS, DEPTH_PIXELS * (2. + sizeof(float)), 0.);
+	
+	c.cloud = &cloud;
+	c.source.depth = f->depth;
+	c.source.lut = lut.f_ptr;
+	c.source.rays = rays;
+	c.source.rgb = f->video;
+	c.source.rgb_planes = 3;
+	c.source.rgb_width = DEPTH_WIDTH;
+	c.source.threshold = 2.f;
+	for(l=CLOUD_FULL;l<=CLOUD_PLANES;l++){
+		c.layout = l;
+		ms = time_runs(run_cloud, &c);
+		snprintf(name, sizeof(name), "cloud %s %u vertices", layout_names[l], cloud.count);
+		report(name, ms, DEPTH_PIXELS, DEPTH_PIXELS * 2. + (double)cloud.count * layout_bytes[l], copy);
+		snprintf(name, sizeof(name), "cloud %s written", layout_names[l]);
+		printf("%-32s %8.2f MB/frame %7.1f%% of full\n", name, cloud.count * layout_bytes[l] * 0.000001,
+			   100. * layout_bytes[l] / layout_bytes[CLOUD_FULL]);
+	}
+	//Interleaved layouts stream whole vertices through the cache, planes only the position rows
+	for(l=CLOUD_FULL;l<=CLOUD_PLANES;l++){
+		c.layout = l;
+		run_cloud(&c);
+		ms = time_runs(run_positions, &c);
+		if(l == CLOUD_FULL){
+			full = ms;
+		}
+		snprintf(name, sizeof(name), "positions from %s", layout_names[l]);
+		report(name, ms, cloud.count, (double)cloud.count * ((l == CLOUD_PLANES) ? 3. * sizeof(float) : layout_bytes[l]),
+			   (l == CLOUD_FULL) ? 0. : full);
+	}
+	
+	free(rays);
+	cloud_release(&cloud);
+	convert_lut(&lut, CONVERT_NONE, 0, 0.f, 0.f);
+}
+
+//Capture: CPU used by the thread servicing the context, the former polling loop against
+//freenect.capture.c, over the stub libfreenect in bench/stub
+
+#define CAPTURE_INTERVAL 1000 //Microseconds between simulated transfers, roughly depth and video streaming
+#define CAPTURE_RUN_MS 10     //Milliseconds measured per frame argument
+
+static volatile int polling_terminate;
+
+//libusb blocks until the next transfer completes or the timeout expires
+static int wait_transfer(freenect_context *ctx, long limit){
+	struct timespec ts;
+	long us = ctx->interval < limit ? ctx->interval : limit;
+	
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	nanosleep(&ts, NULL);
+	__sync_fetch_and_add(&ctx->transfers, 1);
+	return 0;
+}
+
+int freenect_process_events(freenect_context *ctx){
+	return wait_transfer(ctx, ctx->interval);
+}
+
+int freenect_process_events_timeout(freenect_context *ctx, struct timeval *timeout){
+	return wait_transfer(ctx, timeout->tv_sec * 1000000 + timeout->tv_usec);
+}
+
+//capture_threadfunc before the thread blocked
+static void *polling_threadfunc(void *arg){
+	freenect_context *context = (freenect_context *)arg;
+	
+	while(!polling_terminate){
+		if(context->first){
+			if(freenect_process_events(context) < 0){
+				break;
+			}
+		}
+		
+		sleep(0);
+	}
+	return NULL;
+}
+
+static double cpu_ms(void){
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000. + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 0.001;
+}
+
+static void bench_capture(t_frames *f){
+	freenect_context context;
+	freenect_device device;
+	t_capture capture;
+	pthread_t thread;
+	struct timespec ts;
+	double start, cpu, wall;
+	long transfers;
+	int blocking, devices;
+	char name[64];
+	
+	(void)f;
+	device.next = NULL;
+	for(blocking=0;blocking<2;blocking++){
+		for(devices=0;devices<2;devices++){
+			context.first = NULL;
+			context.interval = CAPTURE_INTERVAL;
+			context.transfers = 0;
+			if(blocking){
+				if(capture_start(&capture, &context, NULL)){
+					fprintf(stderr, "freenect.bench: could not start the capture thread\n");
+					return;
+				}
+			}
+			else{
+				polling_terminate = 0;
+				if(pthread_create(&thread, NULL, polling_threadfunc, &context)){
+					fprintf(stderr, "freenect.bench: could not start the polling thread\n");
+					return;
+				}
+			}
+			//Opened after the thread started, like the first device in open
+			if(devices){
+				context.first = &device;
+				if(blocking){
+					capture_post(&capture, OPEN);
+				}
+			}
+			
+			cpu = cpu_ms();
+			start = now_ms();
+			ts.tv_sec = frames * CAPTURE_RUN_MS / 1000;
+			ts.tv_nsec = (frames * CAPTURE_RUN_MS % 1000) * 1000000;
+			nanosleep(&ts, NULL);
+			cpu = cpu_ms() - cpu;
+			wall = now_ms() - start;
+			transfers = context.transfers;
+			
+			if(blocking){
+				capture_stop(&capture);
+			}
+			else{
+				polling_terminate = 1;
+				pthread_join(thread, NULL);
+			}
+			
+			snprintf(name, sizeof(name), "capture %s %d device%s", blocking ? "blocking" : "polling", devices, devices == 1 ? "" : "s");
+			printf("%-32s %8.1f %% of a core %8.0f transfers/s\n", name, cpu * 100. / wall, transfers * 1000. / wall);
+		}
+	}
+}
+
+typedef struct _section{
+	const char *name;
+	void       (*func)(t_frames *f);
+} t_section;
+
+static const t_section sections[] = {
+	{"convert", bench_convert},
+	{"threads", bench_threads},
+	{"millimetres", bench_millimetres},
+	{"fused", bench_fused},
+	{"cloud", bench_cloud},
+	{"capture", bench_capture}
+};
+
+int main(int argc, char **argv){
+	t_frames f;
+	const char *only = NULL;
+	int i, found = 0;
+	
+	if(argc > 1){
+		only = strcmp(argv[1], "all") ? argv[1] : NULL;
+	}
+	if(argc > 2){
+		frames = atol(argv[2]);
+		if(frames < 1){
+			frames = 1;
+		}
+	}
+	if(make_frames(&f)){
+		fprintf(stderr, "freenect.bench: out of memory\n");
+		return 1;
+	}
+	for(i=0;i<(int)(sizeof(sections) / sizeof(sections[0]));i++){
+		if(!only || !strcmp(only, sections[i].name)){
+			sections[i].func(&f);
+			found = 1;
+		}
+	}
+	free_frames(&f);
+	if(!found){
+		fprintf(stderr, "freenect.bench: no section %s\n", only);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,41 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth 
+ jmp@jmpelletier.com
+ 
+ This file is part of jit.freenect.grab.
+  
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ 
+ http://www.apache.org/licenses/LICENSE-2.0
+ 
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ 
+ */
+
+/*
+ Stub context, see libfreenect.h. Open devices get a USB transfer to service every interval
+ microseconds, libusb blocks until then.
+*/
+
+#ifndef FREENECT_INTERNAL_H
+#define FREENECT_INTERNAL_H
+
+#include "libfreenect.h"
+
+struct _freenect_device{
+	freenect_device *next;
+};
+
+struct _freenect_context{
+	freenect_device *first;
+	long            interval;
+	long            transfers;
+};
+
+#endif
@@ -0,0 +1,37 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth 
+ jmp@jmpelletier.com
+ 
+ This file is part of jit.freenect.grab.
+  
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ 
+ http://www.apache.org/licenses/LICENSE-2.0
+ 
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ 
+ */
+
+/*
+ Stand-in for the parts of libfreenect freenect.capture.c uses, so the capture thread can be
+ benchmarked without a device or libusb. freenect.bench.c implements the functions.
+*/
+
+#ifndef LIBFREENECT_H
+#define LIBFREENECT_H
+
+#include <sys/time.h>
+
+typedef struct _freenect_context freenect_context;
+typedef struct _freenect_device freenect_device;
+
+int freenect_process_events(freenect_context *ctx);
+int freenect_process_events_timeout(freenect_context *ctx, struct timeval *timeout);
+
+#endif
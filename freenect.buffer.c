@@ -0,0 +1,147 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth 
+ jmp@jmpelletier.com
+ 
+ This file is part of jit.freenect.grab.
+  
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ 
+ http://www.apache.org/licenses/LICENSE-2.0
+ 
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ 
+ */
+
+#include <stdlib.h>
+#include "freenect.buffer.h"
+
+enum pin_state{
+	PIN_NONE,
+	PIN_HELD,     //The writer has the frame, the slot still circulates
+	PIN_RETIRED   //The writer has the frame, a spare took the slot's place
+};
+
+static long atomic_exchange_long(volatile long *ptr, long value){
+	long old;
+	do{
+		old = *ptr;
+	}while(!__sync_bool_compare_and_swap(ptr, old, value));
+	return old;
+}
+
+int frame_buffer_allocate(t_frame_buffer *buf, long bytes){
+	int i;
+	uint8_t *block = (uint8_t *)malloc(bytes * BUFFER_SLOTS);
+	
+	if(!block){
+		return 1;
+	}
+	for(i=0;i<BUFFER_MAX_SLOTS;i++){
+		buf->slots[i] = (i < BUFFER_SLOTS) ? block + bytes * i : NULL;
+		buf->timestamps[i] = 0;
+		buf->arrivals[i] = 0;
+		buf->pins[i] = PIN_NONE;
+	}
+	buf->spare_block = NULL;
+	buf->spare_head = 0;
+	buf->spare_tail = 0;
+	buf->back = 0;
+	buf->ready = 1;
+	buf->front = 2;
+	buf->bytes = bytes;
+	buf->dropped = 0;
+	buf->watched = 1;
+	return 0;
+}
+
+void frame_buffer_release(t_frame_buffer *buf){
+	int i;
+	
+	free(buf->slots[0]);  //The first slots share a single block, the spares another
+	free(buf->spare_block);
+	for(i=0;i<BUFFER_MAX_SLOTS;i++){
+		buf->slots[i] = NULL;
+	}
+	buf->spare_block = NULL;
+	buf->bytes = 0;
+}
+
+int frame_buffer_add_spares(t_frame_buffer *buf){
+	uint8_t *block;
+	int i;
+	
+	if(buf->spare_block){
+		return 0;
+	}
+	block = (uint8_t *)malloc(buf->bytes * BUFFER_SPARES);
+	if(!block){
+		return 1;
+	}
+	for(i=0;i<BUFFER_SPARES;i++){
+		buf->slots[BUFFER_SLOTS + i] = block + buf->bytes * i;
+		buf->spares[i] = BUFFER_SLOTS + i;
+	}
+	buf->spare_head = BUFFER_SPARES;
+	__sync_synchronize();  //frame_buffer_pin only pins once it sees the spares ready
+	buf->spare_block = block;
+	return 0;
+}
+
+uint8_t *frame_buffer_publish(t_frame_buffer *buf, uint32_t timestamp, uint64_t arrival){
+	long old;
+	
+	buf->timestamps[buf->back] = timestamp;
+	buf->arrivals[buf->back] = arrival;
+	old = atomic_exchange_long(&buf->ready, buf->back | BUFFER_FRESH);
+	if((old & BUFFER_FRESH) && buf->watched){
+		buf->dropped++;
+	}
+	buf->back = old & BUFFER_INDEX;
+	
+	//Never write over a frame the writer still reads. There is always a spare: every retired slot
+	//holds one of at most BUFFER_SPARES pinned frames, and took a spare's place.
+	if((buf->pins[buf->back] == PIN_HELD) && (buf->spare_tail != buf->spare_head)){
+		__sync_synchronize();  //The writer stored the index before moving spare_head
+		if(__sync_bool_compare_and_swap(&buf->pins[buf->back], PIN_HELD, PIN_RETIRED)){
+			buf->back = buf->spares[buf->spare_tail % BUFFER_SPARES];
+			buf->spare_tail++;
+		}
+	}
+	return buf->slots[buf->back];
+}
+
+long frame_buffer_pin(t_frame_buffer *buf){
+	if(!buf->spare_block){
+		return -1;
+	}
+	__sync_synchronize();
+	buf->pins[buf->back] = PIN_HELD;
+	__sync_synchronize();  //Pinned before the slot is published
+	return buf->back;
+}
+
+void frame_buffer_unpin(t_frame_buffer *buf, long index){
+	if(__sync_bool_compare_and_swap(&buf->pins[index], PIN_HELD, PIN_NONE)){
+		return;
+	}
+	//Retired while the writer had it, it becomes a spare
+	buf->pins[index] = PIN_NONE;
+	buf->spares[buf->spare_head % BUFFER_SPARES] = index;
+	__sync_synchronize();
+	buf->spare_head++;
+}
+
+uint8_t *frame_buffer_acquire(t_frame_buffer *buf, uint32_t *timestamp){
+	if(!buf->slots[0] || !(buf->ready & BUFFER_FRESH)){
+		return NULL;
+	}
+	buf->front = atomic_exchange_long(&buf->ready, buf->front) & BUFFER_INDEX;
+	*timestamp = buf->timestamps[buf->front];
+	return buf->slots[buf->front];
+}
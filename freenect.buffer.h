@@ -0,0 +1,87 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth 
+ jmp@jmpelletier.com
+ 
+ This file is part of jit.freenect.grab.
+  
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ 
+ http://www.apache.org/licenses/LICENSE-2.0
+ 
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ 
+ */
+
+/*
+ Frame handoff between a producer, a libfreenect callback or a virtual device thread, and
+ matrix_calc. Plain C with no Max or Jitter dependencies, so it can be tested on its own.
+*/
+
+#ifndef FREENECT_BUFFER_H
+#define FREENECT_BUFFER_H
+
+#include <stdint.h>
+
+#define BUFFER_SLOTS 3        //Slots in circulation between the producer and matrix_calc
+#define BUFFER_SPARES 16      //Slots that stand in for frames the recorder still holds
+#define BUFFER_MAX_SLOTS (BUFFER_SLOTS + BUFFER_SPARES)
+#define BUFFER_FRESH 0x20
+#define BUFFER_INDEX 0x1F
+
+/*
+ Triple buffer. The producer writes into slots[back]; finished frames are published by swapping
+ back with ready, and matrix_calc swaps ready with front. Neither side ever waits on the other.
+ 
+ While recording, the producer can pin a finished frame for the writer thread instead of copying
+ it. A pinned slot keeps circulating, it may well be read by matrix_calc at the same time. Only
+ when it comes back to the producer as the next back slot before the writer is done with it, it
+ is retired and a spare takes its place. The writer returns retired slots to the spares.
+*/
+typedef struct _frame_buffer{
+	uint8_t          *slots[BUFFER_MAX_SLOTS];
+	uint32_t         timestamps[BUFFER_MAX_SLOTS];
+	uint64_t         arrivals[BUFFER_MAX_SLOTS];  //Host time the producer received the frame, 0 unless profiling
+	volatile long    pins[BUFFER_MAX_SLOTS];      //0, or pinned by the writer, see frame_buffer_pin
+	uint8_t          *spare_block;                //Spare slots, allocated for the first recording
+	long             spares[BUFFER_SPARES];       //Ring of free spare slot indices
+	volatile long    spare_head;                  //Written by the writer
+	volatile long    spare_tail;                  //Written by the producer
+	volatile long    ready;    //Slot index of the latest complete frame, BUFFER_FRESH set if not yet read
+	long             back;     //Owned by the producer
+	long             front;    //Owned by matrix_calc
+	long             bytes;    //Size of one slot
+	long             dropped;  //Frames replaced before matrix_calc took them, written by the producer
+	volatile long    watched;  //Whether matrix_calc takes frames, unwatched replacements are not drops
+} t_frame_buffer;
+
+//Allocate the slots, returns non-zero when out of memory
+int      frame_buffer_allocate(t_frame_buffer *buf, long bytes);
+
+//Free the slots. Nothing may produce into the buffer or hold a pinned slot.
+void     frame_buffer_release(t_frame_buffer *buf);
+
+//Allocate the spare slots frames can be pinned with, once. Returns non-zero when out of memory.
+//May be called while the producer runs, as long as nothing pins until it has returned.
+int      frame_buffer_add_spares(t_frame_buffer *buf);
+
+//Producer: hand the frame just written to slots[back] over and return the slot to write next
+uint8_t  *frame_buffer_publish(t_frame_buffer *buf, uint32_t timestamp, uint64_t arrival);
+
+//Producer, before publishing: pin the frame in slots[back] for the writer. Returns the slot index,
+//or -1 if the buffer has no spares. At most BUFFER_SPARES frames may be pinned at a time.
+long     frame_buffer_pin(t_frame_buffer *buf);
+
+//Writer: done with a slot frame_buffer_pin returned
+void     frame_buffer_unpin(t_frame_buffer *buf, long index);
+
+//matrix_calc: take ownership of the latest complete frame, or return NULL if nothing new arrived.
+//The returned slot stays valid until the next call.
+uint8_t  *frame_buffer_acquire(t_frame_buffer *buf, uint32_t *timestamp);
+
+#endif
@@ -0,0 +1,107 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth 
+ jmp@jmpelletier.com
+ 
+ This file is part of jit.freenect.grab.
+  
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ 
+ http://www.apache.org/licenses/LICENSE-2.0
+ 
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ 
+ */
+
+#include <sys/time.h>
+#include "freenect.capture.h"
+#include "freenect_internal.h"
+
+static void *capture_threadfunc(void *arg)
+{
+	t_capture *capture = (t_capture *)arg;
+	freenect_context *context = capture->context;
+	struct timeval timeout;
+	enum thread_mess_type mess;
+	int err;
+	
+	pthread_mutex_lock(&capture->mutex);
+	
+	while(1){
+		mess = capture->mess;
+		capture->mess = NONE;
+		
+		if(mess == TERMINATE){
+			break;
+		}
+		
+		if(!context->first){
+			//No device to service, sleep until we are told something changed
+			pthread_cond_wait(&capture->cond, &capture->mutex);
+			continue;
+		}
+		
+		pthread_mutex_unlock(&capture->mutex);
+		
+		timeout.tv_sec = 0;
+		timeout.tv_usec = CAPTURE_TIMEOUT;
+		err = freenect_process_events_timeout(context, &timeout);
+		
+		pthread_mutex_lock(&capture->mutex);
+		if(err < 0){
+			//Nothing services the context anymore, it has to be shut down and started over
+			capture->failed = 1;
+			if(capture->report){
+				capture->report(err);
+			}
+			break;
+		}
+	}
+	
+	capture->mess = NONE;
+	pthread_mutex_unlock(&capture->mutex);
+	
+	pthread_exit(NULL);
+	return NULL;
+}
+
+int capture_start(t_capture *capture, freenect_context *context, void (*report)(int))
+{
+	capture->context = context;
+	capture->mess = NONE;
+	capture->failed = 0;
+	capture->report = report;
+	pthread_mutex_init(&capture->mutex, NULL);
+	pthread_cond_init(&capture->cond, NULL);
+	if(pthread_create(&capture->thread, NULL, capture_threadfunc, capture)){
+		pthread_mutex_destroy(&capture->mutex);
+		pthread_cond_destroy(&capture->cond);
+		capture->context = NULL;
+		return 1;
+	}
+	return 0;
+}
+
+void capture_post(t_capture *capture, enum thread_mess_type mess)
+{
+	pthread_mutex_lock(&capture->mutex);
+	if(capture->mess != TERMINATE){
+		capture->mess = mess;
+	}
+	pthread_cond_broadcast(&capture->cond);
+	pthread_mutex_unlock(&capture->mutex);
+}
+
+void capture_stop(t_capture *capture)
+{
+	capture_post(capture, TERMINATE);
+	pthread_join(capture->thread, NULL);
+	pthread_mutex_destroy(&capture->mutex);
+	pthread_cond_destroy(&capture->cond);
+	capture->context = NULL;
+}
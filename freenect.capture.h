@@ -0,0 +1,61 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth 
+ jmp@jmpelletier.com
+ 
+ This file is part of jit.freenect.grab.
+  
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ 
+ http://www.apache.org/licenses/LICENSE-2.0
+ 
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ 
+ */
+
+/*
+ Capture thread servicing a libfreenect context. It blocks in libusb while a device is open and
+ sleeps on a condition otherwise, open, close and terminate wake it up. Plain C with no Max or
+ Jitter dependencies.
+*/
+
+#ifndef FREENECT_CAPTURE_H
+#define FREENECT_CAPTURE_H
+
+#include <pthread.h>
+#include "libfreenect.h"
+
+#define CAPTURE_TIMEOUT 100000 //Microseconds the thread blocks in libusb before checking for messages
+
+enum thread_mess_type{
+	NONE,
+	OPEN,
+	CLOSE,
+	TERMINATE
+};
+
+typedef struct _capture{
+	freenect_context      *context;
+	pthread_t             thread;
+	pthread_mutex_t       mutex;
+	pthread_cond_t        cond;
+	enum thread_mess_type mess;
+	volatile long         failed;           //Processing events failed and the thread has returned
+	void                  (*report)(int);   //Called from the thread with libfreenect's error, may be NULL
+} t_capture;
+
+//Start servicing context. Returns non-zero if the thread could not be created.
+int  capture_start(t_capture *capture, freenect_context *context, void (*report)(int));
+
+//Wake the thread up after devices were opened or closed
+void capture_post(t_capture *capture, enum thread_mess_type mess);
+
+//Stop the thread and wait for it, the context is left to the caller
+void capture_stop(t_capture *capture);
+
+#endif
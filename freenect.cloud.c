@@ -0,0 +1,198 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth 
+ jmp@jmpelletier.com
+ 
+ This file is part of jit.freenect.grab.
+  
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ 
+ http://www.apache.org/licenses/LICENSE-2.0
+ 
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ 
+ */
+
+#include <stdlib.h>
+#include "freenect.cloud.h"
+
+#if defined(__GNUC__)
+#define FORCE_INLINE static __inline__ __attribute__((always_inline))
+#else
+#define FORCE_INLINE static __inline
+#endif
+
+int cloud_allocate(t_cloud *cloud){
+	if(!cloud->points){
+		cloud->points = (float *)malloc(CLOUD_SIZE*sizeof(t_point3D));
+		if(!cloud->points){
+			cloud->size = 0;
+			cloud->count = 0;
+			return 1;
+		}
+		cloud->size = CLOUD_SIZE;
+		cloud->count = 0; 
+	}
+	return 0;
+}
+
+void cloud_release(t_cloud *cloud){
+	free(cloud->points);
+	cloud->points = NULL;
+	cloud->count = 0;
+	cloud->size = 0;
+}
+
+/*
+ Each pair of depth rows becomes a triangle strip of alternating top/bottom vertices, and
+ separate strips are joined with degenerate triangles, so the whole cloud can be drawn as a
+ single tri_strip. A column joins the strip when both of its samples are valid and within
+ threshold of each other and of the previous column. A new strip is only started once two
+ consecutive columns connect, so isolated columns emit nothing and a strip of k columns costs at
+ most 2k+2 vertices, which is where CLOUD_SIZE comes from.
+ 
+ Everything is computed in one pass into the preallocated cloud, which jit.freenect.grab.c's
+ output matrix references instead of copying it. build_strips is inlined once per layout so
+ each gets its own loop without a per-vertex branch.
+*/
+
+FORCE_INLINE void emit_cloud_point(float *points, long n, const int layout, float d, long col, long row,
+								   const float *rays, const uint8_t *rgb, long rgb_planes, long rgb_width, long rgb_scale)
+{
+	const float colscale = 1.f / 255.f;
+	const float *ray = rays + (row * CLOUD_WIDTH + col) * 2;
+	float x = ray[0] * d;
+	float y = ray[1] * d;
+	float u = (float)col * (1.f / CLOUD_WIDTH);
+	float v = (float)row * (1.f / CLOUD_HEIGHT);
+	
+	if(layout == CLOUD_FULL){
+		t_point3D *p = (t_point3D *)points + n;
+		p->x = x;
+		p->y = y;
+		p->z = d * -1.f;
+		p->tex_x = u;
+		p->tex_y = v;
+		p->nx = 0.f;
+		p->ny = 0.f;
+		p->nz = -1.f;
+		if(!rgb){
+			p->r = p->g = p->b = 1.f;
+		}
+		else if(rgb_planes == 3){
+			rgb += (row * rgb_width + col) * rgb_scale * 3;
+			p->r = (float)rgb[0] * colscale;
+			p->g = (float)rgb[1] * colscale;
+			p->b = (float)rgb[2] * colscale;
+		}
+		else{
+			p->r = p->g = p->b = (float)rgb[(row * rgb_width + col) * rgb_scale] * colscale;
+		}
+		p->a = 1.f;
+	}
+	else if(layout == CLOUD_COMPACT){
+		float *p = points + n * CLOUD_COMPACT_PLANES;
+		p[0] = x;
+		p[1] = y;
+		p[2] = d * -1.f;
+		p[3] = u;
+		p[4] = v;
+	}
+	else{
+		points[n] = x;
+		points[CLOUD_SIZE + n] = y;
+		points[CLOUD_SIZE * 2 + n] = d * -1.f;
+		points[CLOUD_SIZE * 3 + n] = u;
+		points[CLOUD_SIZE * 4 + n] = v;
+	}
+}
+
+FORCE_INLINE long build_strips(float *points, const t_cloud_source *source, const int layout){
+	long i,j;
+	long n = 0;
+	const uint16_t *top, *bottom;
+	float dt, db, pdt=0, pdb=0, dd;
+	float last_d = 0;
+	long last_col = 0, last_row = 0;
+	int have_prev, in_strip;
+	const uint16_t *depth = source->depth;
+	const float *lut = source->lut;
+	const uint8_t *rgb = source->rgb;
+	long rgb_planes = source->rgb_planes;
+	long rgb_width = source->rgb_width;
+	long rgb_scale = source->rgb_width / CLOUD_WIDTH;  //Colour pixel under each depth pixel, ignoring parallax
+	float threshold = source->threshold * source->threshold;
+	const float *rays = source->rays;
+	
+	for(i=0;i<(CLOUD_HEIGHT-1);i++){
+		top = depth + i * CLOUD_WIDTH;
+		bottom = top + CLOUD_WIDTH;
+		have_prev = 0;
+		in_strip = 0;
+		
+		for(j=0;j<CLOUD_WIDTH;j++){
+			if((top[j] == 0x7FF) || (bottom[j] == 0x7FF)){
+				have_prev = in_strip = 0;
+				continue;
+			}
+			dt = lut[top[j]];
+			db = lut[bottom[j]];
+			dd = dt - db;
+			if(dd*dd >= threshold){
+				have_prev = in_strip = 0;
+				continue;
+			}
+			
+			if(have_prev && ((dt-pdt)*(dt-pdt) < threshold) && ((db-pdb)*(db-pdb) < threshold)){
+				if(!in_strip){
+					//Open a strip on the previous column, joined to the last one by a degenerate pair
+					if(n){
+						emit_cloud_point(points, n++, layout, last_d, last_col, last_row, rays, rgb, rgb_planes, rgb_width, rgb_scale);
+						emit_cloud_point(points, n++, layout, pdt, j-1, i, rays, rgb, rgb_planes, rgb_width, rgb_scale);
+					}
+					emit_cloud_point(points, n++, layout, pdt, j-1, i, rays, rgb, rgb_planes, rgb_width, rgb_scale);
+					emit_cloud_point(points, n++, layout, pdb, j-1, i+1, rays, rgb, rgb_planes, rgb_width, rgb_scale);
+					in_strip = 1;
+				}
+				emit_cloud_point(points, n++, layout, dt, j, i, rays, rgb, rgb_planes, rgb_width, rgb_scale);
+				emit_cloud_point(points, n++, layout, db, j, i+1, rays, rgb, rgb_planes, rgb_width, rgb_scale);
+				last_d = db;
+				last_col = j;
+				last_row = i+1;
+			}
+			else{
+				in_strip = 0;
+			}
+			have_prev = 1;
+			pdt = dt;
+			pdb = db;
+		}
+	}
+	
+	if(!n){
+		//Jitter matrices cannot be empty
+		emit_cloud_point(points, n++, layout, 0.f, 0, 0, rays, NULL, 0, 0, 0);
+	}
+	
+	return n;
+}
+
+long cloud_build(t_cloud *cloud, const t_cloud_source *source, int layout){
+	switch(layout){
+		case CLOUD_COMPACT:
+			cloud->count = build_strips(cloud->points, source, CLOUD_COMPACT);
+			break;
+		case CLOUD_PLANES:
+			cloud->count = build_strips(cloud->points, source, CLOUD_PLANES);
+			break;
+		default:
+			cloud->count = build_strips(cloud->points, source, CLOUD_FULL);
+			break;
+	}
+	return cloud->count;
+}
@@ -0,0 +1,82 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth 
+ jmp@jmpelletier.com
+ 
+ This file is part of jit.freenect.grab.
+  
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ 
+ http://www.apache.org/licenses/LICENSE-2.0
+ 
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ 
+ */
+
+/*
+ Point cloud built from a depth frame as triangle strips, in one of three layouts. Plain C with
+ no Max or Jitter dependencies, jit.freenect.grab.c outputs the cloud as a matrix referencing it.
+*/
+
+#ifndef FREENECT_CLOUD_H
+#define FREENECT_CLOUD_H
+
+#include <stdint.h>
+
+#define CLOUD_WIDTH 640   //Depth frame the cloud is built from
+#define CLOUD_HEIGHT 480
+#define CLOUD_SIZE (CLOUD_WIDTH*3*(CLOUD_HEIGHT-1)) //Upper bound on strip vertices, see cloud_build
+#define CLOUD_COMPACT_PLANES 5  //x, y, z, tex_x, tex_y
+
+typedef struct _point3D{
+	float x;
+	float y;
+	float z;
+	float tex_x;
+	float tex_y;
+	float nx;
+	float ny;
+	float nz;
+	float r;
+	float g;
+	float b;
+	float a;
+} t_point3D;
+
+enum cloud_layout{
+	CLOUD_FULL,     //Interleaved t_point3D
+	CLOUD_COMPACT,  //Interleaved position and texture coordinates
+	CLOUD_PLANES    //Position and texture coordinates, one CLOUD_SIZE array per component
+};
+
+typedef struct _cloud{
+	float    *points;  //Sized for CLOUD_SIZE t_point3D, which holds any layout
+	uint32_t count;
+	uint32_t size;
+} t_cloud;
+
+//What a cloud is built from
+typedef struct _cloud_source{
+	const uint16_t *depth;      //Raw values of a whole frame
+	const float    *lut;        //Raw values to metres
+	const float    *rays;       //Undistorted x/z and -y/z per depth pixel
+	const uint8_t  *rgb;        //Colour of the full layout, NULL for white
+	long           rgb_planes;  //3 for RGB, 1 for IR
+	long           rgb_width;   //A multiple of CLOUD_WIDTH
+	float          threshold;   //Largest step in metres between neighbours joined by a triangle
+} t_cloud_source;
+
+//Allocate the points for CLOUD_SIZE vertices once, returns non-zero when out of memory
+int  cloud_allocate(t_cloud *cloud);
+
+void cloud_release(t_cloud *cloud);
+
+//Build the strips of a frame in a layout, sets and returns the vertex count
+long cloud_build(t_cloud *cloud, const t_cloud_source *source, int layout);
+
+#endif
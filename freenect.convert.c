@@ -0,0 +1,1899 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth 
+ jmp@jmpelletier.com
+ 
+ This file is part of jit.freenect.grab.
+  
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ 
+ http://www.apache.org/licenses/LICENSE-2.0
+ 
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ 
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "freenect.convert.h"
+
+#if defined(__SSE2__)
+#define USE_SSE2
+#include <emmintrin.h>
+#endif
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#define USE_SSSE3 //Compiled with function target attributes, only used if the CPU reports support
+#if !defined(CONVERT_NO_AVX2) //Leaves the SSE2 kernels selected, so tests reach them on any x86
+#define USE_AVX2
+#endif
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#define USE_NEON
+#include <arm_neon.h>
+#endif
+
+typedef long (*t_depth_kernel)(const uint16_t *in, void *out, long count, const t_convert_depth *conv);
+typedef long (*t_rgb_kernel)(const uint8_t *in, uint8_t *out, long count);
+typedef long (*t_unpack_kernel)(const uint8_t *in, uint16_t *out, long count, int bits);
+typedef long (*t_temporal_kernel)(const uint16_t *in, uint16_t *out, uint16_t *history, uint8_t *age, long count,
+								  const t_convert_temporal *temporal);
+typedef long (*t_sort_kernel)(uint16_t *const *lines, uint16_t *const *sorted, long count, int size);
+typedef long (*t_median_kernel)(uint16_t *const *sorted, uint16_t *out, long count, int size);
+typedef long (*t_mask_kernel)(const uint16_t *in, const uint16_t *background, uint8_t *out, long count);
+typedef long (*t_fold_kernel)(const uint16_t *in, uint16_t *fold, uint16_t *valid, long count);
+typedef long (*t_pool_kernel)(const uint16_t *fold, const uint16_t *valid, uint16_t *out, long count);
+
+//Whole millimetres for a raw value, 0 for no data. Computed in float with the same operations as
+//the mode 5 kernels, so tables and kernels agree exactly.
+static long raw_to_mm(long raw, float scale, float offset){
+	float z, mm;
+	
+	z = (float)raw * scale;
+	z = z + offset;
+	if((raw == 0x7FF) || !(z > 0.f)){
+		return 0;
+	}
+	mm = 1000.f / z;
+	if(!(mm <= (float)CONVERT_MM_MAX)){
+		return 0;
+	}
+	return lrintf(mm);
+}
+
+int convert_size(int type){
+	switch(type){
+		case CONVERT_CHAR: return 1;
+		case CONVERT_LONG: return sizeof(long);
+		case CONVERT_FLOAT32: return sizeof(float);
+		case CONVERT_FLOAT64: return sizeof(double);
+		default: return sizeof(uint16_t);
+	}
+}
+
+uint16_t convert_half(float f){
+	union {float f; uint32_t u;} v;
+	uint32_t sign, bits, mantissa, rest;
+	int exponent;
+	
+	v.f = f;
+	sign = (v.u >> 16) & 0x8000;
+	bits = v.u & 0x7FFFFFFF;
+	if(bits >= 0x7F800000){
+		return (uint16_t)(sign | 0x7C00 | ((bits > 0x7F800000) ? 0x200 : 0));  //Infinity, or a quiet NaN
+	}
+	exponent = (int)(bits >> 23) - 127 + 15;
+	if(exponent >= 31){
+		return (uint16_t)(sign | 0x7C00);  //Too large, infinity
+	}
+	if(exponent <= 0){
+		//Subnormal or zero: shift the mantissa with its implicit bit into place
+		if(exponent < -10){
+			return (uint16_t)sign;
+		}
+		mantissa = (bits & 0x7FFFFF) | 0x800000;
+		rest = mantissa & ((1u << (14 - exponent)) - 1);
+		mantissa >>= 14 - exponent;
+		if((rest > (1u << (13 - exponent))) || ((rest == (1u << (13 - exponent))) && (mantissa & 1))){
+			mantissa++;
+		}
+		return (uint16_t)(sign | mantissa);
+	}
+	//Rounding may carry into the exponent, up to infinity, which is what the hardware does
+	bits = ((uint32_t)exponent << 10) | ((bits >> 13) & 0x3FF);
+	rest = v.u & 0x1FFF;
+	if((rest > 0x1000) || ((rest == 0x1000) && (bits & 1))){
+		bits++;
+	}
+	return (uint16_t)(sign | bits);
+}
+
+int convert_lut(t_lookup *lut, int type, int mode, float scale, float offset){
+	long i;
+	
+	if((type == CONVERT_UINT16) || (type == CONVERT_FLOAT16)){
+		//Derived from the wider tables, so the 16-bit outputs follow them exactly
+		t_lookup wide = {NULL};
+		uint16_t *s_lut;
+		int err;
+		
+		if((type == CONVERT_UINT16) && ((mode == 3) || (mode == 4))){
+			return CONVERT_ERR_TYPE;
+		}
+		err = convert_lut(&wide, (type == CONVERT_UINT16) ? CONVERT_LONG : CONVERT_FLOAT32, mode, scale, offset);
+		if(err != CONVERT_ERR_NONE){
+			return err;
+		}
+		s_lut = (uint16_t *)realloc(lut->s_ptr, sizeof(uint16_t) * 0x800);
+		if(!s_lut){
+			free(wide.f_ptr);
+			return CONVERT_ERR_MEMORY;
+		}
+		lut->s_ptr = s_lut;
+		for(i=0;i<0x800;i++){
+			if(type == CONVERT_UINT16){
+				lut->s_ptr[i] = (uint16_t)((wide.l_ptr[i] < 0) ? 0 : ((wide.l_ptr[i] > 0xFFFF) ? 0xFFFF : wide.l_ptr[i]));
+			}
+			else{
+				lut->s_ptr[i] = convert_half(wide.f_ptr[i]);
+			}
+		}
+		free(wide.f_ptr);
+		return CONVERT_ERR_NONE;
+	}
+	
+	if(type == CONVERT_FLOAT32){
+		float *f_lut;
+		f_lut = (float *)realloc(lut->f_ptr, sizeof(float) * 0x800);
+		if(!f_lut){
+			return CONVERT_ERR_MEMORY;
+		}
+		lut->f_ptr = f_lut;
+		
+		switch(mode){
+			case 0:
+				for(i=0;i<0x800;i++){
+					lut->f_ptr[i] = (float)i;
+				}
+				break;
+			case 1:
+				for(i=0;i<0x800;i++){
+					lut->f_ptr[i] = (float)i * (1.f / (float)0x7FF);
+				}
+				break;
+			case 2:
+				for(i=0;i<0x800;i++){
+					lut->f_ptr[i] = 1.f - ((float)i * (1.f / (float)0x7FF));
+				}
+				break;
+			case 3:
+			case 4:
+				for(i=0;i<0x800;i++){
+					lut->f_ptr[i] = 10.f / (3.33f + (float)i * -0.00307f);
+				} 
+				break;
+			case 5:
+				for(i=0;i<0x800;i++){
+					lut->f_ptr[i] = (float)raw_to_mm(i, scale, offset);
+				}
+				break;
+		}
+	}
+	else if(type == CONVERT_LONG){
+		long *l_lut;
+		l_lut = (long *)realloc(lut->l_ptr, sizeof(long) * 0x800);
+		if(!l_lut){
+			return CONVERT_ERR_MEMORY;
+		}
+		lut->l_ptr = l_lut;
+		
+		switch(mode){
+			case 0:
+			case 1:
+				for(i=0;i<0x800;i++){
+					lut->l_ptr[i] = i;
+				}
+				break;
+			case 2:
+				for(i=0;i<0x800;i++){
+					lut->l_ptr[i] = 0x7FF - i;
+				}
+				break;
+			case 3:
+				for(i=0;i<0x800;i++){
+					lut->l_ptr[i] = (long)(-10.f / (3.33f + (float)i * -0.00307f));
+				} 
+				break;
+			case 4:
+				for(i=0;i<0x800;i++){
+					lut->l_ptr[i] = (long)(-10.f / (3.33f + (float)i * -0.00307f));
+				} 
+				break;
+			case 5:
+				for(i=0;i<0x800;i++){
+					lut->l_ptr[i] = raw_to_mm(i, scale, offset);
+				}
+				break;
+		}
+	}
+	else if(type == CONVERT_FLOAT64){
+		double *d_lut;
+		d_lut = (double *)realloc(lut->d_ptr, sizeof(double) * 0x800);
+		if(!d_lut){
+			return CONVERT_ERR_MEMORY;
+		}
+		lut->d_ptr = d_lut;
+		
+		switch(mode){
+			case 0:
+				for(i=0;i<0x800;i++){
+					lut->d_ptr[i] = (double)i;
+				}
+				break;
+			case 1:
+				for(i=0;i<0x800;i++){
+					lut->d_ptr[i] = (double)i * (1.0 / (double)0x7FF);
+				}
+				break;
+			case 2:
+				for(i=0;i<0x800;i++){
+					lut->d_ptr[i] = 1.0 - ((double)i * (1.0 / (double)0x7FF));
+				}
+				break;
+			case 3:
+				for(i=0;i<0x800;i++){
+					lut->d_ptr[i] = -10.0 / (3.33 + (double)i * -0.00307);
+				} 
+				break;
+			case 4:
+				for(i=0;i<0x800;i++){
+					lut->d_ptr[i] = -10.0 / (3.33 + (double)i * -0.00307);
+				} 
+				break;
+			case 5:
+				for(i=0;i<0x800;i++){
+					lut->d_ptr[i] = (double)raw_to_mm(i, scale, offset);
+				}
+				break;
+		}
+	}
+	else if(type == CONVERT_NONE){
+		if(lut->f_ptr){
+			free(lut->f_ptr);
+			lut->f_ptr = NULL;
+		}
+	}
+	else{
+		return CONVERT_ERR_TYPE;
+	}
+	return CONVERT_ERR_NONE;
+}
+
+/*
+ Vectorised depth conversion. Modes 0-2 are linear in the raw value and are computed
+ arithmetically, using the same operations as calculate_lut so results are bit-exact.
+ Mode 3 float32 uses a refined reciprocal estimate and matches the table to within
+ CONVERT_RCP_TOLERANCE.
+ Mode 5 divides and rounds exactly like raw_to_mm. It is only computed with AVX2, narrower
+ divisions are slower than the table. Half floats are the float32 kernel's values converted with
+ F16C or NEON, rounding like convert_half.
+ Each kernel converts as many leading pixels as its vector width allows and returns that
+ count, depth_span runs the rest of the row through it from a padded block. The lookup table
+ remains the reference, and converts the modes a kernel does not handle.
+*/
+
+static long depth_kernel_none(const uint16_t *in, void *out, long count, const t_convert_depth *conv){
+	(void)in; (void)out; (void)count; (void)conv;
+	return 0;
+}
+
+static t_depth_kernel depth_kernel_float32 = depth_kernel_none;
+static t_depth_kernel depth_kernel_float64 = depth_kernel_none;
+static t_depth_kernel depth_kernel_long = depth_kernel_none;
+static t_depth_kernel depth_kernel_uint16 = depth_kernel_none;
+static t_depth_kernel depth_kernel_float16 = depth_kernel_none;
+
+#if defined(USE_SSE2)
+static long depth_kernel_float32_sse2(const uint16_t *in, void *out, long count, const t_convert_depth *conv){
+	float *f = (float *)out;
+	int mode = conv->mode;
+	const __m128i zero = _mm_setzero_si128();
+	__m128 scale, offset, num;
+	__m128i raw;
+	__m128 lo, hi;
+	long j;
+	
+	switch(mode){
+		case 0: scale = _mm_set1_ps(1.f); offset = _mm_setzero_ps(); break;
+		case 1: scale = _mm_set1_ps(1.f / (float)0x7FF); offset = _mm_setzero_ps(); break;
+		case 2: scale = _mm_set1_ps(-(1.f / (float)0x7FF)); offset = _mm_set1_ps(1.f); break;
+		case 3: scale = _mm_set1_ps(-0.00307f); offset = _mm_set1_ps(3.33f); break;
+		default: return 0;
+	}
+	num = _mm_set1_ps(10.f);
+	
+	for(j=0;j+8<=count;j+=8){
+		raw = _mm_loadu_si128((const __m128i *)(in + j));
+		lo = _mm_add_ps(offset, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(raw, zero)), scale));
+		hi = _mm_add_ps(offset, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(raw, zero)), scale));
+		if(mode == 3){
+			//10/d with one Newton-Raphson step on the reciprocal estimate: r' = r * (2 - d*r)
+			__m128 rlo = _mm_rcp_ps(lo);
+			__m128 rhi = _mm_rcp_ps(hi);
+			rlo = _mm_sub_ps(_mm_add_ps(rlo, rlo), _mm_mul_ps(lo, _mm_mul_ps(rlo, rlo)));
+			rhi = _mm_sub_ps(_mm_add_ps(rhi, rhi), _mm_mul_ps(hi, _mm_mul_ps(rhi, rhi)));
+			lo = _mm_mul_ps(num, rlo);
+			hi = _mm_mul_ps(num, rhi);
+		}
+		_mm_storeu_ps(f + j, lo);
+		_mm_storeu_ps(f + j + 4, hi);
+	}
+	return j;
+}
+
+static long depth_kernel_float64_sse2(const uint16_t *in, void *out, long count, const t_convert_depth *conv){
+	double *d = (double *)out;
+	const __m128i zero = _mm_setzero_si128();
+	__m128d scale, offset;
+	__m128i raw, wide;
+	long j;
+	int mode = conv->mode;
+	
+	switch(mode){
+		case 0: scale = _mm_set1_pd(1.0); offset = _mm_setzero_pd(); break;
+		case 1: scale = _mm_set1_pd(1.0 / (double)0x7FF); offset = _mm_setzero_pd(); break;
+		case 2: scale = _mm_set1_pd(-(1.0 / (double)0x7FF)); offset = _mm_set1_pd(1.0); break;
+		default: return 0;
+	}
+	
+	for(j=0;j+4<=count;j+=4){
+		raw = _mm_loadl_epi64((const __m128i *)(in + j));
+		wide = _mm_unpacklo_epi16(raw, zero);
+		_mm_storeu_pd(d + j, _mm_add_pd(offset, _mm_mul_pd(_mm_cvtepi32_pd(wide), scale)));
+		_mm_storeu_pd(d + j + 2, _mm_add_pd(offset, _mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(wide, 8)), scale)));
+	}
+	return j;
+}
+
+static long depth_kernel_long_sse2(const uint16_t *in, void *out, long count, const t_convert_depth *conv){
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i max = _mm_set1_epi16(0x7FF);
+	__m128i raw, lo, hi;
+	long j;
+	int mode = conv->mode;
+	
+	if(mode > 2){
+		return 0;
+	}
+	
+	for(j=0;j+8<=count;j+=8){
+		raw = _mm_loadu_si128((const __m128i *)(in + j));
+		if(mode == 2){
+			raw = _mm_sub_epi16(max, raw);
+		}
+		lo = _mm_unpacklo_epi16(raw, zero);
+		hi = _mm_unpackhi_epi16(raw, zero);
+		if(sizeof(long) == 4){
+			_mm_storeu_si128((__m128i *)((int32_t *)out + j), lo);
+			_mm_storeu_si128((__m128i *)((int32_t *)out + j + 4), hi);
+		}
+		else{
+			_mm_storeu_si128((__m128i *)((int64_t *)out + j), _mm_unpacklo_epi32(lo, zero));
+			_mm_storeu_si128((__m128i *)((int64_t *)out + j + 2), _mm_unpackhi_epi32(lo, zero));
+			_mm_storeu_si128((__m128i *)((int64_t *)out + j + 4), _mm_unpacklo_epi32(hi, zero));
+			_mm_storeu_si128((__m128i *)((int64_t *)out + j + 6), _mm_unpackhi_epi32(hi, zero));
+		}
+	}
+	return j;
+}
+
+static long depth_kernel_uint16_sse2(const uint16_t *in, void *out, long count, const t_convert_depth *conv){
+	const __m128i max = _mm_set1_epi16(0x7FF);
+	__m128i raw;
+	long j;
+	int mode = conv->mode;
+	
+	if(mode > 2){
+		return 0;
+	}
+	
+	for(j=0;j+8<=count;j+=8){
+		raw = _mm_loadu_si128((const __m128i *)(in + j));
+		if(mode == 2){
+			raw = _mm_sub_epi16(max, raw);
+		}
+		_mm_storeu_si128((__m128i *)((uint16_t *)out + j), raw);
+	}
+	return j;
+}
+#endif
+
+#if defined(USE_AVX2)
+//Eight raw values to whole millimetres, 0 where raw_to_mm gives 0
+__attribute__((target("avx2")))
+static __inline__ __m256i mm_avx2(__m256i raw, __m256 scale, __m256 offset){
+	__m256 z = _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(raw), scale), offset);
+	__m256 mm = _mm256_div_ps(_mm256_set1_ps(1000.f), z);
+	__m256 valid = _mm256_and_ps(_mm256_cmp_ps(z, _mm256_setzero_ps(), _CMP_GT_OQ),
+								 _mm256_cmp_ps(mm, _mm256_set1_ps((float)CONVERT_MM_MAX), _CMP_LE_OQ));
+	
+	valid = _mm256_andnot_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(raw, _mm256_set1_epi32(0x7FF))), valid);
+	return _mm256_and_si256(_mm256_cvtps_epi32(mm), _mm256_castps_si256(valid));
+}
+
+//Scale and offset of the float32 output of a mode, 0 for modes without a kernel
+__attribute__((target("avx2")))
+static __inline__ int float_params_avx2(const t_convert_depth *conv, __m256 *scale, __m256 *offset){
+	switch(conv->mode){
+		case 0: *scale = _mm256_set1_ps(1.f); *offset = _mm256_setzero_ps(); return 1;
+		case 1: *scale = _mm256_set1_ps(1.f / (float)0x7FF); *offset = _mm256_setzero_ps(); return 1;
+		case 2: *scale = _mm256_set1_ps(-(1.f / (float)0x7FF)); *offset = _mm256_set1_ps(1.f); return 1;
+		case 3: *scale = _mm256_set1_ps(-0.00307f); *offset = _mm256_set1_ps(3.33f); return 1;
+		case 5: *scale = _mm256_set1_ps(conv->scale); *offset = _mm256_set1_ps(conv->offset); return 1;
+		default: return 0;
+	}
+}
+
+//float32 output of eight raw values
+__attribute__((target("avx2")))
+static __inline__ __m256 float_avx2(const uint16_t *in, int mode, __m256 scale, __m256 offset){
+	__m256i raw = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)in));
+	__m256 v, r;
+	
+	if(mode == 5){
+		return _mm256_cvtepi32_ps(mm_avx2(raw, scale, offset));
+	}
+	v = _mm256_add_ps(offset, _mm256_mul_ps(_mm256_cvtepi32_ps(raw), scale));
+	if(mode == 3){
+		r = _mm256_rcp_ps(v);
+		r = _mm256_sub_ps(_mm256_add_ps(r, r), _mm256_mul_ps(v, _mm256_mul_ps(r, r)));
+		v = _mm256_mul_ps(_mm256_set1_ps(10.f), r);
+	}
+	return v;
+}
+
+__attribute__((target("avx2")))
+static long depth_kernel_float32_avx2(const uint16_t *in, void *out, long count, const t_convert_depth *conv){
+	float *f = (float *)out;
+	__m256 scale, offset;
+	long j;
+	int mode = conv->mode;
+	
+	if(!float_params_avx2(conv, &scale, &offset)){
+		return 0;
+	}
+	for(j=0;j+8<=count;j+=8){
+		_mm256_storeu_ps(f + j, float_avx2(in + j, mode, scale, offset));
+	}
+	return j;
+}
+
+__attribute__((target("avx2")))
+static long depth_kernel_float64_avx2(const uint16_t *in, void *out, long count, const t_convert_depth *conv){
+	double *d = (double *)out;
+	__m256d scale, offset;
+	__m128i wide;
+	long j;
+	int mode = conv->mode;
+	
+	if(mode == 5){
+		__m256 mm_scale = _mm256_set1_ps(conv->scale);
+		__m256 mm_offset = _mm256_set1_ps(conv->offset);
+		__m256i mm;
+		for(j=0;j+8<=count;j+=8){
+			mm = mm_avx2(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(in + j))), mm_scale, mm_offset);
+			_mm256_storeu_pd(d + j, _mm256_cvtepi32_pd(_mm256_castsi256_si128(mm)));
+			_mm256_storeu_pd(d + j + 4, _mm256_cvtepi32_pd(_mm256_extracti128_si256(mm, 1)));
+		}
+		return j;
+	}
+	
+	switch(mode){
+		case 0: scale = _mm256_set1_pd(1.0); offset = _mm256_setzero_pd(); break;
+		case 1: scale = _mm256_set1_pd(1.0 / (double)0x7FF); offset = _mm256_setzero_pd(); break;
+		case 2: scale = _mm256_set1_pd(-(1.0 / (double)0x7FF)); offset = _mm256_set1_pd(1.0); break;
+		default: return 0;
+	}
+	
+	for(j=0;j+4<=count;j+=4){
+		wide = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)(in + j)));
+		_mm256_storeu_pd(d + j, _mm256_add_pd(offset, _mm256_mul_pd(_mm256_cvtepi32_pd(wide), scale)));
+	}
+	return j;
+}
+
+__attribute__((target("avx2")))
+static long depth_kernel_long_avx2(const uint16_t *in, void *out, long count, const t_convert_depth *conv){
+	__m256 scale = _mm256_set1_ps(conv->scale);
+	__m256 offset = _mm256_set1_ps(conv->offset);
+	__m256i mm;
+	long j;
+	
+	if(conv->mode != 5){
+		return depth_kernel_long_sse2(in, out, count, conv);
+	}
+	
+	for(j=0;j+8<=count;j+=8){
+		mm = mm_avx2(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(in + j))), scale, offset);
+		if(sizeof(long) == 4){
+			_mm256_storeu_si256((__m256i *)((int32_t *)out + j), mm);
+		}
+		else{
+			_mm256_storeu_si256((__m256i *)((int64_t *)out + j), _mm256_cvtepu32_epi64(_mm256_castsi256_si128(mm)));
+			_mm256_storeu_si256((__m256i *)((int64_t *)out + j + 4), _mm256_cvtepu32_epi64(_mm256_extracti128_si256(mm, 1)));
+		}
+	}
+	return j;
+}
+
+__attribute__((target("avx2")))
+static long depth_kernel_uint16_avx2(const uint16_t *in, void *out, long count, const t_convert_depth *conv){
+	__m256 scale = _mm256_set1_ps(conv->scale);
+	__m256 offset = _mm256_set1_ps(conv->offset);
+	__m256i mm;
+	long j;
+	
+	if(conv->mode != 5){
+		return depth_kernel_uint16_sse2(in, out, count, conv);
+	}
+	
+	for(j=0;j+8<=count;j+=8){
+		mm = mm_avx2(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(in + j))), scale, offset);
+		_mm_storeu_si128((__m128i *)((uint16_t *)out + j), _mm_packus_epi32(_mm256_castsi256_si128(mm), _mm256_extracti128_si256(mm, 1)));
+	}
+	return j;
+}
+
+__attribute__((target("avx2,f16c")))
+static long depth_kernel_float16_f16c(const uint16_t *in, void *out, long count, const t_convert_depth *conv){
+	__m256 scale, offset;
+	long j;
+	int mode = conv->mode;
+	
+	if(!float_params_avx2(conv, &scale, &offset)){
+		return 0;
+	}
+	for(j=0;j+8<=count;j+=8){
+		_mm_storeu_si128((__m128i *)((uint16_t *)out + j), _mm256_cvtps_ph(float_avx2(in + j, mode, scale, offset), _MM_FROUND_TO_NEAREST_INT));
+	}
+	return j;
+}
+#endif
+
+#if defined(USE_NEON)
+static long depth_kernel_float32_neon(const uint16_t *in, void *out, long count, const t_convert_depth *conv){
+	float *f = (float *)out;
+	float32x4_t scale, offset, num, lo, hi, rlo, rhi;
+	uint16x8_t raw;
+	long j;
+	int mode = conv->mode;
+	
+	switch(mode){
+		case 0: scale = vdupq_n_f32(1.f); offset = vdupq_n_f32(0.f); break;
+		case 1: scale = vdupq_n_f32(1.f / (float)0x7FF); offset = vdupq_n_f32(0.f); break;
+		case 2: scale = vdupq_n_f32(-(1.f / (float)0x7FF)); offset = vdupq_n_f32(1.f); break;
+		case 3: scale = vdupq_n_f32(-0.00307f); offset = vdupq_n_f32(3.33f); break;
+		default: return 0;
+	}
+	num = vdupq_n_f32(10.f);
+	
+	for(j=0;j+8<=count;j+=8){
+		raw = vld1q_u16(in + j);
+		lo = vaddq_f32(offset, vmulq_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(raw))), scale));
+		hi = vaddq_f32(offset, vmulq_f32(vcvtq_f32_u32(vmovl_u16(vget_high_u16(raw))), scale));
+		if(mode == 3){
+			//The NEON estimate is only 8 bits, two refinement steps bring it to float precision
+			rlo = vrecpeq_f32(lo);
+			rhi = vrecpeq_f32(hi);
+			rlo = vmulq_f32(rlo, vrecpsq_f32(lo, rlo));
+			rhi = vmulq_f32(rhi, vrecpsq_f32(hi, rhi));
+			rlo = vmulq_f32(rlo, vrecpsq_f32(lo, rlo));
+			rhi = vmulq_f32(rhi, vrecpsq_f32(hi, rhi));
+			lo = vmulq_f32(num, rlo);
+			hi = vmulq_f32(num, rhi);
+		}
+		vst1q_f32(f + j, lo);
+		vst1q_f32(f + j + 4, hi);
+	}
+	return j;
+}
+
+static long depth_kernel_uint16_neon(const uint16_t *in, void *out, long count, const t_convert_depth *conv){
+	const uint16x8_t max = vdupq_n_u16(0x7FF);
+	uint16x8_t raw;
+	long j;
+	int mode = conv->mode;
+	
+	if(mode > 2){
+		return 0;
+	}
+	
+	for(j=0;j+8<=count;j+=8){
+		raw = vld1q_u16(in + j);
+		if(mode == 2){
+			raw = vsubq_u16(max, raw);
+		}
+		vst1q_u16((uint16_t *)out + j, raw);
+	}
+	return j;
+}
+
+#if defined(__aarch64__)
+static long depth_kernel_float16_neon(const uint16_t *in, void *out, long count, const t_convert_depth *conv){
+	float block[64];
+	long j, k, n;
+	
+	for(j=0;j+8<=count;j+=n){
+		n = (count - j < 64) ? (count - j) & ~7 : 64;
+		if(depth_kernel_float32(in + j, block, n, conv) < n){
+			break;
+		}
+		for(k=0;k<n;k+=4){
+			vst1_u16((uint16_t *)out + j + k, vreinterpret_u16_f16(vcvt_f16_f32(vld1q_f32(block + k))));
+		}
+	}
+	return j;
+}
+#endif
+#endif
+
+/*
+ RGB24 to ARGB32 expansion. Kernels return how many pixels they converted, copy_rgb_data
+ finishes the row with the scalar loop.
+*/
+
+static long rgb_kernel_none(const uint8_t *in, uint8_t *out, long count){
+	(void)in; (void)out; (void)count;
+	return 0;
+}
+
+static t_rgb_kernel rgb_kernel_argb = rgb_kernel_none;
+
+#if defined(USE_SSSE3)
+__attribute__((target("ssse3")))
+static long rgb_kernel_argb_ssse3(const uint8_t *in, uint8_t *out, long count){
+	const __m128i mask = _mm_setr_epi8(-1,0,1,2, -1,3,4,5, -1,6,7,8, -1,9,10,11);
+	const __m128i alpha = _mm_set1_epi32(0xFF);
+	__m128i a, b, c;
+	long j;
+	
+	//16 pixels per iteration: 48 bytes in, 64 bytes out, without reading past the last pixel
+	for(j=0;j+16<=count;j+=16){
+		a = _mm_loadu_si128((const __m128i *)(in));
+		b = _mm_loadu_si128((const __m128i *)(in + 16));
+		c = _mm_loadu_si128((const __m128i *)(in + 32));
+		_mm_storeu_si128((__m128i *)(out), _mm_or_si128(_mm_shuffle_epi8(a, mask), alpha));
+		_mm_storeu_si128((__m128i *)(out + 16), _mm_or_si128(_mm_shuffle_epi8(_mm_alignr_epi8(b, a, 12), mask), alpha));
+		_mm_storeu_si128((__m128i *)(out + 32), _mm_or_si128(_mm_shuffle_epi8(_mm_alignr_epi8(c, b, 8), mask), alpha));
+		_mm_storeu_si128((__m128i *)(out + 48), _mm_or_si128(_mm_shuffle_epi8(_mm_srli_si128(c, 4), mask), alpha));
+		in += 48;
+		out += 64;
+	}
+	return j;
+}
+#endif
+
+#if defined(USE_AVX2)
+__attribute__((target("avx2")))
+static long rgb_kernel_argb_avx2(const uint8_t *in, uint8_t *out, long count){
+	const __m256i mask = _mm256_setr_epi8(-1,0,1,2, -1,3,4,5, -1,6,7,8, -1,9,10,11,
+										  -1,0,1,2, -1,3,4,5, -1,6,7,8, -1,9,10,11);
+	const __m256i alpha = _mm256_set1_epi32(0xFF);
+	__m256i v;
+	long j;
+	
+	//8 pixels per iteration, each lane loads 16 bytes for 4 pixels so stop before the last 2 pixels
+	for(j=0;j+10<=count;j+=8){
+		v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)in)),
+									_mm_loadu_si128((const __m128i *)(in + 12)), 1);
+		_mm256_storeu_si256((__m256i *)out, _mm256_or_si256(_mm256_shuffle_epi8(v, mask), alpha));
+		in += 24;
+		out += 32;
+	}
+	return j;
+}
+#endif
+
+#if defined(USE_NEON)
+static long rgb_kernel_argb_neon(const uint8_t *in, uint8_t *out, long count){
+	uint8x16x3_t rgb;
+	uint8x16x4_t argb;
+	long j;
+	
+	argb.val[0] = vdupq_n_u8(0xFF);
+	for(j=0;j+16<=count;j+=16){
+		rgb = vld3q_u8(in);
+		argb.val[1] = rgb.val[0];
+		argb.val[2] = rgb.val[1];
+		argb.val[3] = rgb.val[2];
+		vst4q_u8(out, argb);
+		in += 48;
+		out += 64;
+	}
+	return j;
+}
+#endif
+
+/*
+ Packed depth, values of 10 or 11 bits stored most significant bit first (libfreenect's
+ FREENECT_DEPTH_11BIT_PACKED and FREENECT_DEPTH_10BIT_PACKED). Eight values always take a whole
+ number of bytes. Each value is rebuilt from the two 16-bit big-endian words at its first byte:
+ (hi << o | lo >> (16 - o)) >> (16 - bits), o being the value's bit offset in that byte. The
+ kernels return how many values they unpacked, unpack_depth finishes with the scalar loop.
+ 10-bit values are the same disparity at half the resolution. They are doubled into the 11-bit
+ range, and their hole 0x3FF becomes 0x7FF, so the tables, filters and everything reading raw
+ values downstream handle one domain: 2v | (v == 0x3FF).
+*/
+
+static long unpack_kernel_none(const uint8_t *in, uint16_t *out, long count, int bits){
+	(void)in; (void)out; (void)count; (void)bits;
+	return 0;
+}
+
+static t_unpack_kernel unpack_kernel = unpack_kernel_none;
+
+#if defined(USE_SSSE3)
+__attribute__((target("ssse3")))
+static long unpack_kernel_ssse3(const uint8_t *in, uint16_t *out, long count, int bits){
+	int8_t hi_idx[16], lo_idx[16];
+	int16_t mul[8];
+	__m128i hi_mask, lo_mask, shift_mul, v, hi, lo, raw;
+	__m128i shift = _mm_cvtsi32_si128(16 - bits);
+	const __m128i hole10 = _mm_set1_epi16(0x3FF);
+	long j, k;
+	
+	for(k=0;k<8;k++){
+		long byte = (k * bits) >> 3;
+		hi_idx[k*2] = byte + 1;
+		hi_idx[k*2+1] = byte;
+		lo_idx[k*2] = byte + 3;
+		lo_idx[k*2+1] = byte + 2;
+		mul[k] = 1 << ((k * bits) & 7);
+	}
+	hi_mask = _mm_loadu_si128((const __m128i *)hi_idx);
+	lo_mask = _mm_loadu_si128((const __m128i *)lo_idx);
+	shift_mul = _mm_loadu_si128((const __m128i *)mul);
+	
+	//8 values per iteration from a 16 byte load, stop while the load still ends inside the input
+	for(j=0;(j+8<=count)&&((count-j)*bits>=128);j+=8){
+		v = _mm_loadu_si128((const __m128i *)in);
+		hi = _mm_mullo_epi16(_mm_shuffle_epi8(v, hi_mask), shift_mul);
+		lo = _mm_mulhi_epu16(_mm_shuffle_epi8(v, lo_mask), shift_mul);
+		raw = _mm_srl_epi16(_mm_or_si128(hi, lo), shift);
+		if(bits == 10){
+			raw = _mm_or_si128(_mm_slli_epi16(raw, 1), _mm_srli_epi16(_mm_cmpeq_epi16(raw, hole10), 15));
+		}
+		_mm_storeu_si128((__m128i *)(out + j), raw);
+		in += bits;
+	}
+	return j;
+}
+#endif
+
+#if defined(USE_NEON) && defined(__aarch64__)
+static long unpack_kernel_neon(const uint8_t *in, uint16_t *out, long count, int bits){
+	uint8_t hi_idx[16], lo_idx[16];
+	int16_t left[8], right[8];
+	uint8x16_t hi_mask, lo_mask, v;
+	int16x8_t hi_shift, lo_shift;
+	int16x8_t shift = vdupq_n_s16(bits - 16);
+	const uint16x8_t hole10 = vdupq_n_u16(0x3FF);
+	uint16x8_t hi, lo, raw;
+	long j, k;
+	
+	for(k=0;k<8;k++){
+		long byte = (k * bits) >> 3;
+		hi_idx[k*2] = byte + 1;
+		hi_idx[k*2+1] = byte;
+		lo_idx[k*2] = byte + 3;
+		lo_idx[k*2+1] = byte + 2;
+		left[k] = (k * bits) & 7;
+		right[k] = left[k] - 16;  //Shifting right by 16 gives 0, as needed when o is 0
+	}
+	hi_mask = vld1q_u8(hi_idx);
+	lo_mask = vld1q_u8(lo_idx);
+	hi_shift = vld1q_s16(left);
+	lo_shift = vld1q_s16(right);
+	
+	for(j=0;(j+8<=count)&&((count-j)*bits>=128);j+=8){
+		v = vld1q_u8(in);
+		hi = vshlq_u16(vreinterpretq_u16_u8(vqtbl1q_u8(v, hi_mask)), hi_shift);
+		lo = vshlq_u16(vreinterpretq_u16_u8(vqtbl1q_u8(v, lo_mask)), lo_shift);
+		raw = vshlq_u16(vorrq_u16(hi, lo), shift);
+		if(bits == 10){
+			raw = vorrq_u16(vshlq_n_u16(raw, 1), vshrq_n_u16(vceqq_u16(raw, hole10), 15));
+		}
+		vst1q_u16(out + j, raw);
+		in += bits;
+	}
+	return j;
+}
+#endif
+
+static void unpack_depth(const uint8_t *in, uint16_t *out, long count, int bits){
+	uint32_t buffer = 0;
+	uint32_t mask = (1 << bits) - 1;
+	uint32_t v;
+	int nbits = 0;
+	long j;
+	
+	j = unpack_kernel(in, out, count, bits);
+	in += j * bits / 8;
+	for(;j<count;j++){
+		while(nbits < bits){
+			buffer = (buffer << 8) | *in++;
+			nbits += 8;
+		}
+		nbits -= bits;
+		v = (buffer >> nbits) & mask;
+		out[j] = (bits == 10) ? (uint16_t)((v << 1) | (v == 0x3FF)) : (uint16_t)v;
+	}
+}
+
+void convert_unpack_depth(const uint8_t *in, uint16_t *out, long count, int bits){
+	unpack_depth(in, out, count, bits);
+}
+
+/*
+ Temporal filter, see t_convert_temporal. Integer arithmetic throughout so the kernels and the
+ scalar loop agree exactly. The blend h * (256 - w) + 16v * w stays within 24 bits.
+*/
+
+static long temporal_kernel_none(const uint16_t *in, uint16_t *out, uint16_t *history, uint8_t *age, long count,
+								 const t_convert_temporal *temporal){
+	(void)in; (void)out; (void)history; (void)age; (void)count; (void)temporal;
+	return 0;
+}
+
+static t_temporal_kernel temporal_kernel = temporal_kernel_none;
+
+#if defined(USE_SSE2)
+static long temporal_kernel_sse2(const uint16_t *in, uint16_t *out, uint16_t *history, uint8_t *age, long count,
+								 const t_convert_temporal *temporal){
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i invalid_raw = _mm_set1_epi16(0x7FF);
+	const __m128i none_value = _mm_set1_epi16((short)CONVERT_NO_HISTORY);
+	const __m128i full = _mm_set1_epi16(256);
+	const __m128i alpha = _mm_set1_epi16(temporal->alpha);
+	const __m128i gain = _mm_set1_epi16((short)temporal->gain);
+	const __m128i hold = _mm_set1_epi16(temporal->hold);
+	const __m128i round = _mm_set1_epi32(128);
+	__m128i d, h, a, d16, w, iw, lo, hi, blend, invalid, none, held, hist;
+	long j;
+	
+	for(j=0;j+8<=count;j+=8){
+		d = _mm_loadu_si128((const __m128i *)(in + j));
+		h = _mm_loadu_si128((const __m128i *)(history + j));
+		a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(age + j)), zero);
+		invalid = _mm_cmpeq_epi16(d, invalid_raw);
+		none = _mm_cmpeq_epi16(h, none_value);
+		
+		//Weight of the new value, min(256, alpha + |16d - h| * gain >> 16)
+		d16 = _mm_slli_epi16(d, 4);
+		w = _mm_or_si128(_mm_subs_epu16(d16, h), _mm_subs_epu16(h, d16));
+		w = _mm_adds_epu16(alpha, _mm_mulhi_epu16(w, gain));
+		w = _mm_sub_epi16(w, _mm_subs_epu16(w, full));
+		iw = _mm_sub_epi16(full, w);
+		lo = _mm_madd_epi16(_mm_unpacklo_epi16(h, d16), _mm_unpacklo_epi16(iw, w));
+		hi = _mm_madd_epi16(_mm_unpackhi_epi16(h, d16), _mm_unpackhi_epi16(iw, w));
+		blend = _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(lo, round), 8), _mm_srai_epi32(_mm_add_epi32(hi, round), 8));
+		blend = _mm_or_si128(_mm_and_si128(none, d16), _mm_andnot_si128(none, blend));
+		
+		//Invalid pixels keep their history while held and lose it after
+		held = _mm_andnot_si128(none, _mm_cmplt_epi16(a, hold));
+		hist = _mm_or_si128(_mm_and_si128(held, h), _mm_andnot_si128(held, none_value));
+		hist = _mm_or_si128(_mm_and_si128(invalid, hist), _mm_andnot_si128(invalid, blend));
+		a = _mm_and_si128(invalid, _mm_sub_epi16(a, held));
+		
+		_mm_storeu_si128((__m128i *)(history + j), hist);
+		_mm_storel_epi64((__m128i *)(age + j), _mm_packus_epi16(a, zero));
+		_mm_storeu_si128((__m128i *)(out + j), _mm_or_si128(_mm_and_si128(_mm_cmpeq_epi16(hist, none_value), invalid_raw),
+			_mm_andnot_si128(_mm_cmpeq_epi16(hist, none_value), _mm_srli_epi16(_mm_add_epi16(hist, _mm_set1_epi16(8)), 4))));
+	}
+	return j;
+}
+#endif
+
+#if defined(USE_AVX2)
+__attribute__((target("avx2")))
+static long temporal_kernel_avx2(const uint16_t *in, uint16_t *out, uint16_t *history, uint8_t *age, long count,
+								 const t_convert_temporal *temporal){
+	const __m256i invalid_raw = _mm256_set1_epi16(0x7FF);
+	const __m256i none_value = _mm256_set1_epi16((short)CONVERT_NO_HISTORY);
+	const __m256i full = _mm256_set1_epi16(256);
+	const __m256i alpha = _mm256_set1_epi16(temporal->alpha);
+	const __m256i gain = _mm256_set1_epi16((short)temporal->gain);
+	const __m256i hold = _mm256_set1_epi16(temporal->hold);
+	const __m256i round = _mm256_set1_epi32(128);
+	__m256i d, h, a, d16, w, iw, lo, hi, blend, invalid, none, held, hist;
+	long j;
+	
+	for(j=0;j+16<=count;j+=16){
+		d = _mm256_loadu_si256((const __m256i *)(in + j));
+		h = _mm256_loadu_si256((const __m256i *)(history + j));
+		a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(age + j)));
+		invalid = _mm256_cmpeq_epi16(d, invalid_raw);
+		none = _mm256_cmpeq_epi16(h, none_value);
+		
+		d16 = _mm256_slli_epi16(d, 4);
+		w = _mm256_or_si256(_mm256_subs_epu16(d16, h), _mm256_subs_epu16(h, d16));
+		w = _mm256_min_epu16(_mm256_adds_epu16(alpha, _mm256_mulhi_epu16(w, gain)), full);
+		iw = _mm256_sub_epi16(full, w);
+		lo = _mm256_madd_epi16(_mm256_unpacklo_epi16(h, d16), _mm256_unpacklo_epi16(iw, w));
+		hi = _mm256_madd_epi16(_mm256_unpackhi_epi16(h, d16), _mm256_unpackhi_epi16(iw, w));
+		blend = _mm256_packs_epi32(_mm256_srai_epi32(_mm256_add_epi32(lo, round), 8), _mm256_srai_epi32(_mm256_add_epi32(hi, round), 8));
+		blend = _mm256_blendv_epi8(blend, d16, none);
+		
+		held = _mm256_andnot_si256(none, _mm256_cmpgt_epi16(hold, a));
+		hist = _mm256_blendv_epi8(none_value, h, held);
+		hist = _mm256_blendv_epi8(blend, hist, invalid);
+		a = _mm256_and_si256(invalid, _mm256_sub_epi16(a, held));
+		
+		_mm256_storeu_si256((__m256i *)(history + j), hist);
+		_mm_storeu_si128((__m128i *)(age + j), _mm_packus_epi16(_mm256_castsi256_si128(a), _mm256_extracti128_si256(a, 1)));
+		_mm256_storeu_si256((__m256i *)(out + j), _mm256_blendv_epi8(_mm256_srli_epi16(_mm256_add_epi16(hist, _mm256_set1_epi16(8)), 4),
+			invalid_raw, _mm256_cmpeq_epi16(hist, none_value)));
+	}
+	return j;
+}
+#endif
+
+#if defined(USE_NEON)
+static long temporal_kernel_neon(const uint16_t *in, uint16_t *out, uint16_t *history, uint8_t *age, long count,
+								 const t_convert_temporal *temporal){
+	const uint16x8_t invalid_raw = vdupq_n_u16(0x7FF);
+	const uint16x8_t none_value = vdupq_n_u16(CONVERT_NO_HISTORY);
+	const uint16x8_t full = vdupq_n_u16(256);
+	const uint16x8_t alpha = vdupq_n_u16(temporal->alpha);
+	const uint16x4_t gain = vdup_n_u16(temporal->gain);
+	const uint16x8_t hold = vdupq_n_u16(temporal->hold);
+	uint16x8_t d, h, a, d16, w, iw, blend, invalid, none, held, hist;
+	uint32x4_t lo, hi;
+	long j;
+	
+	for(j=0;j+8<=count;j+=8){
+		d = vld1q_u16(in + j);
+		h = vld1q_u16(history + j);
+		a = vmovl_u8(vld1_u8(age + j));
+		invalid = vceqq_u16(d, invalid_raw);
+		none = vceqq_u16(h, none_value);
+		
+		d16 = vshlq_n_u16(d, 4);
+		w = vabdq_u16(d16, h);
+		w = vcombine_u16(vshrn_n_u32(vmull_u16(vget_low_u16(w), gain), 16), vshrn_n_u32(vmull_u16(vget_high_u16(w), gain), 16));
+		w = vminq_u16(vqaddq_u16(alpha, w), full);
+		iw = vsubq_u16(full, w);
+		lo = vmlal_u16(vmull_u16(vget_low_u16(h), vget_low_u16(iw)), vget_low_u16(d16), vget_low_u16(w));
+		hi = vmlal_u16(vmull_u16(vget_high_u16(h), vget_high_u16(iw)), vget_high_u16(d16), vget_high_u16(w));
+		blend = vcombine_u16(vshrn_n_u32(vaddq_u32(lo, vdupq_n_u32(128)), 8), vshrn_n_u32(vaddq_u32(hi, vdupq_n_u32(128)), 8));
+		blend = vbslq_u16(none, d16, blend);
+		
+		held = vbicq_u16(vcltq_u16(a, hold), none);
+		hist = vbslq_u16(invalid, vbslq_u16(held, h, none_value), blend);
+		a = vandq_u16(invalid, vaddq_u16(a, vandq_u16(held, vdupq_n_u16(1))));
+		
+		vst1q_u16(history + j, hist);
+		vst1_u8(age + j, vmovn_u16(a));
+		vst1q_u16(out + j, vbslq_u16(vceqq_u16(hist, none_value), invalid_raw, vshrq_n_u16(vaddq_u16(hist, vdupq_n_u16(8)), 4)));
+	}
+	return j;
+}
+#endif
+
+static void temporal_filter(const uint16_t *in, uint16_t *out, t_convert_temporal *temporal, long pixel, long count){
+	uint16_t *history = temporal->history + pixel;
+	uint8_t *age = temporal->age + pixel;
+	long j, d, h, w;
+	
+	for(j=temporal_kernel(in, out, history, age, count, temporal);j<count;j++){
+		d = in[j];
+		h = history[j];
+		if(d == 0x7FF){
+			if((h != CONVERT_NO_HISTORY) && (age[j] < temporal->hold)){
+				age[j]++;
+			}
+			else{
+				history[j] = h = CONVERT_NO_HISTORY;
+			}
+		}
+		else{
+			d <<= 4;
+			if(h == CONVERT_NO_HISTORY){
+				h = d;
+			}
+			else{
+				w = temporal->alpha + ((labs(d - h) * temporal->gain) >> 16);
+				if(w > 256){
+					w = 256;
+				}
+				h = (h * (256 - w) + d * w + 128) >> 8;
+			}
+			history[j] = h;
+			age[j] = 0;
+		}
+		out[j] = (h == CONVERT_NO_HISTORY) ? 0x7FF : (h + 8) >> 4;
+	}
+}
+
+void convert_temporal_output(const t_convert_temporal *temporal, uint16_t *out, long count){
+	long j;
+	
+	for(j=0;j<count;j++){
+		out[j] = (temporal->history[j] == CONVERT_NO_HISTORY) ? 0x7FF : (temporal->history[j] + 8) >> 4;
+	}
+}
+
+/*
+ Spatial filter: median of the 3x3 or 5x5 window around each raw value. Holes (0x7FF) count as
+ farther than anything, so lone holes are filled and lone values inside holes dropped. Each window
+ column is sorted once per output row, 3x3 then takes the median of the column maxima, medians and
+ minima, 5x5 selects from the five sorted columns with a Batcher merge network pruned to the one
+ output it needs, 142 min/max. Raw values fit in 15 bits, signed 16-bit min/max do for SSE2.
+ C(c, k) is rank k of window column c.
+*/
+
+#define SORT_PAIR(T, MIN, MAX, a, b) do{ T t_ = MIN(a, b); b = MAX(a, b); a = t_; }while(0)
+
+#define SORT3(T, MIN, MAX, v) do{ \
+	SORT_PAIR(T, MIN, MAX, v[0], v[1]); SORT_PAIR(T, MIN, MAX, v[1], v[2]); SORT_PAIR(T, MIN, MAX, v[0], v[1]); \
+}while(0)
+
+#define SORT5(T, MIN, MAX, v) do{ \
+	SORT_PAIR(T, MIN, MAX, v[0], v[1]); SORT_PAIR(T, MIN, MAX, v[3], v[4]); SORT_PAIR(T, MIN, MAX, v[2], v[4]); \
+	SORT_PAIR(T, MIN, MAX, v[2], v[3]); SORT_PAIR(T, MIN, MAX, v[0], v[3]); SORT_PAIR(T, MIN, MAX, v[0], v[2]); \
+	SORT_PAIR(T, MIN, MAX, v[1], v[4]); SORT_PAIR(T, MIN, MAX, v[1], v[3]); SORT_PAIR(T, MIN, MAX, v[1], v[2]); \
+}while(0)
+
+#define MEDIAN3(MIN, MAX, a, b, c) MAX(MIN(a, b), MIN(MAX(a, b), c))
+
+#define MEDIAN9(T, MIN, MAX, C, out) do{ \
+	T lo_ = MAX(MAX(C(0,0), C(1,0)), C(2,0)); \
+	T mid_ = MEDIAN3(MIN, MAX, C(0,1), C(1,1), C(2,1)); \
+	T hi_ = MIN(MIN(C(0,2), C(1,2)), C(2,2)); \
+	out = MEDIAN3(MIN, MAX, lo_, mid_, hi_); \
+}while(0)
+
+#define MEDIAN25(T, MIN, MAX, C, out) do{ \
+	T m0, m1, m2, m3, m4, m5, m6, m7, m8, m9, m10, m11, m12, m13, m14, m15, m16, m17, m18, m19, m20, m21, m22, m23, \
+	m24, m25, m26, m27, m28, m29, m30, m31, m32, m33, m34, m35, m36, m37, m38, m39, m40, m41, m42, m43, m44, m45, \
+	m46, m47, m48, m49, m50, m51, m52, m53, m54, m55, m56, m57, m58, m59, m60, m61, m62, m63, m64, m65, m66, m67, \
+	m68, m69, m70, m71, m72, m73, m74, m75, m76, m77, m78, m79, m80, m81, m82, m83, m84, m85, m86, m87, m88, m89, \
+	m90, m91, m92, m93, m94, m95, m96, m97, m98, m99, m100, m101, m102, m103, m104, m105, m106, m107, m108, m109, \
+	m110, m111, m112, m113, m114, m115, m116, m117, m118, m119, m120, m121, m122, m123, m124, m125, m126, m127, \
+	m128, m129, m130, m131, m132, m133, m134, m135, m136, m137, m138, m139, m140, m141; \
+	m0 = MAX(C(0,3), C(1,3)); m1 = MAX(C(0,2), C(1,2)); m2 = MIN(C(0,4), C(1,4)); m3 = MAX(C(0,0), C(1,0)); \
+	m4 = MAX(m2, m3); m5 = MAX(m1, m4); m6 = MIN(m0, m5); m7 = MIN(C(0,3), C(1,3)); m8 = MAX(C(0,1), C(1,1)); \
+	m9 = MIN(m7, m8); m10 = MIN(C(0,2), C(1,2)); m11 = MIN(m2, m3); m12 = MAX(m10, m11); m13 = MIN(m9, m12); \
+	m14 = MAX(C(2,2), C(2,4)); m15 = MIN(C(2,3), m14); m16 = MAX(m13, m15); m17 = MIN(m6, m16); \
+	m18 = MAX(m7, m8); m19 = MIN(m1, m4); m20 = MIN(m18, m19); m21 = MAX(C(0,4), C(1,4)); \
+	m22 = MIN(C(0,1), C(1,1)); m23 = MIN(m10, m11); m24 = MIN(m22, m23); m25 = MIN(C(2,2), C(2,4)); \
+	m26 = MIN(C(2,1), m25); m27 = MAX(m24, m26); m28 = MIN(m21, m27); m29 = MAX(m20, m28); m30 = MIN(m17, m29); \
+	m31 = MAX(m18, m19); m32 = MAX(m22, m23); m33 = MAX(C(2,1), m25); m34 = MAX(m32, m33); m35 = MIN(m31, m34); \
+	m36 = MAX(m9, m12); m37 = MAX(C(2,3), m14); m38 = MIN(m36, m37); m39 = MAX(m0, m5); \
+	m40 = MIN(C(0,0), C(1,0)); m41 = MAX(m40, C(2,0)); m42 = MIN(m39, m41); m43 = MAX(m38, m42); \
+	m44 = MAX(m35, m43); m45 = MIN(m30, m44); m46 = MAX(C(3,2), C(3,4)); m47 = MIN(C(3,3), m46); \
+	m48 = MAX(C(4,2), C(4,4)); m49 = MIN(C(4,3), m48); m50 = MAX(m47, m49); m51 = MIN(C(3,2), C(3,4)); \
+	m52 = MAX(C(3,1), m51); m53 = MIN(C(4,2), C(4,4)); m54 = MAX(C(4,1), m53); m55 = MAX(m52, m54); \
+	m56 = MAX(C(3,3), m46); m57 = MAX(C(4,3), m48); m58 = MIN(m56, m57); m59 = MAX(C(3,0), C(4,0)); \
+	m60 = MAX(m58, m59); m61 = MAX(m55, m60); m62 = MIN(m50, m61); m63 = MIN(m45, m62); m64 = MAX(m6, m16); \
+	m65 = MAX(m21, m27); m66 = MIN(m64, m65); m67 = MAX(m31, m34); m68 = MAX(m36, m37); m69 = MAX(m39, m41); \
+	m70 = MIN(m68, m69); m71 = MAX(m67, m70); m72 = MIN(m66, m71); m73 = MIN(m13, m15); m74 = MIN(m20, m28); \
+	m75 = MIN(m73, m74); m76 = MIN(m32, m33); m77 = MIN(m38, m42); m78 = MAX(m76, m77); m79 = MIN(m75, m78); \
+	m80 = MIN(m47, m49); m81 = MIN(C(3,1), m51); m82 = MIN(C(4,1), m53); m83 = MAX(m81, m82); \
+	m84 = MIN(m80, m83); m85 = MIN(m52, m54); m86 = MIN(m58, m59); m87 = MAX(m85, m86); m88 = MIN(m84, m87); \
+	m89 = MAX(m79, m88); m90 = MIN(m72, m89); m91 = MAX(m63, m90); m92 = MAX(m64, m65); m93 = MAX(m68, m69); \
+	m94 = MIN(m92, m93); m95 = MAX(m73, m74); m96 = MIN(m35, m43); m97 = MIN(m95, m96); m98 = MAX(m80, m83); \
+	m99 = MIN(m55, m60); m100 = MIN(m98, m99); m101 = MAX(m97, m100); m102 = MIN(m94, m101); \
+	m103 = MAX(m17, m29); m104 = MIN(m67, m70); m105 = MIN(m103, m104); m106 = MAX(m56, m57); \
+	m107 = MIN(m105, m106); m108 = MIN(m24, m26); m109 = MIN(m76, m77); m110 = MIN(m108, m109); \
+	m111 = MIN(m81, m82); m112 = MIN(m85, m86); m113 = MIN(m111, m112); m114 = MAX(m110, m113); \
+	m115 = MAX(m107, m114); m116 = MIN(m102, m115); m117 = MIN(m91, m116); m118 = MAX(m95, m96); \
+	m119 = MAX(m98, m99); m120 = MIN(m118, m119); m121 = MAX(m103, m104); m122 = MAX(m108, m109); \
+	m123 = MAX(m111, m112); m124 = MAX(m122, m123); m125 = MIN(m121, m124); m126 = MAX(m120, m125); \
+	m127 = MAX(m66, m71); m128 = MAX(m75, m78); m129 = MAX(m84, m87); m130 = MAX(m128, m129); \
+	m131 = MIN(m127, m130); m132 = MAX(m30, m44); m133 = MAX(m50, m61); m134 = MIN(m132, m133); \
+	m135 = MIN(m40, C(2,0)); m136 = MIN(C(3,0), C(4,0)); m137 = MAX(m135, m136); m138 = MAX(m134, m137); \
+	m139 = MIN(m131, m138); m140 = MAX(m126, m139); m141 = MAX(m117, m140); \
+	out = m141; \
+}while(0)
+
+#define SCALAR_MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define SCALAR_MAX(a, b) (((a) > (b)) ? (a) : (b))
+
+static long sort_kernel_none(uint16_t *const *lines, uint16_t *const *sorted, long count, int size){
+	(void)lines; (void)sorted; (void)count; (void)size;
+	return 0;
+}
+
+static long median_kernel_none(uint16_t *const *sorted, uint16_t *out, long count, int size){
+	(void)sorted; (void)out; (void)count; (void)size;
+	return 0;
+}
+
+static t_sort_kernel sort_kernel = sort_kernel_none;
+static t_median_kernel median_kernel = median_kernel_none;
+
+#if defined(USE_SSE2)
+static long sort_kernel_sse2(uint16_t *const *lines, uint16_t *const *sorted, long count, int size){
+	__m128i v[5];
+	long i, j;
+	
+	for(j=0;j+8<=count;j+=8){
+		for(i=0;i<size;i++){
+			v[i] = _mm_loadu_si128((const __m128i *)(lines[i] + j));
+		}
+		if(size == 5){
+			SORT5(__m128i, _mm_min_epi16, _mm_max_epi16, v);
+		}
+		else{
+			SORT3(__m128i, _mm_min_epi16, _mm_max_epi16, v);
+		}
+		for(i=0;i<size;i++){
+			_mm_storeu_si128((__m128i *)(sorted[i] + j), v[i]);
+		}
+	}
+	return j;
+}
+
+static long median_kernel_sse2(uint16_t *const *sorted, uint16_t *out, long count, int size){
+	__m128i m;
+	long j;
+	
+#define C(c, k) _mm_loadu_si128((const __m128i *)(sorted[k] + j + (c)))
+	if(size == 5){
+		for(j=0;j+8<=count;j+=8){
+			MEDIAN25(__m128i, _mm_min_epi16, _mm_max_epi16, C, m);
+			_mm_storeu_si128((__m128i *)(out + j), m);
+		}
+	}
+	else{
+		for(j=0;j+8<=count;j+=8){
+			MEDIAN9(__m128i, _mm_min_epi16, _mm_max_epi16, C, m);
+			_mm_storeu_si128((__m128i *)(out + j), m);
+		}
+	}
+#undef C
+	return j;
+}
+#endif
+
+#if defined(USE_AVX2)
+__attribute__((target("avx2")))
+static long sort_kernel_avx2(uint16_t *const *lines, uint16_t *const *sorted, long count, int size){
+	__m256i v[5];
+	long i, j;
+	
+	for(j=0;j+16<=count;j+=16){
+		for(i=0;i<size;i++){
+			v[i] = _mm256_loadu_si256((const __m256i *)(lines[i] + j));
+		}
+		if(size == 5){
+			SORT5(__m256i, _mm256_min_epu16, _mm256_max_epu16, v);
+		}
+		else{
+			SORT3(__m256i, _mm256_min_epu16, _mm256_max_epu16, v);
+		}
+		for(i=0;i<size;i++){
+			_mm256_storeu_si256((__m256i *)(sorted[i] + j), v[i]);
+		}
+	}
+	return j;
+}
+
+__attribute__((target("avx2")))
+static long median_kernel_avx2(uint16_t *const *sorted, uint16_t *out, long count, int size){
+	__m256i m;
+	long j;
+	
+#define C(c, k) _mm256_loadu_si256((const __m256i *)(sorted[k] + j + (c)))
+	if(size == 5){
+		for(j=0;j+16<=count;j+=16){
+			MEDIAN25(__m256i, _mm256_min_epu16, _mm256_max_epu16, C, m);
+			_mm256_storeu_si256((__m256i *)(out + j), m);
+		}
+	}
+	else{
+		for(j=0;j+16<=count;j+=16){
+			MEDIAN9(__m256i, _mm256_min_epu16, _mm256_max_epu16, C, m);
+			_mm256_storeu_si256((__m256i *)(out + j), m);
+		}
+	}
+#undef C
+	return j;
+}
+#endif
+
+#if defined(USE_NEON)
+static long sort_kernel_neon(uint16_t *const *lines, uint16_t *const *sorted, long count, int size){
+	uint16x8_t v[5];
+	long i, j;
+	
+	for(j=0;j+8<=count;j+=8){
+		for(i=0;i<size;i++){
+			v[i] = vld1q_u16(lines[i] + j);
+		}
+		if(size == 5){
+			SORT5(uint16x8_t, vminq_u16, vmaxq_u16, v);
+		}
+		else{
+			SORT3(uint16x8_t, vminq_u16, vmaxq_u16, v);
+		}
+		for(i=0;i<size;i++){
+			vst1q_u16(sorted[i] + j, v[i]);
+		}
+	}
+	return j;
+}
+
+static long median_kernel_neon(uint16_t *const *sorted, uint16_t *out, long count, int size){
+	uint16x8_t m;
+	long j;
+	
+#define C(c, k) vld1q_u16(sorted[k] + j + (c))
+	if(size == 5){
+		for(j=0;j+8<=count;j+=8){
+			MEDIAN25(uint16x8_t, vminq_u16, vmaxq_u16, C, m);
+			vst1q_u16(out + j, m);
+		}
+	}
+	else{
+		for(j=0;j+8<=count;j+=8){
+			MEDIAN9(uint16x8_t, vminq_u16, vmaxq_u16, C, m);
+			vst1q_u16(out + j, m);
+		}
+	}
+#undef C
+	return j;
+}
+#endif
+
+//Median of one row. lines are the size rows of the window, edge-padded by size / 2 on both sides.
+static void median_filter(uint16_t *const *lines, uint16_t *const *sorted, uint16_t *out, long count, int size){
+	uint16_t v[5];
+	long columns = count + size - 1;
+	long i, j;
+	
+	for(j=sort_kernel(lines, sorted, columns, size);j<columns;j++){
+		for(i=0;i<size;i++){
+			v[i] = lines[i][j];
+		}
+		if(size == 5){
+			SORT5(uint16_t, SCALAR_MIN, SCALAR_MAX, v);
+		}
+		else{
+			SORT3(uint16_t, SCALAR_MIN, SCALAR_MAX, v);
+		}
+		for(i=0;i<size;i++){
+			sorted[i][j] = v[i];
+		}
+	}
+#define C(c, k) sorted[k][j + (c)]
+	for(j=median_kernel(sorted, out, count, size);j<count;j++){
+		if(size == 5){
+			MEDIAN25(uint16_t, SCALAR_MIN, SCALAR_MAX, C, out[j]);
+		}
+		else{
+			MEDIAN9(uint16_t, SCALAR_MIN, SCALAR_MAX, C, out[j]);
+		}
+	}
+#undef C
+}
+
+/*
+ Foreground mask: 255 where a raw value is below the pixel's background threshold, closer than
+ anything seen while learning it. Holes are 0x7FF and thresholds at most that, so they never are.
+*/
+
+static long mask_kernel_none(const uint16_t *in, const uint16_t *background, uint8_t *out, long count){
+	(void)in; (void)background; (void)out; (void)count;
+	return 0;
+}
+
+static t_mask_kernel mask_kernel = mask_kernel_none;
+
+#if defined(USE_SSE2)
+static long mask_kernel_sse2(const uint16_t *in, const uint16_t *background, uint8_t *out, long count){
+	const __m128i zero = _mm_setzero_si128();
+	__m128i lo, hi;
+	long j;
+	
+	//SSE2 only compares signed 16-bit values, in >= background is background - in saturating to 0
+	for(j=0;j+16<=count;j+=16){
+		lo = _mm_cmpeq_epi16(_mm_subs_epu16(_mm_loadu_si128((const __m128i *)(background + j)), _mm_loadu_si128((const __m128i *)(in + j))), zero);
+		hi = _mm_cmpeq_epi16(_mm_subs_epu16(_mm_loadu_si128((const __m128i *)(background + j + 8)), _mm_loadu_si128((const __m128i *)(in + j + 8))), zero);
+		_mm_storeu_si128((__m128i *)(out + j), _mm_andnot_si128(_mm_packs_epi16(lo, hi), _mm_set1_epi8(-1)));
+	}
+	return j;
+}
+#endif
+
+#if defined(USE_NEON)
+static long mask_kernel_neon(const uint16_t *in, const uint16_t *background, uint8_t *out, long count){
+	uint16x8_t lo, hi;
+	long j;
+	
+	for(j=0;j+16<=count;j+=16){
+		lo = vcltq_u16(vld1q_u16(in + j), vld1q_u16(background + j));
+		hi = vcltq_u16(vld1q_u16(in + j + 8), vld1q_u16(background + j + 8));
+		vst1q_u8(out + j, vcombine_u8(vmovn_u16(lo), vmovn_u16(hi)));
+	}
+	return j;
+}
+#endif
+
+FORCE_INLINE void mask_span(const uint16_t *in, const uint16_t *background, uint8_t *out, long count){
+	long j;
+	
+	for(j=mask_kernel(in, background, out, count);j<count;j++){
+		out[j] = (in[j] < background[j]) ? 255 : 0;
+	}
+}
+
+void convert_mask_rows(const uint16_t *in, const uint16_t *background, char *mask_bp, long stride, long width, long rows){
+	long i;
+	
+	for(i=0;i<rows;i++){
+		mask_span(in + i * width, background + i * width, (uint8_t *)mask_bp + stride * i, width);
+	}
+}
+
+/*
+ Pooling for decimated regions. Fold kernels combine a frame row into a span column by column,
+ the minimum, or the sum and count of valid values. Pool kernels then combine neighbouring pairs
+ of the span for a factor of 2, larger factors pool across in the scalar loop. The mean divides
+ in float, exact for these magnitudes.
+*/
+
+static long fold_kernel_none(const uint16_t *in, uint16_t *fold, uint16_t *valid, long count){
+	(void)in; (void)fold; (void)valid; (void)count;
+	return 0;
+}
+
+static long pool_kernel_none(const uint16_t *fold, const uint16_t *valid, uint16_t *out, long count){
+	(void)fold; (void)valid; (void)out; (void)count;
+	return 0;
+}
+
+static t_fold_kernel fold_kernel_min = fold_kernel_none;
+static t_fold_kernel fold_kernel_mean = fold_kernel_none;
+static t_pool_kernel pool_kernel_min2 = pool_kernel_none;
+static t_pool_kernel pool_kernel_mean2 = pool_kernel_none;
+
+#if defined(USE_SSE2)
+static long fold_kernel_min_sse2(const uint16_t *in, uint16_t *fold, uint16_t *valid, long count){
+	long j;
+	
+	(void)valid;  //Only the mean counts valid values
+	for(j=0;j+8<=count;j+=8){
+		_mm_storeu_si128((__m128i *)(fold + j), _mm_min_epi16(_mm_loadu_si128((const __m128i *)(in + j)),
+															 _mm_loadu_si128((const __m128i *)(fold + j))));
+	}
+	return j;
+}
+
+static long fold_kernel_mean_sse2(const uint16_t *in, uint16_t *fold, uint16_t *valid, long count){
+	const __m128i hole = _mm_set1_epi16(0x7FF);
+	__m128i v, m;
+	long j;
+	
+	for(j=0;j+8<=count;j+=8){
+		v = _mm_loadu_si128((const __m128i *)(in + j));
+		m = _mm_cmplt_epi16(v, hole);
+		_mm_storeu_si128((__m128i *)(fold + j), _mm_add_epi16(_mm_loadu_si128((const __m128i *)(fold + j)), _mm_and_si128(v, m)));
+		_mm_storeu_si128((__m128i *)(valid + j), _mm_sub_epi16(_mm_loadu_si128((const __m128i *)(valid + j)), m));
+	}
+	return j;
+}
+
+static long pool_kernel_min2_sse2(const uint16_t *fold, const uint16_t *valid, uint16_t *out, long count){
+	const __m128i low = _mm_set1_epi32(0xFFFF);
+	__m128i a, b;
+	long j;
+	
+	(void)valid;  //Only the mean counts valid values
+	for(j=0;j+8<=count;j+=8){
+		a = _mm_loadu_si128((const __m128i *)(fold + j * 2));
+		b = _mm_loadu_si128((const __m128i *)(fold + j * 2 + 8));
+		a = _mm_and_si128(_mm_min_epi16(a, _mm_srli_epi32(a, 16)), low);
+		b = _mm_and_si128(_mm_min_epi16(b, _mm_srli_epi32(b, 16)), low);
+		_mm_storeu_si128((__m128i *)(out + j), _mm_packs_epi32(a, b));
+	}
+	return j;
+}
+
+static __inline__ __m128i mean_sse2(__m128i sum, __m128i n){
+	const __m128i none = _mm_cmpeq_epi32(n, _mm_setzero_si128());
+	__m128i mean = _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(_mm_add_epi32(sum, _mm_srli_epi32(n, 1))), _mm_cvtepi32_ps(n)));
+	
+	return _mm_or_si128(_mm_andnot_si128(none, mean), _mm_and_si128(none, _mm_set1_epi32(0x7FF)));
+}
+
+static long pool_kernel_mean2_sse2(const uint16_t *fold, const uint16_t *valid, uint16_t *out, long count){
+	const __m128i ones = _mm_set1_epi16(1);
+	__m128i lo, hi;
+	long j;
+	
+	for(j=0;j+8<=count;j+=8){
+		lo = mean_sse2(_mm_madd_epi16(_mm_loadu_si128((const __m128i *)(fold + j * 2)), ones),
+					   _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(valid + j * 2)), ones));
+		hi = mean_sse2(_mm_madd_epi16(_mm_loadu_si128((const __m128i *)(fold + j * 2 + 8)), ones),
+					   _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(valid + j * 2 + 8)), ones));
+		_mm_storeu_si128((__m128i *)(out + j), _mm_packs_epi32(lo, hi));
+	}
+	return j;
+}
+#endif
+
+#if defined(USE_NEON)
+static long fold_kernel_min_neon(const uint16_t *in, uint16_t *fold, uint16_t *valid, long count){
+	long j;
+	
+	(void)valid;  //Only the mean counts valid values
+	for(j=0;j+8<=count;j+=8){
+		vst1q_u16(fold + j, vminq_u16(vld1q_u16(in + j), vld1q_u16(fold + j)));
+	}
+	return j;
+}
+
+static long fold_kernel_mean_neon(const uint16_t *in, uint16_t *fold, uint16_t *valid, long count){
+	const uint16x8_t hole = vdupq_n_u16(0x7FF);
+	uint16x8_t v, m;
+	long j;
+	
+	for(j=0;j+8<=count;j+=8){
+		v = vld1q_u16(in + j);
+		m = vcltq_u16(v, hole);
+		vst1q_u16(fold + j, vaddq_u16(vld1q_u16(fold + j), vandq_u16(v, m)));
+		vst1q_u16(valid + j, vsubq_u16(vld1q_u16(valid + j), m));
+	}
+	return j;
+}
+
+static long pool_kernel_min2_neon(const uint16_t *fold, const uint16_t *valid, uint16_t *out, long count){
+	uint16x8x2_t pairs;
+	long j;
+	
+	(void)valid;  //Only the mean counts valid values
+	for(j=0;j+8<=count;j+=8){
+		pairs = vld2q_u16(fold + j * 2);
+		vst1q_u16(out + j, vminq_u16(pairs.val[0], pairs.val[1]));
+	}
+	return j;
+}
+
+#if defined(__aarch64__)
+static __inline__ uint16x4_t mean_neon(uint16x4_t sum, uint16x4_t n){
+	uint32x4_t n32 = vmovl_u16(n);
+	float32x4_t mean = vdivq_f32(vcvtq_f32_u32(vaddq_u32(vmovl_u16(sum), vshrq_n_u32(n32, 1))), vcvtq_f32_u32(n32));
+	
+	return vmovn_u32(vbslq_u32(vceqq_u32(n32, vdupq_n_u32(0)), vdupq_n_u32(0x7FF), vcvtq_u32_f32(mean)));
+}
+
+static long pool_kernel_mean2_neon(const uint16_t *fold, const uint16_t *valid, uint16_t *out, long count){
+	uint16x8x2_t sums, counts;
+	uint16x8_t sum, n;
+	long j;
+	
+	for(j=0;j+8<=count;j+=8){
+		sums = vld2q_u16(fold + j * 2);
+		counts = vld2q_u16(valid + j * 2);
+		sum = vaddq_u16(sums.val[0], sums.val[1]);
+		n = vaddq_u16(counts.val[0], counts.val[1]);
+		vst1q_u16(out + j, vcombine_u16(mean_neon(vget_low_u16(sum), vget_low_u16(n)), mean_neon(vget_high_u16(sum), vget_high_u16(n))));
+	}
+	return j;
+}
+#endif
+#endif
+
+//Pick the widest kernels the CPU we are running on supports
+void convert_select_kernels(void){
+#if defined(USE_SSE2)
+	depth_kernel_float32 = depth_kernel_float32_sse2;
+	depth_kernel_float64 = depth_kernel_float64_sse2;
+	depth_kernel_long = depth_kernel_long_sse2;
+	depth_kernel_uint16 = depth_kernel_uint16_sse2;
+	temporal_kernel = temporal_kernel_sse2;
+	sort_kernel = sort_kernel_sse2;
+	median_kernel = median_kernel_sse2;
+	mask_kernel = mask_kernel_sse2;
+	fold_kernel_min = fold_kernel_min_sse2;
+	fold_kernel_mean = fold_kernel_mean_sse2;
+	pool_kernel_min2 = pool_kernel_min2_sse2;
+	pool_kernel_mean2 = pool_kernel_mean2_sse2;
+#endif
+#if defined(USE_SSSE3)
+	if(__builtin_cpu_supports("ssse3")){
+		rgb_kernel_argb = rgb_kernel_argb_ssse3;
+		unpack_kernel = unpack_kernel_ssse3;
+	}
+#endif
+#if defined(USE_AVX2)
+	if(__builtin_cpu_supports("avx2")){
+		depth_kernel_float32 = depth_kernel_float32_avx2;
+		depth_kernel_float64 = depth_kernel_float64_avx2;
+		depth_kernel_long = depth_kernel_long_avx2;
+		depth_kernel_uint16 = depth_kernel_uint16_avx2;
+		rgb_kernel_argb = rgb_kernel_argb_avx2;
+		temporal_kernel = temporal_kernel_avx2;
+		sort_kernel = sort_kernel_avx2;
+		median_kernel = median_kernel_avx2;
+	}
+	if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c")){
+		depth_kernel_float16 = depth_kernel_float16_f16c;
+	}
+#endif
+#if defined(USE_NEON)
+	depth_kernel_float32 = depth_kernel_float32_neon;
+	depth_kernel_uint16 = depth_kernel_uint16_neon;
+	rgb_kernel_argb = rgb_kernel_argb_neon;
+	temporal_kernel = temporal_kernel_neon;
+	sort_kernel = sort_kernel_neon;
+	median_kernel = median_kernel_neon;
+	mask_kernel = mask_kernel_neon;
+	fold_kernel_min = fold_kernel_min_neon;
+	fold_kernel_mean = fold_kernel_mean_neon;
+	pool_kernel_min2 = pool_kernel_min2_neon;
+#if defined(__aarch64__)
+	unpack_kernel = unpack_kernel_neon;
+	pool_kernel_mean2 = pool_kernel_mean2_neon;
+	depth_kernel_float16 = depth_kernel_float16_neon;
+#endif
+#endif
+}
+
+/*
+ Row loops are inlined with the width as a compile-time constant for the Kinect's video sizes, so
+ the compiler can fully plan the kernel and tail loops for the common cases. Packed depth rows are
+ unpacked into a buffer on the stack that stays in L1 and converted from there, so a packed frame
+ is read from memory once, like an unpacked one. The foreground mask is taken from the same rows.
+*/
+
+//Values left after a kernel, fewer than its vector, go through it from a zero padded block, so a
+//row never mixes kernel and table values where they may differ, as mode 3 reciprocals do
+static long depth_tail(t_depth_kernel kernel, const uint16_t *in, char *out_bp, long j, long count, long size, const t_convert_depth *conv)
+{
+	uint16_t block[8] = {0};
+	double converted[8];
+	long n = count - j;
+	
+	if((n <= 0) || (n >= 8)){
+		return j;
+	}
+	memcpy(block, in + j, n * sizeof(uint16_t));
+	if(kernel(block, converted, 8, conv) < 8){
+		return j;
+	}
+	memcpy(out_bp + j * size, converted, n * size);
+	return count;
+}
+
+FORCE_INLINE void depth_span(const uint16_t *in, char *out_bp, long count, const t_convert_depth *conv)
+{
+	const t_lookup *lut = conv->lut;
+	long j;
+	
+	if(conv->type == CONVERT_FLOAT32){
+		float *out = (float *)out_bp;
+		j = depth_tail(depth_kernel_float32, in, out_bp, depth_kernel_float32(in, out, count, conv), count, sizeof(float), conv);
+		for(;j<count;j++){
+			out[j] = lut->f_ptr[in[j]];
+		}
+	}
+	else if(conv->type == CONVERT_FLOAT64){
+		double *out = (double *)out_bp;
+		j = depth_tail(depth_kernel_float64, in, out_bp, depth_kernel_float64(in, out, count, conv), count, sizeof(double), conv);
+		for(;j<count;j++){
+			out[j] = lut->d_ptr[in[j]];
+		}
+	}
+	else if(conv->type == CONVERT_LONG){
+		long *out = (long *)out_bp;
+		j = depth_tail(depth_kernel_long, in, out_bp, depth_kernel_long(in, out, count, conv), count, sizeof(long), conv);
+		for(;j<count;j++){
+			out[j] = lut->l_ptr[in[j]];
+		}
+	}
+	else if(conv->type == CONVERT_UINT16){
+		uint16_t *out = (uint16_t *)out_bp;
+		j = depth_tail(depth_kernel_uint16, in, out_bp, depth_kernel_uint16(in, out, count, conv), count, sizeof(uint16_t), conv);
+		for(;j<count;j++){
+			out[j] = lut->s_ptr[in[j]];
+		}
+	}
+	else if(conv->type == CONVERT_FLOAT16){
+		uint16_t *out = (uint16_t *)out_bp;
+		j = depth_tail(depth_kernel_float16, in, out_bp, depth_kernel_float16(in, out, count, conv), count, sizeof(uint16_t), conv);
+		for(;j<count;j++){
+			out[j] = lut->s_ptr[in[j]];
+		}
+	}
+	else if(conv->type == CONVERT_NONE){
+		memcpy(out_bp, in, count * sizeof(uint16_t));
+	}
+}
+
+//Rows through the spatial filter. The window's rows are unpacked into a ring of edge-padded
+//copies, each frame row once per band, and the window stops at the frame's edges.
+static void spatial_rows(const uint8_t *in, char *out_bp, long stride, long width, long rows, long row, int bits,
+						 const t_convert_depth *conv)
+{
+	uint16_t window[5][CONVERT_UNPACK_CHUNK + 4];
+	uint16_t columns[5][CONVERT_UNPACK_CHUNK + 4];
+	uint16_t filtered[CONVERT_UNPACK_CHUNK];
+	uint16_t *lines[5], *sorted[5];
+	long loaded[5] = {-1, -1, -1, -1, -1};
+	int radius = (conv->spatial == 2) ? 2 : 1;
+	int size = radius * 2 + 1;
+	const uint8_t *frame = in - row * width * bits / 8;
+	long i, k, y, slot;
+	uint16_t *line;
+	
+	for(k=0;k<size;k++){
+		sorted[k] = columns[k];
+	}
+	for(i=0;i<rows;i++){
+		for(k=0;k<size;k++){
+			y = row + i + k - radius;
+			y = (y < 0) ? 0 : ((y >= conv->height) ? conv->height - 1 : y);
+			slot = y % size;
+			line = window[slot];
+			if(loaded[slot] != y){
+				if(bits == 16){
+					memcpy(line + radius, (const uint16_t *)frame + y * width, width * sizeof(uint16_t));
+				}
+				else{
+					unpack_depth(frame + y * width * bits / 8, line + radius, width, bits);
+				}
+				line[0] = line[radius - 1] = line[radius];
+				line[width + radius] = line[width + size - 2] = line[width + radius - 1];
+				loaded[slot] = y;
+			}
+			lines[k] = line;
+		}
+		median_filter(lines, sorted, filtered, width, size);
+		if(conv->temporal){
+			temporal_filter(filtered, filtered, conv->temporal, (row + i) * width, width);
+		}
+		depth_span(filtered, out_bp + stride * i, width, conv);
+		if(conv->background){
+			mask_span(filtered, conv->background + (row + i) * width, (uint8_t *)conv->mask_bp + conv->mask_stride * (row + i), width);
+		}
+	}
+}
+
+FORCE_INLINE void depth_rows(const uint8_t *in, char *out_bp, long stride, const long width, long rows, long row,
+							 const int bits, const t_convert_depth *conv)
+{
+	uint16_t unpacked[CONVERT_UNPACK_CHUNK];
+	uint16_t filtered[CONVERT_UNPACK_CHUNK];
+	const uint16_t *raw;
+	long size = convert_size(conv->type);
+	long pixel = row * width;
+	long i,j,n;
+	
+	if(conv->spatial && (width <= CONVERT_UNPACK_CHUNK)){
+		spatial_rows(in, out_bp, stride, width, rows, row, bits, conv);
+		return;
+	}
+	for(i=0;i<rows;i++){
+		if((bits == 16) && !conv->temporal){
+			depth_span((const uint16_t *)in, out_bp + stride * i, width, conv);
+			if(conv->background){
+				mask_span((const uint16_t *)in, conv->background + pixel, (uint8_t *)conv->mask_bp + conv->mask_stride * (row + i), width);
+			}
+		}
+		else{
+			for(j=0;j<width;j+=n){
+				n = (width - j < CONVERT_UNPACK_CHUNK) ? width - j : CONVERT_UNPACK_CHUNK;
+				if(bits == 16){
+					raw = (const uint16_t *)in + j;
+				}
+				else{
+					unpack_depth(in + j * bits / 8, unpacked, n, bits);
+					raw = unpacked;
+				}
+				if(conv->temporal){
+					temporal_filter(raw, filtered, conv->temporal, pixel + j, n);
+					raw = filtered;
+				}
+				depth_span(raw, out_bp + stride * i + j * size, n, conv);
+				if(conv->background){
+					mask_span(raw, conv->background + pixel + j, (uint8_t *)conv->mask_bp + conv->mask_stride * (row + i) + j, n);
+				}
+			}
+		}
+		in += width * bits / 8;
+		pixel += width;
+	}
+}
+
+void convert_depth_rows(const void *in, char *out_bp, long stride, long width, long rows, long row, int bits, const t_convert_depth *conv)
+{
+	if(width == 640){
+		if(bits == 16){
+			depth_rows((const uint8_t *)in, out_bp, stride, 640, rows, row, 16, conv);
+		}
+		else{
+			depth_rows((const uint8_t *)in, out_bp, stride, 640, rows, row, bits, conv);
+		}
+	}
+	else{
+		depth_rows((const uint8_t *)in, out_bp, stride, width, rows, row, bits, conv);
+	}
+}
+
+void convert_filter(const void *in, uint16_t *out, long width, long height, int bits, const t_convert_depth *conv)
+{
+	t_convert_depth filter = *conv;
+	
+	filter.type = CONVERT_NONE;
+	filter.background = NULL;
+	convert_depth_rows(in, (char *)out, width * sizeof(uint16_t), width, height, 0, bits, &filter);
+}
+
+//count values of frame row y from column x, unpacked into line when packed. Packed rows are
+//unpacked from the 8 value group x falls in, line must have room for count + 8 values.
+static const uint16_t *region_line(const uint8_t *frame, long width, int bits, long y, long x, long count, uint16_t *line)
+{
+	long x0 = x & ~7;
+	
+	if(bits == 16){
+		return (const uint16_t *)frame + y * width + x;
+	}
+	unpack_depth(frame + (y * width + x0) * bits / 8, line, (x + count - x0 + 7) & ~7, bits);
+	return line + x - x0;
+}
+
+/*
+ Region and decimation. Each output row reads its factor rows once, or one for CONVERT_SKIP,
+ folds them column by column into a span of frame width, then across into the pooled row, which
+ goes through depth_span like a full row. Holes are 0x7FF so the minimum skips them by itself,
+ the mean counts valid values and is a hole only when all of the block is.
+*/
+
+void convert_region_rows(const void *in, char *out_bp, long stride, long frame_width, long start, long end, int bits,
+						 const t_convert_region *region, const t_convert_depth *conv)
+{
+	uint16_t line[CONVERT_UNPACK_CHUNK + 8];
+	uint16_t fold[CONVERT_UNPACK_CHUNK];
+	uint16_t valid[CONVERT_UNPACK_CHUNK];
+	uint16_t pooled[CONVERT_UNPACK_CHUNK];
+	const uint8_t *frame = (const uint8_t *)in;
+	const uint16_t *raw;
+	long factor = region->factor;
+	long width = region->width;
+	long span = width * factor;
+	long i, j, k, y;
+	unsigned long sum, n;
+	uint16_t v;
+	
+	for(i=start;i<end;i++){
+		y = region->y + i * factor;
+		if(factor == 1){
+			raw = region_line(frame, frame_width, bits, y, region->x, width, line);
+		}
+		else if(region->pooling == CONVERT_SKIP){
+			raw = region_line(frame, frame_width, bits, y, region->x, span, line);
+			for(j=0;j<width;j++){
+				pooled[j] = raw[j * factor];
+			}
+			raw = pooled;
+		}
+		else if(region->pooling == CONVERT_MIN){
+			for(k=0;k<factor;k++){
+				raw = region_line(frame, frame_width, bits, y + k, region->x, span, line);
+				if(k == 0){
+					memcpy(fold, raw, span * sizeof(uint16_t));
+					continue;
+				}
+				for(j=fold_kernel_min(raw, fold, NULL, span);j<span;j++){
+					fold[j] = (raw[j] < fold[j]) ? raw[j] : fold[j];
+				}
+			}
+			for(j=(factor == 2) ? pool_kernel_min2(fold, NULL, pooled, width) : 0;j<width;j++){
+				v = fold[j * factor];
+				for(k=1;k<factor;k++){
+					v = (fold[j * factor + k] < v) ? fold[j * factor + k] : v;
+				}
+				pooled[j] = v;
+			}
+			raw = pooled;
+		}
+		else{
+			memset(fold, 0, span * sizeof(uint16_t));
+			memset(valid, 0, span * sizeof(uint16_t));
+			for(k=0;k<factor;k++){
+				raw = region_line(frame, frame_width, bits, y + k, region->x, span, line);
+				for(j=fold_kernel_mean(raw, fold, valid, span);j<span;j++){
+					fold[j] += (raw[j] < 0x7FF) ? raw[j] : 0;
+					valid[j] += (raw[j] < 0x7FF);
+				}
+			}
+			for(j=(factor == 2) ? pool_kernel_mean2(fold, valid, pooled, width) : 0;j<width;j++){
+				sum = 0;
+				n = 0;
+				for(k=0;k<factor;k++){
+					sum += fold[j * factor + k];
+					n += valid[j * factor + k];
+				}
+				pooled[j] = n ? (uint16_t)((sum + n / 2) / n) : 0x7FF;
+			}
+			raw = pooled;
+		}
+		depth_span(raw, out_bp + stride * i, width, conv);
+	}
+}
+
+FORCE_INLINE void rgb_rows(const uint8_t *in, char *out_bp, long stride, const long width, long rows, long planecount)
+{
+	long i,j;
+	uint8_t *out;
+	
+	if(planecount == 4){
+		for(i=0;i<rows;i++){
+			out = (uint8_t *)out_bp + stride * i;
+			j = rgb_kernel_argb(in, out, width);
+			in += j * 3;
+			out += j * 4;
+			for(;j<width;j++){
+				out[0] = 0xFF;
+				out[1] = in[0];
+				out[2] = in[1];
+				out[3] = in[2];
+				
+				out += 4;
+				in += 3;
+			}
+		}
+	}
+	else if(planecount == 1){
+		if(stride == width){
+			memcpy(out_bp, in, width * rows);
+		}
+		else{
+			for(i=0;i<rows;i++){
+				memcpy(out_bp + stride * i, in, width);
+				in += width;
+			}
+		}
+	}
+}
+
+void convert_rgb_rows(const uint8_t *in, char *out_bp, long stride, long width, long rows, long planecount)
+{
+	if(width == 640){
+		rgb_rows(in, out_bp, stride, 640, rows, planecount);
+	}
+	else if(width == 1280){
+		rgb_rows(in, out_bp, stride, 1280, rows, planecount);
+	}
+	else{
+		rgb_rows(in, out_bp, stride, width, rows, planecount);
+	}
+}
+
+void convert_fused_rows(const t_convert_frame *depth, const t_convert_frame *video, long start, long end,
+						const t_convert_depth *conv)
+{
+	long i, n, first, last;
+	long video_planes = (video->planecount == 4) ? 3 : 1;
+	
+	for(i=start;i<end;i+=CONVERT_TILE_ROWS){
+		n = (end - i < CONVERT_TILE_ROWS) ? end - i : CONVERT_TILE_ROWS;
+		convert_depth_rows((const uint8_t *)depth->in + i * depth->width * depth->bits / 8, depth->out_bp + depth->stride * i,
+						   depth->stride, depth->width, n, i, depth->bits, conv);
+		
+		//Video rows covering the same part of the image, frames may differ in height
+		first = i * video->height / depth->height;
+		last = (i + n) * video->height / depth->height;
+		convert_rgb_rows((const uint8_t *)video->in + first * video->width * video_planes, video->out_bp + video->stride * first,
+						 video->stride, video->width, last - first, video->planecount);
+	}
+}
@@ -0,0 +1,174 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth 
+ jmp@jmpelletier.com
+ 
+ This file is part of jit.freenect.grab.
+  
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ 
+ http://www.apache.org/licenses/LICENSE-2.0
+ 
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ 
+ */
+
+/*
+ Frame conversion kernels: raw 11-bit depth, unpacked or packed, to long/float32/float64 through
+ a lookup table, and RGB24 to ARGB32. Plain C with no Max or Jitter dependencies, jit.freenect.grab.c wraps
+ them for Jitter matrices and splits frames across its worker pool.
+ */
+
+#ifndef FREENECT_CONVERT_H
+#define FREENECT_CONVERT_H
+
+#include <stdint.h>
+
+#define CONVERT_TILE_ROWS 16      //Depth rows per tile of the fused conversion, about 64KB of float32 output
+#define CONVERT_UNPACK_CHUNK 640  //Packed depth values unpacked at a time, a multiple of 8
+#define CONVERT_MM_MAX 10000      //Farthest millimetre output, beyond reads as no data like FREENECT_DEPTH_MM
+#define CONVERT_NO_HISTORY 0xFFFF //Temporal filter history of a pixel without a recent valid value
+#define CONVERT_MAX_FACTOR 8      //Largest region factor, mean pooling sums its rows in 16 bits, 2046 at most each
+#define CONVERT_RCP_TOLERANCE 4e-7 //Relative difference of mode 3 float kernels from the table, measured under 2e-7
+
+#if defined(__GNUC__)
+#define FORCE_INLINE static __inline__ __attribute__((always_inline))
+#else
+#define FORCE_INLINE static __inline
+#endif
+
+typedef union _lookup_data{
+	long *l_ptr;
+	float *f_ptr;
+	double *d_ptr;
+	uint16_t *s_ptr;  //CONVERT_UINT16 and CONVERT_FLOAT16
+}t_lookup;
+
+//Output element types. CONVERT_NONE releases a lookup table, as a conversion it gives the raw
+//uint16_t values after the filters. CONVERT_UINT16 is the long output clipped to 0-65535, so raw
+//values or millimetres, and CONVERT_FLOAT16 the float32 output as IEEE half floats.
+enum convert_type{
+	CONVERT_NONE,
+	CONVERT_CHAR,
+	CONVERT_LONG,
+	CONVERT_FLOAT32,
+	CONVERT_FLOAT64,
+	CONVERT_UINT16,
+	CONVERT_FLOAT16
+};
+
+enum convert_err{
+	CONVERT_ERR_NONE,
+	CONVERT_ERR_MEMORY,
+	CONVERT_ERR_TYPE
+};
+
+/*
+ Temporal filter on raw depth. history holds the filtered value of each pixel in 1/16 raw units.
+ A valid value v is blended in with weight w = min(256, alpha + (|16v - history| * gain >> 16))
+ in 1/256: small changes are smoothed, changes past the motion threshold are followed at once.
+ An invalid pixel keeps showing its history for hold frames, age counts how long it has.
+*/
+typedef struct _convert_temporal{
+	uint16_t       *history;
+	uint8_t        *age;
+	int            alpha;   //Weight of a new value when nothing moves, 1-256
+	int            gain;    //Extra weight per 1/16 raw unit of change, 0-65535
+	int            hold;    //0-255
+} t_convert_temporal;
+
+//How every raw depth value of a frame is converted
+typedef struct _convert_depth{
+	const t_lookup     *lut;
+	int                type;      //enum convert_type of the output
+	int                mode;
+	float              scale;     //Mode 5 disparity model, raw to inverse metres: raw * scale + offset
+	float              offset;
+	int                spatial;   //Median of raw values first, 0: off, 1: 3x3, 2: 5x5
+	long               height;    //Rows in the frame, where the median's window stops
+	t_convert_temporal *temporal; //Then filter them over time, NULL when off
+	const uint16_t     *background; //Per pixel, filtered values below it are foreground. NULL for no mask.
+	char               *mask_bp;    //Foreground mask of the frame, 255 or 0 per pixel
+	long               mask_stride;
+} t_convert_depth;
+
+//How each output value of a region comes from its factor x factor block of frame values
+enum convert_pooling{
+	CONVERT_SKIP,  //Top left value
+	CONVERT_MEAN,  //Mean of the valid values
+	CONVERT_MIN    //Nearest valid value
+};
+
+//Part of a frame converted by convert_region_rows
+typedef struct _convert_region{
+	long x, y;           //Top left corner in the frame
+	long width, height;  //Output size, the region covers width * factor by height * factor values
+	long factor;         //1-CONVERT_MAX_FACTOR
+	int  pooling;        //enum convert_pooling
+} t_convert_region;
+
+//Call once before converting, picks the widest kernels the CPU supports
+void convert_select_kernels(void);
+
+//Bytes per output value of an enum convert_type
+int  convert_size(int type);
+
+//IEEE half float nearest to f, ties to even like the F16C and NEON conversions
+uint16_t convert_half(float f);
+
+//(Re)build the 0x800 entry table mapping raw depth to output values for a depth mode.
+//Mode 5 is whole millimetres from the disparity model, 0 for no data. CONVERT_UINT16 gives
+//CONVERT_ERR_TYPE in modes 3 and 4, metres clipped to 0-65535 would only keep 0-10.
+int  convert_lut(t_lookup *lut, int type, int mode, float scale, float offset);
+
+//Convert rows of width raw depth values, stride is the output row pitch in bytes. bits is 16 for
+//uint16_t values, or 11 or 10 for packed rows, width must then be a multiple of 8. 10-bit values
+//are widened as by convert_unpack_depth. row is the index of the first row in the frame, it
+//locates the temporal filter's history. Rows above and below are read for the spatial filter,
+//which is skipped for widths over CONVERT_UNPACK_CHUNK.
+void convert_depth_rows(const void *in, char *out_bp, long stride, long width, long rows, long row, int bits, const t_convert_depth *conv);
+
+//Convert output rows start to end of a region, in is the frame and out_bp the output's first row.
+//The region must be at most CONVERT_UNPACK_CHUNK values across. Filters and the mask are not
+//applied, convert a frame from convert_filter for those.
+void convert_region_rows(const void *in, char *out_bp, long stride, long frame_width, long start, long end, int bits,
+						 const t_convert_region *region, const t_convert_depth *conv);
+
+//Run the filters of conv alone over a frame, out gets the filtered raw values
+void convert_filter(const void *in, uint16_t *out, long width, long height, int bits, const t_convert_depth *conv);
+
+//Foreground mask of rows of raw values against a background, see t_convert_depth
+void convert_mask_rows(const uint16_t *in, const uint16_t *background, char *mask_bp, long stride, long width, long rows);
+
+//Filtered raw values as last left in the history by the filter
+void convert_temporal_output(const t_convert_temporal *temporal, uint16_t *out, long count);
+
+//Unpack count packed values of 10 or 11 bits. 10-bit values come out in the 11-bit range, doubled,
+//with their hole 0x3FF as 0x7FF.
+void convert_unpack_depth(const uint8_t *in, uint16_t *out, long count, int bits);
+
+//Expand rows of RGB24 to ARGB32 (planecount 4) or copy rows of IR (planecount 1)
+void convert_rgb_rows(const uint8_t *in, char *out_bp, long stride, long width, long rows, long planecount);
+
+//Whole frame source and destination for the fused conversion
+typedef struct _convert_frame{
+	const void *in;
+	char       *out_bp;
+	long       stride;      //Output row pitch in bytes
+	long       width;
+	long       height;
+	long       planecount;  //Output planes, video only
+	int        bits;        //Bits per raw value, depth only, see convert_depth_rows
+} t_convert_frame;
+
+//Convert depth rows start to end and the matching video rows in tiles of CONVERT_TILE_ROWS,
+//so both frames are streamed through the cache once instead of in two separate passes
+void convert_fused_rows(const t_convert_frame *depth, const t_convert_frame *video, long start, long end,
+						const t_convert_depth *conv);
+
+#endif
@@ -0,0 +1,140 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth 
+ jmp@jmpelletier.com
+ 
+ This file is part of jit.freenect.grab.
+  
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ 
+ http://www.apache.org/licenses/LICENSE-2.0
+ 
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ 
+ */
+
+#include "freenect.pool.h"
+
+static void *worker_threadfunc(void *arg){
+	t_worker_pool *pool = (t_worker_pool *)arg;
+	long generation;
+	long band, bands, rows;
+	
+	pthread_mutex_lock(&pool->mutex);
+	band = ++pool->started;  //Bands are numbered from 1, band 0 belongs to the caller
+	generation = pool->generation;
+	pthread_cond_signal(&pool->done_cond);
+	
+	while(1){
+		while(pool->generation == generation && !pool->terminate){
+			pthread_cond_wait(&pool->start_cond, &pool->mutex);
+		}
+		if(pool->terminate){
+			break;
+		}
+		generation = pool->generation;
+		bands = pool->count + 1;
+		rows = pool->rows;
+		pthread_mutex_unlock(&pool->mutex);
+		
+		pool->func(pool->data, rows * band / bands, rows * (band + 1) / bands);
+		
+		pthread_mutex_lock(&pool->mutex);
+		if(!--pool->pending){
+			pthread_cond_signal(&pool->done_cond);
+		}
+	}
+	
+	pthread_mutex_unlock(&pool->mutex);
+	return NULL;
+}
+
+void worker_pool_init(t_worker_pool *pool){
+	pool->count = 0;
+	pool->started = 0;
+	pool->generation = 0;
+	pool->pending = 0;
+	pool->terminate = 0;
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->start_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+}
+
+static void worker_pool_stop(t_worker_pool *pool){
+	long i;
+	
+	if(!pool->count){
+		return;
+	}
+	pthread_mutex_lock(&pool->mutex);
+	pool->terminate = 1;
+	pthread_cond_broadcast(&pool->start_cond);
+	pthread_mutex_unlock(&pool->mutex);
+	
+	for(i=0;i<pool->count;i++){
+		pthread_join(pool->threads[i], NULL);
+	}
+	pool->count = 0;
+	pool->started = 0;
+	pool->terminate = 0;
+}
+
+long worker_pool_resize(t_worker_pool *pool, long nthreads){
+	long i;
+	
+	worker_pool_stop(pool);
+	
+	if(nthreads > POOL_MAX_THREADS){
+		nthreads = POOL_MAX_THREADS;
+	}
+	for(i=0;i<nthreads-1;i++){
+		if(pthread_create(&pool->threads[i], NULL, worker_threadfunc, pool)){
+			break;
+		}
+		pool->count++;
+	}
+	
+	//Make sure every worker has picked up its band number before the first job is posted
+	pthread_mutex_lock(&pool->mutex);
+	while(pool->started < pool->count){
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return pool->count + 1;
+}
+
+void worker_pool_free(t_worker_pool *pool){
+	worker_pool_stop(pool);
+	pthread_mutex_destroy(&pool->mutex);
+	pthread_cond_destroy(&pool->start_cond);
+	pthread_cond_destroy(&pool->done_cond);
+}
+
+void worker_pool_run(t_worker_pool *pool, t_band_func func, void *data, long rows, long pixels){
+	if(!pool || !pool->count || (pixels < POOL_MIN_PIXELS)){
+		func(data, 0, rows);
+		return;
+	}
+	
+	pthread_mutex_lock(&pool->mutex);
+	pool->func = func;
+	pool->data = data;
+	pool->rows = rows;
+	pool->pending = pool->count;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->start_cond);
+	pthread_mutex_unlock(&pool->mutex);
+	
+	func(data, 0, rows / (pool->count + 1));
+	
+	pthread_mutex_lock(&pool->mutex);
+	while(pool->pending){
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+}
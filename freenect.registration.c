@@ -0,0 +1,367 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth 
+ jmp@jmpelletier.com
+ 
+ This file is part of jit.freenect.grab.
+  
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ 
+ http://www.apache.org/licenses/LICENSE-2.0
+ 
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "freenect.registration.h"
+
+#if defined(__GNUC__)
+#define FORCE_INLINE static __inline__ __attribute__((always_inline))
+#else
+#define FORCE_INLINE static __inline
+#endif
+
+//The depth intrinsics reproduce the field of view the point cloud has always used, the colour
+//camera and baseline are Nicolas Burrus' published values.
+const t_calibration registration_defaults = {
+	319.5 / 0.542955699638437, 239.5 / 0.393910475614942, 319.5, 239.5,
+	0., 0., 0., 0., 0.,
+	529.21508098293293, 525.56393630057437, 328.94272028759258, 267.48068171871557,
+	0.019985242312092553, -0.00074423738761617583, -0.010916736334336222,
+	-0.0030711016, 3.3309495161
+};
+
+/*
+ Calibration files are plain text, one parameter group per line, in pixels and metres:
+ 
+   depth_intrinsics fx fy cx cy
+   depth_distortion k1 k2 p1 p2 k3
+   rgb_intrinsics fx fy cx cy
+   translation tx ty tz
+   depth_disparity scale offset
+ 
+ Distortion terms left off the end are 0. Blank lines and lines starting with # are ignored.
+*/
+
+typedef struct _calibration_group{
+	const char *name;
+	int        min, max;  //Values it takes
+	size_t     offset;    //Of the first one in t_calibration, the rest follow
+} t_calibration_group;
+
+static const t_calibration_group calibration_groups[] = {
+	{"depth_intrinsics", 4, 4, offsetof(t_calibration, depth_fx)},
+	{"depth_distortion", 2, 5, offsetof(t_calibration, depth_k1)},
+	{"rgb_intrinsics", 4, 4, offsetof(t_calibration, rgb_fx)},
+	{"translation", 3, 3, offsetof(t_calibration, tx)},
+	{"depth_disparity", 2, 2, offsetof(t_calibration, disparity_scale)}
+};
+
+#define CALIBRATION_GROUPS (sizeof(calibration_groups) / sizeof(calibration_groups[0]))
+#define SPACE " \t\r\n"
+
+//Parse a line into a calibration, returns non-zero when it is malformed
+static int parse_group(const char *text, t_calibration *cal){
+	const t_calibration_group *group = NULL;
+	const char *p = text + strspn(text, SPACE);
+	size_t length = strcspn(p, SPACE);
+	double *values;
+	char *end;
+	int i, n;
+	
+	if(!*p || (*p == '#')){
+		return 0;
+	}
+	for(i=0;i<(int)CALIBRATION_GROUPS;i++){
+		if((strlen(calibration_groups[i].name) == length) && !strncmp(p, calibration_groups[i].name, length)){
+			group = &calibration_groups[i];
+		}
+	}
+	if(!group){
+		return 1;
+	}
+	
+	values = (double *)((char *)cal + group->offset);
+	p += length;
+	for(n=0;*(p += strspn(p, SPACE));n++){
+		if(n == group->max){
+			return 1;
+		}
+		values[n] = strtod(p, &end);
+		if(end == p){
+			return 1;
+		}
+		p = end;
+	}
+	if(n < group->min){
+		return 1;
+	}
+	for(;n<group->max;n++){
+		values[n] = 0.;
+	}
+	return 0;
+}
+
+int registration_load(const char *path, t_calibration *cal, long *line){
+	t_calibration loaded = registration_defaults;
+	char text[256];
+	FILE *f;
+	int err = REGISTRATION_ERR_NONE;
+	
+	*line = 0;
+	f = fopen(path, "r");
+	if(!f){
+		return REGISTRATION_ERR_FILE;
+	}
+	while(fgets(text, sizeof(text), f)){
+		(*line)++;
+		if(parse_group(text, &loaded)){
+			err = REGISTRATION_ERR_FORMAT;
+			break;
+		}
+	}
+	fclose(f);
+	if(err){
+		return err;
+	}
+	
+	*line = 0;
+	if(!(loaded.depth_fx > 0.) || !(loaded.depth_fy > 0.) || !(loaded.rgb_fx > 0.) || !(loaded.rgb_fy > 0.)){
+		return REGISTRATION_ERR_FOCAL;
+	}
+	*cal = loaded;
+	return REGISTRATION_ERR_NONE;
+}
+
+/*
+ Camera tables. Every depth pixel is undistorted once into a ray, which the point cloud scales
+ by depth, so lens correction costs nothing per frame. For registration the depth and colour
+ cameras are related by a translation: the matching colour pixel is the ray's projection at
+ infinite distance plus a parallax term that only depends on the raw depth value, so both are
+ tabulated too: one fixed-point entry per depth pixel and one per raw value.
+ Tables are built when the device is opened and whenever the calibration changes.
+*/
+
+static double raw_to_metres(const t_calibration *cal, long raw){
+	double z = raw * cal->disparity_scale + cal->disparity_offset;
+	return (z > 0.) ? 1. / z : 0.;
+}
+
+int registration_allocate(t_registration *reg){
+	if(!reg->table){
+		reg->rays = (float *)malloc(REG_WIDTH * REG_HEIGHT * 2 * sizeof(float));
+		reg->table = (int32_t *)malloc(REG_WIDTH * REG_HEIGHT * 2 * sizeof(int32_t));
+		reg->zbuffer = (uint16_t *)malloc(REG_WIDTH * REG_HEIGHT * sizeof(uint16_t));
+		if(!reg->rays || !reg->table || !reg->zbuffer){
+			registration_release(reg);
+			return 1;
+		}
+		reg->valid = 0;
+	}
+	return 0;
+}
+
+void registration_release(t_registration *reg){
+	free(reg->rays);
+	reg->rays = NULL;
+	free(reg->table);
+	free(reg->zbuffer);
+	reg->table = NULL;
+	reg->zbuffer = NULL;
+	reg->valid = 0;
+}
+
+//Invert the lens distortion of a pixel, giving its ideal normalised coordinates
+static void undistort_point(const t_calibration *cal, double u, double v, double *xn, double *yn){
+	double x0 = (u - cal->depth_cx) / cal->depth_fx;
+	double y0 = (v - cal->depth_cy) / cal->depth_fy;
+	double x = x0, y = y0;
+	double r2, radial, dx, dy;
+	int i;
+	
+	//The model maps ideal to distorted coordinates, fixed-point iteration converges in a few steps
+	for(i=0;i<10;i++){
+		r2 = x*x + y*y;
+		radial = 1. + r2 * (cal->depth_k1 + r2 * (cal->depth_k2 + r2 * cal->depth_k3));
+		dx = 2. * cal->depth_p1 * x * y + cal->depth_p2 * (r2 + 2. * x * x);
+		dy = cal->depth_p1 * (r2 + 2. * y * y) + 2. * cal->depth_p2 * x * y;
+		x = (x0 - dx) / radial;
+		y = (y0 - dy) / radial;
+	}
+	*xn = x;
+	*yn = y;
+}
+
+void registration_build(t_registration *reg, const t_calibration *cal){
+	long u,v,i;
+	float *r;
+	int32_t *t;
+	double z, xn, yn;
+	
+	if(reg->valid){
+		return;
+	}
+	
+	r = reg->rays;
+	t = reg->table;
+	for(v=0;v<REG_HEIGHT;v++){
+		for(u=0;u<REG_WIDTH;u++){
+			undistort_point(cal, u, v, &xn, &yn);
+			*r++ = (float)xn;
+			*r++ = (float)-yn;  //OpenGL's y axis points up
+			*t++ = (int32_t)((xn * cal->rgb_fx + cal->rgb_cx) * (1 << REG_SHIFT) + 0.5);
+			*t++ = (int32_t)((yn * cal->rgb_fy + cal->rgb_cy) * (1 << REG_SHIFT) + 0.5);
+		}
+	}
+	
+	for(i=0;i<0x800;i++){
+		z = raw_to_metres(cal, i);
+		if((i == 0x7FF) || (z <= 0.)){
+			reg->shift_x[i] = REG_INVALID;
+			reg->shift_y[i] = 0;
+		}
+		else{
+			reg->shift_x[i] = (int32_t)(cal->rgb_fx * cal->tx / z * (1 << REG_SHIFT));
+			reg->shift_y[i] = (int32_t)(cal->rgb_fy * cal->ty / z * (1 << REG_SHIFT));
+		}
+	}
+	
+	reg->valid = 1;
+}
+
+//Scatter depth into colour camera space, converting through the lookup table on the way.
+//The z-buffer keeps the nearest sample when several depth pixels land on the same colour pixel.
+//type is the table's enum convert_type, inlined once per type.
+FORCE_INLINE void register_depth_pass(t_registration *reg, const uint16_t *in, char *out_bp, long stride,
+									  const t_lookup *lut, const int type)
+{
+	long p, rx, ry, t;
+	uint16_t d;
+	const int32_t *table = reg->table;
+	uint16_t *zbuffer = reg->zbuffer;
+	char *out;
+	
+	for(p=0;p<REG_WIDTH*REG_HEIGHT;p++){
+		d = in[p];
+		if(reg->shift_x[d] == REG_INVALID){
+			continue;
+		}
+		rx = (table[p*2] + reg->shift_x[d] + (1 << (REG_SHIFT-1))) >> REG_SHIFT;
+		ry = (table[p*2+1] + reg->shift_y[d] + (1 << (REG_SHIFT-1))) >> REG_SHIFT;
+		if((rx < 0) || (rx >= REG_WIDTH) || (ry < 0) || (ry >= REG_HEIGHT)){
+			continue;
+		}
+		t = ry * REG_WIDTH + rx;
+		if(d < zbuffer[t]){
+			zbuffer[t] = d;
+			out = out_bp + stride * ry;
+			if((type == CONVERT_UINT16) || (type == CONVERT_FLOAT16)){
+				((uint16_t *)out)[rx] = lut->s_ptr[d];
+			}
+			else if(type == CONVERT_FLOAT32){
+				((float *)out)[rx] = lut->f_ptr[d];
+			}
+			else if(type == CONVERT_FLOAT64){
+				((double *)out)[rx] = lut->d_ptr[d];
+			}
+			else{
+				((long *)out)[rx] = lut->l_ptr[d];
+			}
+		}
+	}
+}
+
+void registration_depth(t_registration *reg, const uint16_t *depth, char *out_bp, long stride,
+						const t_lookup *lut, int type)
+{
+	long i,j;
+	
+	//Colour pixels that no depth sample reaches read as "no data"
+	for(j=0;j<REG_WIDTH*REG_HEIGHT;j++){
+		reg->zbuffer[j] = 0x7FF;
+	}
+	for(i=0;i<REG_HEIGHT;i++){
+		char *out = out_bp + stride * i;
+		switch(type){
+			case CONVERT_UINT16:
+			case CONVERT_FLOAT16:
+				for(j=0;j<REG_WIDTH;j++) ((uint16_t *)out)[j] = lut->s_ptr[0x7FF];
+				break;
+			case CONVERT_FLOAT32:
+				for(j=0;j<REG_WIDTH;j++) ((float *)out)[j] = lut->f_ptr[0x7FF];
+				break;
+			case CONVERT_FLOAT64:
+				for(j=0;j<REG_WIDTH;j++) ((double *)out)[j] = lut->d_ptr[0x7FF];
+				break;
+			case CONVERT_LONG:
+				for(j=0;j<REG_WIDTH;j++) ((long *)out)[j] = lut->l_ptr[0x7FF];
+				break;
+		}
+	}
+	
+	switch(type){
+		case CONVERT_UINT16:
+		case CONVERT_FLOAT16:
+			register_depth_pass(reg, depth, out_bp, stride, lut, CONVERT_UINT16);
+			break;
+		case CONVERT_FLOAT32:
+			register_depth_pass(reg, depth, out_bp, stride, lut, CONVERT_FLOAT32);
+			break;
+		case CONVERT_FLOAT64:
+			register_depth_pass(reg, depth, out_bp, stride, lut, CONVERT_FLOAT64);
+			break;
+		case CONVERT_LONG:
+			register_depth_pass(reg, depth, out_bp, stride, lut, CONVERT_LONG);
+			break;
+	}
+}
+
+void registration_rgb(const t_registration *reg, const uint16_t *depth, const uint8_t *rgb, long rgb_width,
+					  char *out_bp, long stride, long planecount)
+{
+	long i,j,p, rx, ry;
+	uint16_t d;
+	long scale = rgb_width / REG_WIDTH;  //The tables are in 640x480 colour pixels
+	uint8_t *out;
+	
+	for(i=0,p=0;i<REG_HEIGHT;i++){
+		out = (uint8_t *)out_bp + stride * i;
+		for(j=0;j<REG_WIDTH;j++,p++){
+			d = depth[p];
+			rx = (reg->table[p*2] + reg->shift_x[d] + (1 << (REG_SHIFT-1))) >> REG_SHIFT;
+			ry = (reg->table[p*2+1] + reg->shift_y[d] + (1 << (REG_SHIFT-1))) >> REG_SHIFT;
+			if((reg->shift_x[d] == REG_INVALID) || (rx < 0) || (rx >= REG_WIDTH) || (ry < 0) || (ry >= REG_HEIGHT)){
+				if(planecount == 4){
+					out[0] = out[1] = out[2] = out[3] = 0;
+					out += 4;
+				}
+				else{
+					*out++ = 0;
+				}
+				continue;
+			}
+			rx *= scale;
+			ry *= scale;
+			if(planecount == 4){
+				const uint8_t *c = rgb + (ry * rgb_width + rx) * 3;
+				out[0] = 0xFF;
+				out[1] = c[0];
+				out[2] = c[1];
+				out[3] = c[2];
+				out += 4;
+			}
+			else{
+				*out++ = rgb[ry * rgb_width + rx];
+			}
+		}
+	}
+}
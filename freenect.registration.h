@@ -0,0 +1,90 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth 
+ jmp@jmpelletier.com
+ 
+ This file is part of jit.freenect.grab.
+  
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ 
+ http://www.apache.org/licenses/LICENSE-2.0
+ 
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ 
+ */
+
+/*
+ Registration between the depth and colour cameras and the calibration files it is built from.
+ Plain C with no Max or Jitter dependencies, jit.freenect.grab.c builds the tables when a device
+ opens and runs the passes in matrix_calc.
+*/
+
+#ifndef FREENECT_REGISTRATION_H
+#define FREENECT_REGISTRATION_H
+
+#include <stdint.h>
+#include "freenect.convert.h"
+
+#define REG_WIDTH 640               //Depth frame and colour pixels the tables map between
+#define REG_HEIGHT 480
+#define REG_SHIFT 8                 //Fraction bits of the registration tables
+#define REG_INVALID ((int32_t)0x80000000)
+
+//Pinhole intrinsics of both cameras, depth lens distortion (Brown-Conrady: k1, k2, p1, p2, k3),
+//the translation from depth to colour camera in metres and the disparity model mapping raw depth
+//to inverse metres: 1/z = raw * disparity_scale + disparity_offset
+typedef struct _calibration{
+	double depth_fx, depth_fy, depth_cx, depth_cy;
+	double depth_k1, depth_k2, depth_p1, depth_p2, depth_k3;
+	double rgb_fx, rgb_fy, rgb_cx, rgb_cy;
+	double tx, ty, tz;
+	double disparity_scale, disparity_offset;
+} t_calibration;
+
+enum registration_err{
+	REGISTRATION_ERR_NONE,
+	REGISTRATION_ERR_FILE,    //Could not be opened
+	REGISTRATION_ERR_FORMAT,  //Unknown group, or a group with a wrong count of values
+	REGISTRATION_ERR_FOCAL    //A focal length that is not positive
+};
+
+//Used until a calibration file is loaded
+extern const t_calibration registration_defaults;
+
+typedef struct _registration{
+	float    *rays;          //Undistorted x/z and -y/z per depth pixel, used to build the cloud
+	int32_t  *table;         //Colour pixel seen at infinity, x and y per depth pixel
+	int32_t  shift_x[0x800]; //Parallax per raw depth value, REG_INVALID for unusable values
+	int32_t  shift_y[0x800];
+	uint16_t *zbuffer;       //Nearest raw depth per colour pixel, used when registering depth
+	char     valid;
+} t_registration;
+
+//Read a calibration file, groups it leaves out get registration_defaults. On error cal is left as
+//it was and line is the line at fault, 0 when the error is not in a single line.
+int  registration_load(const char *path, t_calibration *cal, long *line);
+
+//Allocate the tables once, returns non-zero when out of memory
+int  registration_allocate(t_registration *reg);
+
+void registration_release(t_registration *reg);
+
+//Fill the tables from a calibration unless they are still valid, clear valid to rebuild them
+void registration_build(t_registration *reg, const t_calibration *cal);
+
+//Scatter a raw depth frame into the colour camera's REG_WIDTH x REG_HEIGHT view, converted through
+//the lookup table, whose enum convert_type is type. Pixels nothing lands on get the value of 0x7FF.
+void registration_depth(t_registration *reg, const uint16_t *depth, char *out_bp, long stride,
+						const t_lookup *lut, int type);
+
+//Gather colour into the depth camera's view. rgb is 3 planes or 1 plane of IR, rgb_width a
+//multiple of REG_WIDTH. Pixels without valid depth come out black with zero alpha.
+void registration_rgb(const t_registration *reg, const uint16_t *depth, const uint8_t *rgb, long rgb_width,
+					  char *out_bp, long stride, long planecount);
+
+#endif
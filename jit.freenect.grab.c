@@ -23,54 +23,194 @@
 #include <libusb.h>
 #include "libfreenect.h"
 #include "freenect_internal.h"
+#include "freenect.convert.h"
+#include "freenect.buffer.h"
+#include "freenect.capture.h"
+#include "freenect.pool.h"
+#include "freenect.cloud.h"
+#include "freenect.registration.h"
+#include <math.h>
 #include <time.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#endif
 
 #define DEPTH_WIDTH 640
 #define DEPTH_HEIGHT 480
 #define RGB_WIDTH 640
 #define RGB_HEIGHT 480
+#define RGB_HIGH_WIDTH 1280   //FREENECT_RESOLUTION_HIGH video, same field of view as 1280x960 plus 64 rows below
+#define RGB_HIGH_HEIGHT 1024
 #define MAX_DEVICES 8
-#define CLOUD_SIZE (DEPTH_WIDTH+2)*DEPTH_HEIGHT*2
-#define CLOUD_BLOCK 640
 #define DISTANCE_THRESH 10.f * 10.f
+#define MAX_THREADS POOL_MAX_THREADS
+#define RECORD_SLOTS BUFFER_SPARES //Frames the capture thread can queue ahead of the writer, each pins a buffer slot
+#define RECORD_WAIT 10000    //Microseconds the writer sleeps when it missed a wakeup
+#define RECORD_VERSION 1
+#define PLAYBACK_LAG 1000000 //Microseconds playback may fall behind the recorded timing before it stops catching up
+#define SYNTH_TICKS 2000000  //Device clock ticks per frame reported by the synthetic source (60MHz at 30fps)
+#define STATS_WINDOW 128     //Frames the rolling statistics cover
+#define STATS_COUNT 9        //Values reported by the stats attribute
+#define DEPTH_FRAME_BYTES(n, bits) (((n) * (bits) + 7) / 8)
+#define BACKGROUND_FRAMES 30 //Frames learnbg learns from by default
+#define BACKGROUND_MAX_FRAMES 1000
 
-typedef float float4[4];
-#define mult_scalar_float4(a,b,c) {int vector_iterator; for(vector_iterator=0;vector_iterator<4;vector_iterator++)c[vector_iterator] = a[vector_iterator] * b;}
+enum registration_mode{
+	REGISTER_NONE,
+	REGISTER_DEPTH,  //Depth output is mapped into the colour camera's view
+	REGISTER_RGB     //Colour output is mapped into the depth camera's view
+};
+
+//Background model behind the foreground mask, in raw units as they leave the filters. While
+//learning the valid values of each pixel are accumulated, then turned into a threshold.
+typedef struct _background{
+	uint16_t *threshold;  //Values below are foreground, 0x7FF where nothing valid was seen
+	uint16_t *nearest;    //Learning: smallest valid value, their sum, sum of squares and count
+	uint32_t *sum;
+	uint64_t *sumsq;
+	uint16_t *count;
+	long     frames;      //Frames still to learn, 0 when not learning
+	long     learnt;      //Frames in the model, 0 for none
+	float    deviation;   //Settings the thresholds were computed with
+	long     margin;
+	char     clear;       //The mask output needs clearing
+} t_background;
 
-typedef union _lookup_data{
-	long *l_ptr;
-	float *f_ptr;
-	double *d_ptr;
-}t_lookup;
+//Rolling timings, in microseconds of the host monotonic clock. Only updated while profile is on.
+typedef struct _stats{
+	uint32_t         latency[STATS_WINDOW];  //Callback arrival to end of matrix_calc, one entry per frame output
+	uint32_t         copy[STATS_WINDOW];     //Time matrix_calc spent converting
+	uint64_t         output[STATS_WINDOW];   //End of each matrix_calc that output frames, for fps
+	long             nlatency;
+	long             noutput;
+	long             depth_dropped;          //Frame buffer drop counts when profiling started
+	long             rgb_dropped;
+	long             count;                  //Backing store of the stats attribute
+	double           values[STATS_COUNT];
+} t_stats;
 
-enum thread_mess_type{
-	NONE,
-	OPEN,
-	CLOSE,
-	TERMINATE
+/*
+ Recording container, all fields little-endian:
+   t_record_header
+   t_record_frame followed by its payload, repeated. Depth payloads are 11 or 10-bit values packed
+     most significant bit first (libfreenect's FREENECT_DEPTH_11BIT_PACKED layout), video is raw.
+   t_record_index for every frame, in file order
+   t_record_trailer, which ends the file
+ Frames are only ever appended, the index and trailer are written by stop. A file without a
+ trailer (the patch crashed while recording) can still be read by walking the frame headers.
+*/
+enum record_frame_type{
+	RECORD_DEPTH = 1,
+	RECORD_VIDEO = 2
 };
 
-typedef struct _point3D{
-	float x;
-	float y;
-	float z;
-	float tex_x;
-	float tex_y;
-	float nx;
-	float ny;
-	float nz;
-	float r;
-	float g;
-	float b;
-	float a;
-} t_point3D;
-
-typedef struct _cloud{
-	t_point3D *points;
-	uint32_t count;
-	uint32_t size;
-	t_point3D *last;
-} t_cloud;
+typedef struct _record_header{
+	char             magic[4];       //"FNKR"
+	uint32_t         version;
+	uint16_t         depth_width;
+	uint16_t         depth_height;
+	uint16_t         depth_bits;     //11 or 10: bits per packed value
+	uint16_t         video_planes;   //3: RGB, 1: IR
+	uint16_t         video_width;
+	uint16_t         video_height;
+	uint32_t         reserved[3];
+} t_record_header;
+
+typedef struct _record_frame{
+	uint32_t         type;
+	uint32_t         timestamp;      //Device clock, as passed to the callback
+	uint64_t         time;           //Host monotonic clock in microseconds
+	uint32_t         bytes;          //Payload size
+	uint32_t         reserved;
+} t_record_frame;
+
+typedef struct _record_index{
+	uint64_t         offset;         //File offset of the frame's t_record_frame
+	uint64_t         time;
+	uint32_t         type;
+	uint32_t         timestamp;
+} t_record_index;
+
+typedef struct _record_trailer{
+	uint64_t         index_offset;
+	uint32_t         count;
+	char             magic[4];       //"FNKI"
+} t_record_trailer;
+
+typedef struct _record_slot{
+	t_frame_buffer   *buffer;        //The frame stays pinned in its frame buffer until written
+	long             index;
+	t_record_frame   frame;
+} t_record_slot;
+
+// The capture thread queues frames in a ring of slots and a writer thread drains it to disk.
+// Frames are not copied, the writer reads them from the frame buffers, see frame_buffer_pin.
+// The ring is single producer, single consumer: the callbacks never wait, when the ring is full
+// the frame is dropped and counted.
+typedef struct _recorder{
+	FILE             *file;
+	pthread_t        thread;
+	pthread_mutex_t  mutex;
+	pthread_cond_t   cond;
+	t_record_slot    slots[RECORD_SLOTS];
+	uint8_t          *packed;        //Writer scratch for depth packing
+	long             depth_bits;     //Bits per value of recorded depth
+	volatile long    head;           //Written by the capture thread
+	volatile long    tail;           //Written by the writer
+	volatile long    active;         //Callbacks may push
+	volatile long    pushing;        //Callbacks currently inside recorder_push
+	volatile long    stop;
+	long             dropped;
+	long             failed;
+	uint64_t         offset;
+	t_record_index   *index;
+	uint32_t         count;
+	uint32_t         capacity;
+} t_recorder;
+
+enum synth_scene{
+	SCENE_PLANES,   //Floor and a back wall moving to and fro
+	SCENE_SPHERES,  //Spheres orbiting in front of a wall
+	SCENE_NOISE     //Flat wall with per-pixel noise
+};
+
+// Virtual device, either replaying a recording or generating synthetic frames. A thread hands
+// frames to the same triple buffers the libfreenect callbacks fill. Recordings are mapped read-only.
+typedef struct _playback{
+	uint8_t               *map;
+	size_t                size;
+	const t_record_header *header;
+	const t_record_index  *index;   //Points into the map, or to our own copy if the file has no trailer
+	t_record_index        *scanned;
+	uint32_t              count;
+	pthread_t             thread;
+	pthread_mutex_t       mutex;
+	pthread_cond_t        cond;
+	long                  stop;
+	char                  running;
+} t_playback;
+
+//Arguments for a band of copy_depth_data, copy_depth_region or copy_rgb_data
+typedef struct _copy_job{
+	void              *source;
+	char              *out_bp;
+	t_jit_matrix_info *dest_info;
+	t_convert_depth   conv;   //Depth only
+	t_convert_region  region; //copy_depth_region only
+	int               bits;   //Bits per source value
+} t_copy_job;
+
+//Arguments for a band of copy_frames
+typedef struct _fused_job{
+	t_convert_frame   depth;
+	t_convert_frame   video;
+	t_convert_depth   conv;
+} t_fused_job;
 
 typedef struct _jit_freenect_grab
 {
@@ -89,19 +229,61 @@ typedef struct _jit_freenect_grab
 	long             tilt;
 	long             accelcount;
 	double           mks_accel[3];
-	uint8_t          *rgb_data, *rgb_swap;
-	uint16_t         *depth_data, *depth_swap;
+	t_frame_buffer   rgb_buffer;
+	t_frame_buffer   depth_buffer;
+	uint8_t          *rgb_data;
+	uint8_t          *depth_data;     //As stored in the buffer, depth_bits per value
+	long             depthformat;     //Requested depth format, 0: 11-bit, 1: 11-bit packed, 2: 10-bit packed
+	long             depth_bits;      //Bits per value of the open depth stream, 16 unless packed
+	uint16_t         *depth_unpacked; //Unpacked copy of packed depth for registration and the cloud
+	char             depth_stale;     //depth_unpacked is older than depth_data
+	long             spatial;         //Median filter on depth, 0: off, 1: 3x3, 2: 5x5
+	char             temporal;        //Temporal filter on depth
+	float            smoothing;       //0: none, 1: all history
+	long             motion;          //Change in raw units the filter follows at once
+	long             hold;            //Frames a hole keeps its last valid value
+	t_convert_temporal temporal_state;
+	char             filter_pending;  //depth_data has not been through the filters yet
+	char             depth_filtered;  //depth_data has, depth_frame gives the filtered values
+	t_background     background;
+	float            bg_deviation;    //Standard deviations of the background that are still background
+	long             bg_margin;       //Raw units closer than that before a value is foreground
+	long             roicount;
+	long             roi[4];          //Part of the depth frame output: x, y, width, height
+	long             decimate;        //Frame pixels per output pixel across and down
+	long             pooling;         //How decimated pixels are combined, enum convert_pooling
+	long             depth16;         //16-bit depth in a 2 plane char matrix, 0: off, 1: uint16, 2: float16
+	char             depth_enable;    //Outputs to update, disabled ones keep their last frame
+	char             rgb_enable;
+	char             depth_streaming; //Streams running on the device, see update_streams
+	char             rgb_streaming;
+	char             passthrough;     //Outputs that need no conversion reference the capture buffers
+	t_symbol         *referenced[2];  //Names of the depth and RGB outputs that do, see release_references
 	uint32_t         rgb_timestamp;
 	uint32_t         depth_timestamp;
-	char             have_depth_frames;
-	char             have_rgb_frames;
 	char             clear_depth;
 	t_cloud          cloud;
+	char             cloud_layout;
+	char             registration_mode;
+	t_symbol         *calibration_file;
+	t_calibration    calibration;
+	t_registration   registration;
 	t_symbol         *type;
-	float            *rgb;
 	freenect_raw_tilt_state *state;
-    
-    pthread_mutex_t  cb_mutex;
+	long             threads;
+	t_worker_pool    pool;
+	t_recorder       recorder;
+	t_playback       playback;
+	char             realtime;
+	char             loop;
+	long             scene;
+	float            holes;
+	float            rate;
+	char             profile;
+	t_stats          stats;
+	long             resolution;    //Requested video resolution, 0: 640x480, 1: 1280x1024
+	long             video_width;   //Size of the open video stream
+	long             video_height;
 } t_jit_freenect_grab;
 
 typedef struct _obj_list
@@ -115,6 +297,7 @@ void *_jit_freenect_grab_class;
 
 t_symbol *s_rgb, *s_RGB;
 t_symbol *s_ir, *s_IR;
+t_symbol *s_uint16, *s_float16;  //16-bit depth, Jitter has no matrix types for these
 
 t_jit_err               jit_freenect_grab_init(void);
 t_jit_freenect_grab     *jit_freenect_grab_new(void);
@@ -122,6 +305,10 @@ void                    jit_freenect_grab_free(t_jit_freenect_grab *x);
 
 void                    jit_freenect_grab_open(t_jit_freenect_grab *x, t_symbol *s, long argc, t_atom *argv);
 void                    jit_freenect_grab_close(t_jit_freenect_grab *x, t_symbol *s, long argc, t_atom *argv);
+void                    jit_freenect_grab_record(t_jit_freenect_grab *x, t_symbol *s, long argc, t_atom *argv);
+void                    jit_freenect_grab_stop(t_jit_freenect_grab *x, t_symbol *s, long argc, t_atom *argv);
+void                    jit_freenect_grab_learnbg(t_jit_freenect_grab *x, t_symbol *s, long argc, t_atom *argv);
+void                    jit_freenect_grab_clearbg(t_jit_freenect_grab *x, t_symbol *s, long argc, t_atom *argv);
 
 t_jit_err               jit_freenect_grab_get_ndevices(t_jit_freenect_grab *x, void *attr, long *ac, t_atom **av);
 t_jit_err               jit_freenect_grab_get_accel(t_jit_freenect_grab *x, void *attr, long *ac, t_atom **av);
@@ -130,258 +317,873 @@ void					jit_freenect_grab_set_tilt(t_jit_freenect_grab *x,  void *attr, long ar
 void					jit_freenect_grab_set_format(t_jit_freenect_grab *x,  void *attr, long argc, t_atom *argv);
 
 t_jit_err               jit_freenect_grab_set_mode(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av);
+t_jit_err               jit_freenect_grab_set_threads(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av);
+t_jit_err               jit_freenect_grab_set_resolution(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av);
+t_jit_err               jit_freenect_grab_set_depthformat(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av);
+t_jit_err               jit_freenect_grab_set_depth16(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av);
+t_jit_err               jit_freenect_grab_set_temporal(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av);
+t_jit_err               jit_freenect_grab_set_roi(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av);
+t_jit_err               jit_freenect_grab_set_profile(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av);
+t_jit_err               jit_freenect_grab_get_stats(t_jit_freenect_grab *x, void *attr, long *ac, t_atom **av);
+t_jit_err               jit_freenect_grab_set_calibration(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av);
 
 t_jit_err               jit_freenect_grab_matrix_calc(t_jit_freenect_grab *x, void *inputs, void *outputs);
-void                    copy_depth_data(uint16_t *source, char *out_bp, t_jit_matrix_info *dest_info, t_lookup *lut);
-//void                    build_geometry(t_jit_freenect_grab *x, void *matrix, char *out_bp, t_jit_matrix_info *dest_info);
-void                    copy_rgb_data(uint8_t *source, char *out_bp, t_jit_matrix_info *dest_info);
+void                    copy_depth_data(uint8_t *source, int bits, char *out_bp, t_jit_matrix_info *dest_info, const t_convert_depth *conv, t_worker_pool *pool);
+void                    copy_depth_region(uint8_t *source, int bits, char *out_bp, t_jit_matrix_info *dest_info, const t_convert_region *region,
+										  const t_convert_depth *conv, t_worker_pool *pool);
+void                    build_geometry(t_jit_freenect_grab *x, void *matrix, t_jit_matrix_info *dest_info);
+void                    copy_rgb_data(uint8_t *source, char *out_bp, t_jit_matrix_info *dest_info, t_worker_pool *pool);
+void                    copy_frames(uint8_t *depth, int depth_bits, char *depth_bp, t_jit_matrix_info *depth_info, uint8_t *rgb, char *rgb_bp,
+									t_jit_matrix_info *rgb_info, const t_convert_depth *conv, t_worker_pool *pool);
+void                    register_depth_data(t_jit_freenect_grab *x, char *out_bp, t_jit_matrix_info *dest_info);
+void                    register_rgb_data(t_jit_freenect_grab *x, char *out_bp, t_jit_matrix_info *dest_info);
 
 void                    rgb_callback(freenect_device *dev, void *pixels, uint32_t timestamp);
 void                    depth_callback(freenect_device *dev, void *pixels, uint32_t timestamp);
 
-pthread_t capture_thread;
-int       terminate_thread;
+t_capture capture;
 
 int object_count = 0;
 
 freenect_context *f_ctx = NULL;
 
-float xlut[640];
-float ylut[480];
+static int allocate_cloud(t_cloud *cloud){
+	if(cloud_allocate(cloud)){
+		error("Out of memory, could not allocate cloud.");
+		return 1;
+	}
+	return 0;
+}
 
-/*
+static int allocate_temporal(t_convert_temporal *temporal){
+	if(!temporal->history){
+		temporal->history = (uint16_t *)malloc(DEPTH_WIDTH * DEPTH_HEIGHT * sizeof(uint16_t));
+		temporal->age = (uint8_t *)malloc(DEPTH_WIDTH * DEPTH_HEIGHT);
+		if(!temporal->history || !temporal->age){
+			free(temporal->history);
+			free(temporal->age);
+			temporal->history = NULL;
+			temporal->age = NULL;
+			error("Out of memory, could not allocate temporal filter.");
+			return 1;
+		}
+		memset(temporal->history, 0xFF, DEPTH_WIDTH * DEPTH_HEIGHT * sizeof(uint16_t));  //CONVERT_NO_HISTORY
+		memset(temporal->age, 0, DEPTH_WIDTH * DEPTH_HEIGHT);
+	}
+	return 0;
+}
+
+//Forget every pixel's history, the next frame starts the filter afresh
+static void clear_temporal(t_convert_temporal *temporal){
+	if(temporal->history){
+		memset(temporal->history, 0xFF, DEPTH_WIDTH * DEPTH_HEIGHT * sizeof(uint16_t));
+		memset(temporal->age, 0, DEPTH_WIDTH * DEPTH_HEIGHT);
+	}
+}
+
+static void release_temporal(t_convert_temporal *temporal){
+	free(temporal->history);
+	free(temporal->age);
+	temporal->history = NULL;
+	temporal->age = NULL;
+}
+
+static void release_background(t_background *bg){
+	free(bg->threshold);
+	free(bg->nearest);
+	free(bg->sum);
+	free(bg->sumsq);
+	free(bg->count);
+	bg->threshold = NULL;
+	bg->nearest = NULL;
+	bg->sum = NULL;
+	bg->sumsq = NULL;
+	bg->count = NULL;
+	bg->frames = 0;
+	bg->learnt = 0;
+}
 
-static int grow_cloud(t_cloud *cloud){
-	t_point3D *temp = (t_point3D *)realloc(cloud->points, (cloud->size + CLOUD_BLOCK)*sizeof(t_point3D));
-	if(!temp){
-		error("Out of memory, cannot grow cloud.");
+static int allocate_background(t_background *bg){
+	if(!bg->threshold){
+		bg->threshold = (uint16_t *)malloc(DEPTH_WIDTH * DEPTH_HEIGHT * sizeof(uint16_t));
+		bg->nearest = (uint16_t *)malloc(DEPTH_WIDTH * DEPTH_HEIGHT * sizeof(uint16_t));
+		bg->sum = (uint32_t *)malloc(DEPTH_WIDTH * DEPTH_HEIGHT * sizeof(uint32_t));
+		bg->sumsq = (uint64_t *)malloc(DEPTH_WIDTH * DEPTH_HEIGHT * sizeof(uint64_t));
+		bg->count = (uint16_t *)malloc(DEPTH_WIDTH * DEPTH_HEIGHT * sizeof(uint16_t));
+		if(!bg->threshold || !bg->nearest || !bg->sum || !bg->sumsq || !bg->count){
+			release_background(bg);
+			error("Out of memory, could not allocate background.");
+			return 1;
+		}
+	}
+	return 0;
+}
+
+//Add a frame of raw values to the background being learnt
+static void learn_background(t_background *bg, const uint16_t *depth){
+	long i;
+	uint16_t raw;
+	
+	for(i=0;i<DEPTH_WIDTH * DEPTH_HEIGHT;i++){
+		raw = depth[i];
+		if(raw < 0x7FF){
+			bg->nearest[i] = MIN(bg->nearest[i], raw);
+			bg->sum[i] += raw;
+			bg->sumsq[i] += (uint32_t)raw * raw;
+			bg->count[i]++;
+		}
+	}
+}
+
+//Values below min(nearest, mean - deviation * sd) - margin are foreground
+static void calculate_background(t_background *bg, float deviation, long margin){
+	double mean, sd;
+	long i, threshold;
+	
+	for(i=0;i<DEPTH_WIDTH * DEPTH_HEIGHT;i++){
+		if(!bg->count[i]){
+			bg->threshold[i] = 0x7FF;
+			continue;
+		}
+		mean = (double)bg->sum[i] / bg->count[i];
+		sd = sqrt(MAX((double)bg->sumsq[i] / bg->count[i] - mean * mean, 0.));
+		threshold = MIN((long)bg->nearest[i], (long)floor(mean - deviation * sd)) - margin;
+		bg->threshold[i] = (uint16_t)MAX(threshold, 0);
+	}
+	bg->deviation = deviation;
+	bg->margin = margin;
+}
+
+static int allocate_registration(t_registration *reg){
+	if(registration_allocate(reg)){
+		error("Out of memory, could not allocate registration tables.");
 		return 1;
 	}
-	cloud->points = temp;
-	cloud->size += CLOUD_BLOCK;
 	return 0;
 }
 
-static void push_cloud_point(t_cloud *cloud, float x, float y, float z, float tx, float ty, 
-							 float nx, float ny, float nz, float r, float g, float b, float a){
-	if(cloud->count == cloud->size){
-		if(grow_cloud(cloud))return; //Out of memory
-	}
-	cloud->points[cloud->count].x = x;
-	cloud->points[cloud->count].y = y;
-	cloud->points[cloud->count].z = z;
-	cloud->points[cloud->count].tex_x = tx;
-	cloud->points[cloud->count].tex_y = ty;
-	cloud->points[cloud->count].nx = nx;
-	cloud->points[cloud->count].ny = ny;
-	cloud->points[cloud->count].nz = nz;
-	cloud->points[cloud->count].r = r;
-	cloud->points[cloud->count].g = g;
-	cloud->points[cloud->count].b = b;
-	cloud->points[cloud->count].a = a;
-	cloud->count++;
-}
-
-static void start_cloud_point(t_cloud *cloud, float x, float y, float z, float tx, float ty, 
-							  float nx, float ny, float nz, float r, float g, float b, float a){
-	if(cloud->count > (cloud->size - 2)){
-		if(grow_cloud(cloud))return; //Out of memory
-	}
-	cloud->points[cloud->count].x = x;
-	cloud->points[cloud->count].y = y;
-	cloud->points[cloud->count].z = z;
-	cloud->points[cloud->count].tex_x = tx;
-	cloud->points[cloud->count].tex_y = ty;
-	cloud->points[cloud->count].nx = nx;
-	cloud->points[cloud->count].ny = ny;
-	cloud->points[cloud->count].nz = nz;
-	cloud->points[cloud->count].r = r;
-	cloud->points[cloud->count].g = g;
-	cloud->points[cloud->count].b = b;
-	cloud->points[cloud->count].a = a;
-	cloud->count++;
-	cloud->points[cloud->count] = cloud->points[cloud->count-1];
-	cloud->count++;
-}
-
-static void terminate_cloud_point(t_cloud *cloud){
-	if(cloud->count == cloud->size){
-		if(grow_cloud(cloud))return; //Out of memory
-	}
-	cloud->points[cloud->count] = cloud->points[cloud->count-1];
-	cloud->count++;
-}
-
-static void release_cloud(t_cloud *cloud){
-	free(cloud->points);
-	cloud->points = NULL;
-	cloud->count = 0;
-}
-
-static void allocate_cloud(t_cloud *cloud){
-	if(!cloud->points){
-		cloud->points = (t_point3D *)malloc(CLOUD_SIZE*sizeof(t_point3D));
-		if(!cloud->points){
-			cloud->size = 0;
-			cloud->count = 0;
-			error("Out of memory, could not allocate cloud.");
-		}
-		cloud->size = CLOUD_SIZE;
-		cloud->count = 0; 
+//Format in freenect.registration.c, cal keeps its value when the file cannot be used
+static int load_calibration(t_symbol *file, t_calibration *cal){
+	char path[MAX_PATH_CHARS];
+	long line;
+	
+	path_nameconform(file->s_name, path, PATH_STYLE_NATIVE, PATH_TYPE_ABSOLUTE);
+	switch(registration_load(path, cal, &line)){
+		case REGISTRATION_ERR_NONE:
+			return 0;
+		case REGISTRATION_ERR_FILE:
+			error("jit.freenect.grab: could not open calibration file %s", file->s_name);
+			break;
+		case REGISTRATION_ERR_FORMAT:
+			error("jit.freenect.grab: line %ld of calibration file %s is malformed", line, file->s_name);
+			break;
+		case REGISTRATION_ERR_FOCAL:
+			error("jit.freenect.grab: invalid focal length in calibration file %s", file->s_name);
+			break;
 	}
+	return 1;
 }
- 
-*/
 
-void calculate_lut(t_lookup *lut, t_symbol *type, int mode){
+static int allocate_frame_buffer(t_frame_buffer *buf, long bytes){
+	if(frame_buffer_allocate(buf, bytes)){
+		error("Out of memory, could not allocate frame buffers.");
+		return 1;
+	}
+	return 0;
+}
+
+static uint64_t monotonic_us(void){
+#ifdef __APPLE__
+	static mach_timebase_info_data_t timebase;
+	if(!timebase.denom){
+		mach_timebase_info(&timebase);
+	}
+	return mach_absolute_time() * timebase.numer / timebase.denom / 1000;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+static void pack_depth(const uint16_t *in, uint8_t *out, long count, int depth_bits){
+	uint32_t bits = 0;
+	uint32_t mask = (1 << depth_bits) - 1;
+	int nbits = 0;
 	long i;
 	
-	if(type == _jit_sym_float32){
-		float *f_lut;
-		f_lut = (float *)realloc(lut->f_ptr, sizeof(float) * 0x800);
-		if(!f_lut){
-			error("Out of memory!");
+	for(i=0;i<count;i++){
+		bits = (bits << depth_bits) | (in[i] & mask);
+		nbits += depth_bits;
+		while(nbits >= 8){
+			nbits -= 8;
+			*out++ = (uint8_t)(bits >> nbits);
+		}
+	}
+	if(nbits){
+		*out = (uint8_t)(bits << (8 - nbits));
+	}
+}
+
+static int recorder_write(t_recorder *rec, const void *data, size_t bytes){
+	if(rec->failed || fwrite(data, 1, bytes, rec->file) != bytes){
+		rec->failed = 1;
+		return 1;
+	}
+	rec->offset += bytes;
+	return 0;
+}
+
+static void recorder_write_frame(t_recorder *rec, t_record_slot *slot){
+	t_record_frame frame = slot->frame;
+	const uint8_t *payload = slot->buffer->slots[slot->index];
+	t_record_index *entry;
+	
+	//Unpacked depth is packed here, packed streams are recorded as they come
+	if((frame.type == RECORD_DEPTH) && (frame.bytes == DEPTH_WIDTH * DEPTH_HEIGHT * sizeof(uint16_t))){
+		pack_depth((const uint16_t *)payload, rec->packed, DEPTH_WIDTH * DEPTH_HEIGHT, rec->depth_bits);
+		frame.bytes = DEPTH_FRAME_BYTES(DEPTH_WIDTH * DEPTH_HEIGHT, rec->depth_bits);
+		payload = rec->packed;
+	}
+	
+	if(rec->count == rec->capacity){
+		uint32_t capacity = rec->capacity ? rec->capacity * 2 : 1024;
+		entry = (t_record_index *)realloc(rec->index, capacity * sizeof(t_record_index));
+		if(!entry){
+			rec->failed = 1;
 			return;
 		}
-		lut->f_ptr = f_lut;
-		
-		switch(mode){
-			case 0:
-				for(i=0;i<0x800;i++){
-					lut->f_ptr[i] = (float)i;
-				}
-				break;
-			case 1:
-				for(i=0;i<0x800;i++){
-					lut->f_ptr[i] = (float)i * (1.f / (float)0x7FF);
-				}
-				break;
-			case 2:
-				for(i=0;i<0x800;i++){
-					lut->f_ptr[i] = 1.f - ((float)i * (1.f / (float)0x7FF));
-				}
-				break;
-			case 3:
-			case 4:
-				for(i=0;i<0x800;i++){
-					lut->f_ptr[i] = 10.f / (3.33f + (float)i * -0.00307f);
-				} 
+		rec->index = entry;
+		rec->capacity = capacity;
+	}
+	entry = &rec->index[rec->count];
+	entry->offset = rec->offset;
+	entry->time = frame.time;
+	entry->type = frame.type;
+	entry->timestamp = frame.timestamp;
+	
+	if(!recorder_write(rec, &frame, sizeof(frame)) && !recorder_write(rec, payload, frame.bytes)){
+		rec->count++;
+	}
+}
+
+static void *recorder_threadfunc(void *arg){
+	t_recorder *rec = (t_recorder *)arg;
+	t_record_slot *slot;
+	t_record_trailer trailer;
+	struct timeval now;
+	struct timespec until;
+	long stop;
+	
+	while(1){
+		stop = rec->stop;
+		__sync_synchronize();
+		if(rec->tail == rec->head){
+			if(stop){
 				break;
+			}
+			gettimeofday(&now, NULL);
+			until.tv_sec = now.tv_sec;
+			until.tv_nsec = (now.tv_usec + RECORD_WAIT) * 1000;
+			if(until.tv_nsec >= 1000000000){
+				until.tv_sec++;
+				until.tv_nsec -= 1000000000;
+			}
+			pthread_mutex_lock(&rec->mutex);
+			if(rec->tail == rec->head && !rec->stop){
+				pthread_cond_timedwait(&rec->cond, &rec->mutex, &until);
+			}
+			pthread_mutex_unlock(&rec->mutex);
+			continue;
 		}
+		slot = &rec->slots[rec->tail % RECORD_SLOTS];
+		recorder_write_frame(rec, slot);
+		frame_buffer_unpin(slot->buffer, slot->index);
+		__sync_synchronize();  //Done with the slot before the capture thread may reuse it
+		rec->tail++;
 	}
-	else if(type == _jit_sym_long){
-		long *l_lut;
-		l_lut = (long *)realloc(lut->l_ptr, sizeof(long) * 0x800);
-		if(!l_lut){
-			error("Out of memory!");
-			return;
+	
+	trailer.index_offset = rec->offset;
+	trailer.count = rec->count;
+	memcpy(trailer.magic, "FNKI", 4);
+	recorder_write(rec, rec->index, rec->count * sizeof(t_record_index));
+	recorder_write(rec, &trailer, sizeof(trailer));
+	
+	pthread_exit(NULL);
+	return NULL;
+}
+
+static int recorder_start(t_recorder *rec, t_symbol *file, long depth_bits, long video_planes, long video_width, long video_height){
+	char path[MAX_PATH_CHARS];
+	t_record_header header;
+	
+	memset(rec, 0, sizeof(t_recorder));
+	path_nameconform(file->s_name, path, PATH_STYLE_NATIVE, PATH_TYPE_ABSOLUTE);
+	rec->file = fopen(path, "wb");
+	if(!rec->file){
+		error("jit.freenect.grab: could not open %s for recording", file->s_name);
+		return 1;
+	}
+	
+	rec->packed = (uint8_t *)malloc(DEPTH_FRAME_BYTES(DEPTH_WIDTH * DEPTH_HEIGHT, 11));
+	if(!rec->packed){
+		error("Out of memory, could not allocate record buffers.");
+		fclose(rec->file);
+		rec->file = NULL;
+		return 1;
+	}
+	rec->depth_bits = (depth_bits == 16) ? 11 : depth_bits;
+	
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "FNKR", 4);
+	header.version = RECORD_VERSION;
+	header.depth_width = DEPTH_WIDTH;
+	header.depth_height = DEPTH_HEIGHT;
+	header.depth_bits = rec->depth_bits;
+	header.video_planes = video_planes;
+	header.video_width = video_width;
+	header.video_height = video_height;
+	setvbuf(rec->file, NULL, _IOFBF, 1 << 20);
+	recorder_write(rec, &header, sizeof(header));
+	
+	pthread_mutex_init(&rec->mutex, NULL);
+	pthread_cond_init(&rec->cond, NULL);
+	if(rec->failed || pthread_create(&rec->thread, NULL, recorder_threadfunc, rec)){
+		error("jit.freenect.grab: could not start recording to %s", file->s_name);
+		pthread_mutex_destroy(&rec->mutex);
+		pthread_cond_destroy(&rec->cond);
+		fclose(rec->file);
+		free(rec->packed);
+		memset(rec, 0, sizeof(t_recorder));
+		return 1;
+	}
+	__sync_synchronize();
+	rec->active = 1;
+	return 0;
+}
+
+static void recorder_stop(t_recorder *rec){
+	if(!rec->active){
+		return;
+	}
+	rec->active = 0;
+	__sync_synchronize();
+	//A callback that saw active before we cleared it finishes queueing. The atomic read is a full
+	//barrier, so the load is not hoisted, and the sleep gives the capture thread the core.
+	while(__sync_add_and_fetch(&rec->pushing, 0)){
+		usleep(100);
+	}
+	
+	pthread_mutex_lock(&rec->mutex);
+	rec->stop = 1;
+	pthread_cond_signal(&rec->cond);
+	pthread_mutex_unlock(&rec->mutex);
+	pthread_join(rec->thread, NULL);
+	
+	if(fclose(rec->file) || rec->failed){
+		error("jit.freenect.grab: writing the recording failed, the file is incomplete");
+	}
+	else{
+		post("jit.freenect.grab: recorded %u frames, %ld dropped", rec->count, rec->dropped);
+	}
+	pthread_mutex_destroy(&rec->mutex);
+	pthread_cond_destroy(&rec->cond);
+	free(rec->packed);
+	free(rec->index);
+	memset(rec, 0, sizeof(t_recorder));
+}
+
+//Capture thread, before publishing: queue the frame in the buffer's back slot for the writer, or
+//drop it if the writer is behind.
+static void recorder_push(t_recorder *rec, uint32_t type, t_frame_buffer *buf, uint32_t timestamp){
+	t_record_slot *slot;
+	long index;
+	
+	__sync_fetch_and_add(&rec->pushing, 1);
+	if(rec->active){
+		if((rec->head - rec->tail >= RECORD_SLOTS) || ((index = frame_buffer_pin(buf)) < 0)){
+			rec->dropped++;
 		}
-		lut->l_ptr = l_lut;
-		
-		switch(mode){
-			case 0:
-			case 1:
-				for(i=0;i<0x800;i++){
-					lut->l_ptr[i] = i;
-				}
-				break;
-			case 2:
-				for(i=0;i<0x800;i++){
-					lut->l_ptr[i] = 0x7FF - i;
+		else{
+			slot = &rec->slots[rec->head % RECORD_SLOTS];
+			slot->buffer = buf;
+			slot->index = index;
+			slot->frame.type = type;
+			slot->frame.timestamp = timestamp;
+			slot->frame.time = monotonic_us();
+			slot->frame.bytes = buf->bytes;
+			slot->frame.reserved = 0;
+			__sync_synchronize();  //Slot contents are visible before the writer sees the new head
+			rec->head++;
+			//Never wait for the writer, it polls if it misses this wakeup
+			if(!pthread_mutex_trylock(&rec->mutex)){
+				pthread_cond_signal(&rec->cond);
+				pthread_mutex_unlock(&rec->mutex);
+			}
+		}
+	}
+	__sync_fetch_and_sub(&rec->pushing, 1);
+}
+
+//Wait for the writer to finish the queued frames, before the frame buffers they are in go away
+static void recorder_flush(t_recorder *rec){
+	while(rec->active && (rec->tail != rec->head)){
+		usleep(1000);
+	}
+}
+
+//Payload size of a frame of a recording, 0 for an unknown type
+static uint64_t record_frame_bytes(const t_record_header *header, uint32_t type){
+	if(type == RECORD_DEPTH){
+		return DEPTH_FRAME_BYTES((uint64_t)header->depth_width * header->depth_height, header->depth_bits);
+	}
+	if(type == RECORD_VIDEO){
+		return (uint64_t)header->video_width * header->video_height * header->video_planes;
+	}
+	return 0;
+}
+
+//Whether a frame at offset ends before end and has the size its type has in this recording
+static int playback_frame_valid(const t_playback *pb, uint64_t offset, uint64_t end){
+	const t_record_frame *frame;
+	
+	if((offset < sizeof(t_record_header)) || (offset > end) || (end - offset < sizeof(t_record_frame))){
+		return 0;
+	}
+	frame = (const t_record_frame *)(pb->map + offset);
+	return (frame->bytes == record_frame_bytes(pb->header, frame->type)) && frame->bytes &&
+		   (frame->bytes <= end - offset - sizeof(t_record_frame));
+}
+
+//Map a recording and find its frames. Returns 0 on success.
+static int playback_map(t_playback *pb, const char *file){
+	char path[MAX_PATH_CHARS];
+	struct stat st;
+	const t_record_trailer *trailer;
+	const t_record_frame *frame;
+	const t_record_index *index;
+	uint64_t offset, end;
+	uint32_t i, capacity = 0;
+	int fd;
+	
+	path_nameconform(file, path, PATH_STYLE_NATIVE, PATH_TYPE_ABSOLUTE);
+	fd = open(path, O_RDONLY);
+	if(fd < 0){
+		error("jit.freenect.grab: could not open recording %s", file);
+		return 1;
+	}
+	if(fstat(fd, &st) || (st.st_size < (off_t)sizeof(t_record_header))){
+		error("jit.freenect.grab: %s is not a recording", file);
+		close(fd);
+		return 1;
+	}
+	pb->size = st.st_size;
+	pb->map = (uint8_t *)mmap(NULL, pb->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(pb->map == MAP_FAILED){
+		pb->map = NULL;
+		error("jit.freenect.grab: could not map recording %s", file);
+		return 1;
+	}
+	
+	pb->header = (const t_record_header *)pb->map;
+	if(memcmp(pb->header->magic, "FNKR", 4) || (pb->header->version != RECORD_VERSION)){
+		error("jit.freenect.grab: %s is not a recording", file);
+		return 1;
+	}
+	if((pb->header->depth_width != DEPTH_WIDTH) || (pb->header->depth_height != DEPTH_HEIGHT) ||
+	   !(((pb->header->video_width == RGB_WIDTH) && (pb->header->video_height == RGB_HEIGHT)) ||
+		 ((pb->header->video_width == RGB_HIGH_WIDTH) && (pb->header->video_height == RGB_HIGH_HEIGHT)))){
+		error("jit.freenect.grab: unsupported resolution in recording %s", file);
+		return 1;
+	}
+	if((pb->header->depth_bits != 11) && (pb->header->depth_bits != 10)){
+		error("jit.freenect.grab: unsupported depth format in recording %s", file);
+		return 1;
+	}
+	if((pb->header->video_planes != 3) && (pb->header->video_planes != 1)){
+		error("jit.freenect.grab: unsupported video format in recording %s", file);
+		return 1;
+	}
+	
+	end = pb->size;
+	if(pb->size >= sizeof(t_record_header) + sizeof(t_record_trailer)){
+		trailer = (const t_record_trailer *)(pb->map + pb->size - sizeof(t_record_trailer));
+		end -= sizeof(t_record_trailer);
+		if(!memcmp(trailer->magic, "FNKI", 4) && (trailer->index_offset <= end) &&
+		   ((end - trailer->index_offset) / sizeof(t_record_index) >= trailer->count)){
+			//Every entry must point at a whole frame of its type before the index
+			index = (const t_record_index *)(pb->map + trailer->index_offset);
+			for(i=0;i<trailer->count;i++){
+				if(!playback_frame_valid(pb, index[i].offset, trailer->index_offset) ||
+				   (((const t_record_frame *)(pb->map + index[i].offset))->type != index[i].type)){
+					break;
 				}
-				break;
-			case 3:
-				for(i=0;i<0x800;i++){
-					lut->l_ptr[i] = (long)(-10.f / (3.33f + (float)i * -0.00307f));
-				} 
-				break;
-			case 4:
-				for(i=0;i<0x800;i++){
-					lut->l_ptr[i] = (long)(-10.f / (3.33f + (float)i * -0.00307f));
-				} 
-				break;
+			}
+			if(i == trailer->count){
+				pb->index = index;
+				pb->count = trailer->count;
+				return 0;
+			}
+			error("jit.freenect.grab: %s has an invalid index, scanning its frames", file);
 		}
 	}
-	else if(type == _jit_sym_float64){
-		double *d_lut;
-		d_lut = (double *)realloc(lut->d_ptr, sizeof(double) * 0x800);
-		if(!d_lut){
-			error("Out of memory!");
-			return;
+	
+	//No usable index, the recording was interrupted. Walk the frames that were written completely.
+	end = pb->size;
+	offset = sizeof(t_record_header);
+	while(playback_frame_valid(pb, offset, end)){
+		frame = (const t_record_frame *)(pb->map + offset);
+		if(pb->count == capacity){
+			t_record_index *scanned;
+			capacity = capacity ? capacity * 2 : 1024;
+			scanned = (t_record_index *)realloc(pb->scanned, capacity * sizeof(t_record_index));
+			if(!scanned){
+				error("Out of memory, could not index recording.");
+				return 1;
+			}
+			pb->scanned = scanned;
 		}
-		lut->d_ptr = d_lut;
+		pb->scanned[pb->count].offset = offset;
+		pb->scanned[pb->count].time = frame->time;
+		pb->scanned[pb->count].type = frame->type;
+		pb->scanned[pb->count].timestamp = frame->timestamp;
+		pb->count++;
+		offset += sizeof(t_record_frame) + frame->bytes;
+	}
+	pb->index = pb->scanned;
+	post("jit.freenect.grab: %s has no index, recovered %u frames", file, pb->count);
+	return 0;
+}
+
+static void playback_unmap(t_playback *pb){
+	if(pb->map){
+		munmap(pb->map, pb->size);
+	}
+	free(pb->scanned);
+	pb->map = NULL;
+	pb->size = 0;
+	pb->header = NULL;
+	pb->index = NULL;
+	pb->scanned = NULL;
+	pb->count = 0;
+}
+
+//Sleep until the monotonic clock reaches target or playback is stopped. Called with the mutex held.
+static void playback_wait(t_playback *pb, uint64_t target){
+	struct timeval now;
+	struct timespec until;
+	uint64_t clock = monotonic_us();
+	uint64_t delay = (target > clock) ? target - clock : 0;  //The caller's clock reading may be stale
+	
+	gettimeofday(&now, NULL);
+	until.tv_sec = now.tv_sec + delay / 1000000;
+	until.tv_nsec = (now.tv_usec + delay % 1000000) * 1000;
+	if(until.tv_nsec >= 1000000000){
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(&pb->cond, &pb->mutex, &until);
+}
+
+static void *playback_threadfunc(void *arg){
+	t_jit_freenect_grab *x = (t_jit_freenect_grab *)arg;
+	t_playback *pb = &x->playback;
+	const t_record_index *entry;
+	const t_record_frame *frame;
+	const uint8_t *payload;
+	uint64_t start, first, target, now;
+	uint32_t i = 0;
+	
+	pthread_mutex_lock(&pb->mutex);
+	start = monotonic_us();
+	first = pb->index[0].time;
+	while(!pb->stop){
+		if(i == pb->count){
+			if(!x->loop){
+				pthread_cond_wait(&pb->cond, &pb->mutex);
+				continue;
+			}
+			i = 0;
+			start = monotonic_us();
+			first = pb->index[0].time;
+		}
+		entry = &pb->index[i];
 		
-		switch(mode){
-			case 0:
-				for(i=0;i<0x800;i++){
-					lut->d_ptr[i] = (double)i;
-				}
-				break;
-			case 1:
-				for(i=0;i<0x800;i++){
-					lut->d_ptr[i] = (double)i * (1.0 / (double)0x7FF);
+		if(x->realtime){
+			target = start + (entry->time - first);
+			now = monotonic_us();
+			if(now > target + PLAYBACK_LAG){
+				start = now - (entry->time - first);  //Too far behind (or was free-running), resync
+			}
+			else if(target > now){
+				playback_wait(pb, target);
+				continue;
+			}
+		}
+		pthread_mutex_unlock(&pb->mutex);
+		
+		frame = (const t_record_frame *)(pb->map + entry->offset);
+		payload = (const uint8_t *)(frame + 1);
+		//Depth stays packed, matrix_calc unpacks it while converting
+		if(frame->type == RECORD_DEPTH){
+			if(frame->bytes == x->depth_buffer.bytes){
+				memcpy(x->depth_buffer.slots[x->depth_buffer.back], payload, frame->bytes);
+				recorder_push(&x->recorder, RECORD_DEPTH, &x->depth_buffer, frame->timestamp);
+				frame_buffer_publish(&x->depth_buffer, frame->timestamp, x->profile ? monotonic_us() : 0);
+			}
+		}
+		else if(frame->type == RECORD_VIDEO){
+			if(frame->bytes == x->rgb_buffer.bytes){
+				memcpy(x->rgb_buffer.slots[x->rgb_buffer.back], payload, frame->bytes);
+				recorder_push(&x->recorder, RECORD_VIDEO, &x->rgb_buffer, frame->timestamp);
+				frame_buffer_publish(&x->rgb_buffer, frame->timestamp, x->profile ? monotonic_us() : 0);
+			}
+		}
+		
+		pthread_mutex_lock(&pb->mutex);
+		i++;
+	}
+	pthread_mutex_unlock(&pb->mutex);
+	
+	pthread_exit(NULL);
+	return NULL;
+}
+
+static uint16_t metres_to_raw(float z){
+	float raw;
+	
+	if(z <= 0.f){
+		return 0x7FF;
+	}
+	raw = (1.f / z - 3.3309495161f) / -0.0030711016f;
+	return ((raw < 0.f) || (raw >= 2047.f)) ? 0x7FF : (uint16_t)raw;
+}
+
+static uint32_t xorshift32(uint32_t *state){
+	uint32_t v = *state;
+	v ^= v << 13;
+	v ^= v >> 17;
+	v ^= v << 5;
+	return *state = v;
+}
+
+//Raw depth for a scene at a given frame. Everything is a function of frame so runs are reproducible.
+static void synth_depth(uint16_t *out, const float *rays, long scene, float holes, uint32_t frame){
+	float t = frame * (1.f / 30.f);
+	float wall = 3.5f + sinf(t);
+	float c[3][3], r2[3];
+	float z, rx, ry, a, b, d;
+	uint32_t seed = frame * 2654435761u + 1;
+	uint32_t hole = (uint32_t)(holes * 4294967295.f);
+	long i, k;
+	
+	for(k=0;k<3;k++){
+		c[k][0] = 0.6f * cosf(t + k * 2.094f);
+		c[k][1] = 0.3f * sinf(2.f * t + k);
+		c[k][2] = 2.f + 0.6f * sinf(t + k * 2.094f);
+		r2[k] = 0.1f + 0.05f * k;
+	}
+	
+	for(i=0;i<DEPTH_WIDTH*DEPTH_HEIGHT;i++){
+		rx = rays[2*i];
+		ry = rays[2*i+1];
+		switch(scene){
+			case SCENE_PLANES:
+				z = wall;
+				if(ry < 0.f && (-1.f / ry) < z){
+					z = -1.f / ry;  //Floor one metre below the camera
 				}
+				out[i] = metres_to_raw(z);
 				break;
-			case 2:
-				for(i=0;i<0x800;i++){
-					lut->d_ptr[i] = 1.0 - ((double)i * (1.0 / (double)0x7FF));
+			case SCENE_SPHERES:
+				z = 4.f;
+				a = rx * rx + ry * ry + 1.f;
+				for(k=0;k<3;k++){
+					b = rx * c[k][0] + ry * c[k][1] + c[k][2];
+					d = b * b - a * (c[k][0] * c[k][0] + c[k][1] * c[k][1] + c[k][2] * c[k][2] - r2[k]);
+					if(d >= 0.f && (b - sqrtf(d)) / a < z){
+						z = (b - sqrtf(d)) / a;
+					}
 				}
+				out[i] = metres_to_raw(z);
 				break;
-			case 3:
-				for(i=0;i<0x800;i++){
-					lut->d_ptr[i] = -10.0 / (3.33 + (double)i * -0.00307);
-				} 
-				break;
-			case 4:
-				for(i=0;i<0x800;i++){
-					lut->d_ptr[i] = -10.0 / (3.33 + (double)i * -0.00307);
-				} 
+			default:
+				out[i] = 800 + (xorshift32(&seed) % 41);  //About 2m, +-20 raw
 				break;
 		}
+		if(hole && (xorshift32(&seed) < hole)){
+			out[i] = 0x7FF;
+		}
 	}
-	else if(type == NULL){
-		if(lut->f_ptr){
-			free(lut->f_ptr);
-			lut->f_ptr = NULL;
+}
+
+//Scrolling colour bars for RGB, a moving checkerboard over a ramp for IR
+static void synth_video(uint8_t *out, long planes, long width, long height, uint32_t frame){
+	static const uint8_t bars[8][3] = {
+		{255,255,255}, {255,255,0}, {0,255,255}, {0,255,0}, {255,0,255}, {255,0,0}, {0,0,255}, {0,0,0}
+	};
+	long i, j, bar;
+	
+	for(i=0;i<height;i++){
+		for(j=0;j<width;j++){
+			if(planes == 3){
+				bar = ((j + frame * 4) / (width / 8)) & 7;
+				*out++ = bars[bar][0];
+				*out++ = bars[bar][1];
+				*out++ = bars[bar][2];
+			}
+			else{
+				*out++ = (((((j + frame) / 40) ^ (i / 40)) & 1) ? 128 : 0) + (i * 127) / height;
+			}
 		}
 	}
-	else{
-		error("Invalid type for lookup table calculation. char not supported.");
+}
+
+static void *synth_threadfunc(void *arg){
+	t_jit_freenect_grab *x = (t_jit_freenect_grab *)arg;
+	t_playback *pb = &x->playback;
+	long planes = x->rgb_buffer.bytes / (x->video_width * x->video_height);
+	uint64_t next, now;
+	uint32_t frame = 0;
+	
+	pthread_mutex_lock(&pb->mutex);
+	next = monotonic_us();
+	while(!pb->stop){
+		if(x->realtime){
+			now = monotonic_us();
+			if(next > now){
+				playback_wait(pb, next);
+				continue;
+			}
+			next += (uint64_t)(1000000.f / x->rate);
+			if(now > next + PLAYBACK_LAG){
+				next = now;
+			}
+		}
+		//The rays are rebuilt under the mutex when the calibration changes
+		synth_depth((uint16_t *)x->depth_buffer.slots[x->depth_buffer.back], x->registration.rays, x->scene, x->holes, frame);
+		pthread_mutex_unlock(&pb->mutex);
+		
+		recorder_push(&x->recorder, RECORD_DEPTH, &x->depth_buffer, frame * SYNTH_TICKS);
+		frame_buffer_publish(&x->depth_buffer, frame * SYNTH_TICKS, x->profile ? monotonic_us() : 0);
+		synth_video(x->rgb_buffer.slots[x->rgb_buffer.back], planes, x->video_width, x->video_height, frame);
+		recorder_push(&x->recorder, RECORD_VIDEO, &x->rgb_buffer, frame * SYNTH_TICKS);
+		frame_buffer_publish(&x->rgb_buffer, frame * SYNTH_TICKS, x->profile ? monotonic_us() : 0);
+		
+		pthread_mutex_lock(&pb->mutex);
+		frame++;
+	}
+	pthread_mutex_unlock(&pb->mutex);
+	
+	pthread_exit(NULL);
+	return NULL;
+}
+
+static void reset_stats(t_stats *stats, t_frame_buffer *depth, t_frame_buffer *rgb){
+	stats->nlatency = 0;
+	stats->noutput = 0;
+	stats->depth_dropped = depth->dropped;
+	stats->rgb_dropped = rgb->dropped;
+}
+
+//End of a matrix_calc that output frames: record conversion time and the latency of each new frame
+static void update_stats(t_stats *stats, uint64_t start, uint64_t rgb_arrival, uint64_t depth_arrival){
+	uint64_t end = monotonic_us();
+	
+	stats->copy[stats->noutput % STATS_WINDOW] = (uint32_t)(end - start);
+	stats->output[stats->noutput % STATS_WINDOW] = end;
+	stats->noutput++;
+	//Frames that arrived before profiling was switched on have no arrival time
+	if(rgb_arrival){
+		stats->latency[stats->nlatency++ % STATS_WINDOW] = (uint32_t)(end - rgb_arrival);
+	}
+	if(depth_arrival){
+		stats->latency[stats->nlatency++ % STATS_WINDOW] = (uint32_t)(end - depth_arrival);
+	}
+}
+
+static int compare_uint32(const void *a, const void *b){
+	uint32_t va = *(const uint32_t *)a;
+	uint32_t vb = *(const uint32_t *)b;
+	return (va > vb) - (va < vb);
+}
+
+//p50, p95 and p99 of a window of samples, in milliseconds
+static void percentiles(const uint32_t *samples, long count, double *out){
+	uint32_t sorted[STATS_WINDOW];
+	long n = MIN(count, STATS_WINDOW);
+	
+	if(!n){
+		out[0] = out[1] = out[2] = 0.;
 		return;
 	}
+	memcpy(sorted, samples, n * sizeof(uint32_t));
+	qsort(sorted, n, sizeof(uint32_t), compare_uint32);
+	out[0] = sorted[(n - 1) * 50 / 100] * 0.001;
+	out[1] = sorted[(n - 1) * 95 / 100] * 0.001;
+	out[2] = sorted[(n - 1) * 99 / 100] * 0.001;
 }
 
-void *capture_threadfunc(void *arg)
-{	
-	freenect_context *context;
-		
-	if(!f_ctx){
-		if (freenect_init(&context, NULL) < 0) {
-			printf("freenect_init() failed\n");
-			goto out;
-		}
+static int convert_type(t_symbol *type){
+	if(type == _jit_sym_char)return CONVERT_CHAR;
+	if(type == _jit_sym_long)return CONVERT_LONG;
+	if(type == _jit_sym_float32)return CONVERT_FLOAT32;
+	if(type == _jit_sym_float64)return CONVERT_FLOAT64;
+	if(type == s_uint16)return CONVERT_UINT16;
+	if(type == s_float16)return CONVERT_FLOAT16;
+	return CONVERT_NONE;
+}
+
+void calculate_lut(t_lookup *lut, t_symbol *type, int mode, const t_calibration *cal){
+	switch(convert_lut(lut, type ? convert_type(type) : CONVERT_NONE, mode, (float)cal->disparity_scale, (float)cal->disparity_offset)){
+		case CONVERT_ERR_MEMORY:
+			error("Out of memory!");
+			break;
+		case CONVERT_ERR_TYPE:
+			error("Invalid type for lookup table calculation. char, and uint16 in modes 3 and 4, not supported.");
+			break;
 	}
+}
+
+static void capture_failed(int err){
+	error("jit.freenect.grab: could not process events (%d), close and reopen the devices.", err);
+}
+
+static int start_capture_thread(void){
+	freenect_context *context;
 	
-	f_ctx = context;
+	if (freenect_init(&context, NULL) < 0) {
+		error("freenect_init() failed");
+		return 1;
+	}
 	
-	terminate_thread = 0;
-		
-	while(!terminate_thread){
-		if(f_ctx->first){
-			if(freenect_process_events(f_ctx) < 0){
-				error("Could not process events.");
-				break;
-			}
-		}
-		
-		sleep(0);
+	if (capture_start(&capture, context, capture_failed)) {
+		error("Failed to create capture thread.");
+		freenect_shutdown(context);
+		return 1;
 	}
 	
-out:
+	f_ctx = context;
+	return 0;
+}
+
+static void stop_capture_thread(void){
+	capture_stop(&capture);
+	
 	freenect_shutdown(f_ctx);
 	f_ctx = NULL;
-	pthread_exit(NULL);
-	return NULL;
+}
+
+//Planes of the video stream: 1 for IR, 3 for RGB
+static long video_planes(t_jit_freenect_grab *x){
+	if(x->device){
+		return (x->device->video_format == FREENECT_VIDEO_IR_8BIT) ? 1 : 3;
+	}
+	if(x->playback.header){
+		return x->playback.header->video_planes;
+	}
+	return (x->format.a_w.w_sym == s_ir) ? 1 : 3;
 }
 
 t_jit_err jit_freenect_grab_init(void)
@@ -390,18 +1192,19 @@ t_jit_err jit_freenect_grab_init(void)
 	t_jit_object *attr;
 	t_jit_object *mop,*output;
 	t_atom a[4];
-	int i;
 	
 	s_rgb = gensym("rgb");
 	s_RGB = gensym("RGB");
 	s_ir = gensym("ir");
 	s_IR = gensym("IR");
+	s_uint16 = gensym("uint16");
+	s_float16 = gensym("float16");
 	
 	_jit_freenect_grab_class = jit_class_new("jit_freenect_grab",(method)jit_freenect_grab_new,
 											 (method)jit_freenect_grab_free, sizeof(t_jit_freenect_grab),0L);
   	
 	//add mop
-	mop = (t_jit_object *)jit_object_new(_jit_sym_jit_mop,0,2); //0 inputs, 2 outputs
+	mop = (t_jit_object *)jit_object_new(_jit_sym_jit_mop,0,3); //0 inputs, 3 outputs
 	
 	//Prepare depth image, all values are hard-coded, may need to be queried for safety?
 	output = jit_object_method(mop,_jit_sym_getoutput,1);
@@ -409,12 +1212,17 @@ t_jit_err jit_freenect_grab_init(void)
 	jit_atom_setsym(a,_jit_sym_float32); //default
 	jit_atom_setsym(a+1,_jit_sym_long);
 	jit_atom_setsym(a+2,_jit_sym_float64);
-	jit_object_method(output,_jit_sym_types,3,a);
+	jit_atom_setsym(a+3,_jit_sym_char);  //Two planes holding 16-bit values, see depth16
+	jit_object_method(output,_jit_sym_types,4,a);
+	
+	jit_atom_setlong(&a[0], 1);
+	jit_atom_setlong(&a[1], 1);
+	
+	jit_object_method(output, _jit_sym_mindim, 2, a);  //Two dimensions, sizes in atom array, smaller with roi and decimate
 	
 	jit_atom_setlong(&a[0], DEPTH_WIDTH);
 	jit_atom_setlong(&a[1], DEPTH_HEIGHT);
 	
-	jit_object_method(output, _jit_sym_mindim, 2, a);  //Two dimensions, sizes in atom array
 	jit_object_method(output, _jit_sym_maxdim, 2, a);
 	
 	//Prepare RGB image
@@ -429,6 +1237,25 @@ t_jit_err jit_freenect_grab_init(void)
 	jit_atom_setlong(&a[0], RGB_WIDTH);
 	jit_atom_setlong(&a[1], RGB_HEIGHT);
 	
+	jit_object_method(output, _jit_sym_mindim, 2, a);
+	
+	jit_atom_setlong(&a[0], RGB_HIGH_WIDTH);
+	jit_atom_setlong(&a[1], RGB_HIGH_HEIGHT);
+	
+	jit_object_method(output, _jit_sym_maxdim, 2, a);  //Follows the resolution attribute, see matrix_calc
+	
+	//Foreground mask, see learnbg
+	output = jit_object_method(mop,_jit_sym_getoutput,3);
+	
+	jit_atom_setsym(a,_jit_sym_char);
+	jit_object_method(output,_jit_sym_types,1,a);
+	
+	jit_attr_setlong(output,_jit_sym_minplanecount,1);
+	jit_attr_setlong(output,_jit_sym_maxplanecount,1);
+	
+	jit_atom_setlong(&a[0], DEPTH_WIDTH);
+	jit_atom_setlong(&a[1], DEPTH_HEIGHT);
+	
 	jit_object_method(output, _jit_sym_mindim, 2, a);
 	jit_object_method(output, _jit_sym_maxdim, 2, a);
 	
@@ -437,6 +1264,10 @@ t_jit_err jit_freenect_grab_init(void)
 	//add methods
 	jit_class_addmethod(_jit_freenect_grab_class, (method)jit_freenect_grab_open, "open", A_GIMME, 0L);
 	jit_class_addmethod(_jit_freenect_grab_class, (method)jit_freenect_grab_close, "close", A_GIMME, 0L);
+	jit_class_addmethod(_jit_freenect_grab_class, (method)jit_freenect_grab_record, "record", A_GIMME, 0L);
+	jit_class_addmethod(_jit_freenect_grab_class, (method)jit_freenect_grab_stop, "stop", A_GIMME, 0L);
+	jit_class_addmethod(_jit_freenect_grab_class, (method)jit_freenect_grab_learnbg, "learnbg", A_GIMME, 0L);
+	jit_class_addmethod(_jit_freenect_grab_class, (method)jit_freenect_grab_clearbg, "clearbg", A_GIMME, 0L);
 	
 	jit_class_addmethod(_jit_freenect_grab_class, (method)jit_freenect_grab_matrix_calc, "matrix_calc", A_CANT, 0L);
 	
@@ -458,14 +1289,148 @@ t_jit_err jit_freenect_grab_init(void)
 	jit_attr_addfilterset_clip(attr,0,1,TRUE,TRUE);
 	jit_class_addattr(_jit_freenect_grab_class,attr);
 	
+	//0: raw, 1: normalised, 2: inverted, 3: metres, 4: point cloud, 5: millimetres from the calibration
 	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"mode",_jit_sym_char,
 										  attrflags,(method)NULL,(method)jit_freenect_grab_set_mode,calcoffset(t_jit_freenect_grab,mode));
 	jit_class_addattr(_jit_freenect_grab_class,attr);
 	
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"cloudlayout",_jit_sym_char,
+										  attrflags,(method)NULL,(method)NULL,calcoffset(t_jit_freenect_grab,cloud_layout));
+	jit_attr_addfilterset_clip(attr,CLOUD_FULL,CLOUD_PLANES,TRUE,TRUE);
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"registration",_jit_sym_char,
+										  attrflags,(method)NULL,(method)NULL,calcoffset(t_jit_freenect_grab,registration_mode));
+	jit_attr_addfilterset_clip(attr,REGISTER_NONE,REGISTER_RGB,TRUE,TRUE);
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"calibration",_jit_sym_symbol,
+										  attrflags,(method)NULL,(method)jit_freenect_grab_set_calibration,calcoffset(t_jit_freenect_grab,calibration_file));
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"realtime",_jit_sym_char,
+										  attrflags,(method)NULL,(method)NULL,calcoffset(t_jit_freenect_grab,realtime));
+	jit_attr_addfilterset_clip(attr,0,1,TRUE,TRUE);
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"loop",_jit_sym_char,
+										  attrflags,(method)NULL,(method)NULL,calcoffset(t_jit_freenect_grab,loop));
+	jit_attr_addfilterset_clip(attr,0,1,TRUE,TRUE);
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"scene",_jit_sym_long,
+										  attrflags,(method)NULL,(method)NULL,calcoffset(t_jit_freenect_grab,scene));
+	jit_attr_addfilterset_clip(attr,SCENE_PLANES,SCENE_NOISE,TRUE,TRUE);
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"holes",_jit_sym_float32,
+										  attrflags,(method)NULL,(method)NULL,calcoffset(t_jit_freenect_grab,holes));
+	jit_attr_addfilterset_clip(attr,0,1,TRUE,TRUE);
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"rate",_jit_sym_float32,
+										  attrflags,(method)NULL,(method)NULL,calcoffset(t_jit_freenect_grab,rate));
+	jit_attr_addfilterset_clip(attr,1,1000,TRUE,TRUE);
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
 	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"format",_jit_sym_atom,
 										  attrflags,(method)NULL,(method)jit_freenect_grab_set_format,calcoffset(t_jit_freenect_grab,format));
 	jit_class_addattr(_jit_freenect_grab_class,attr);
 	
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"resolution",_jit_sym_long,
+										  attrflags,(method)NULL,(method)jit_freenect_grab_set_resolution,calcoffset(t_jit_freenect_grab,resolution));
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	//0: 11-bit, 1: 11-bit packed, 2: 10-bit packed, doubled into 11-bit values when unpacked
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"depthformat",_jit_sym_long,
+										  attrflags,(method)NULL,(method)jit_freenect_grab_set_depthformat,calcoffset(t_jit_freenect_grab,depthformat));
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	//0: off, 1: 3x3 median, 2: 5x5 median
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"spatial",_jit_sym_long,
+										  attrflags,(method)NULL,(method)NULL,calcoffset(t_jit_freenect_grab,spatial));
+	jit_attr_addfilterset_clip(attr,0,2,TRUE,TRUE);
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"temporal",_jit_sym_char,
+										  attrflags,(method)NULL,(method)jit_freenect_grab_set_temporal,calcoffset(t_jit_freenect_grab,temporal));
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"smoothing",_jit_sym_float32,
+										  attrflags,(method)NULL,(method)NULL,calcoffset(t_jit_freenect_grab,smoothing));
+	jit_attr_addfilterset_clip(attr,0,1,TRUE,TRUE);
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	//Weight of new values ramps up to 1 as the change approaches motion, 16 raw units at least
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"motion",_jit_sym_long,
+										  attrflags,(method)NULL,(method)NULL,calcoffset(t_jit_freenect_grab,motion));
+	jit_attr_addfilterset_clip(attr,16,2047,TRUE,TRUE);
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"hold",_jit_sym_long,
+										  attrflags,(method)NULL,(method)NULL,calcoffset(t_jit_freenect_grab,hold));
+	jit_attr_addfilterset_clip(attr,0,255,TRUE,TRUE);
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"bgdeviation",_jit_sym_float32,
+										  attrflags,(method)NULL,(method)NULL,calcoffset(t_jit_freenect_grab,bg_deviation));
+	jit_attr_addfilterset_clip(attr,0,0,TRUE,FALSE);
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"bgmargin",_jit_sym_long,
+										  attrflags,(method)NULL,(method)NULL,calcoffset(t_jit_freenect_grab,bg_margin));
+	jit_attr_addfilterset_clip(attr,0,2047,TRUE,TRUE);
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	//Disabled outputs are not converted, and their stream stops unless something else needs it
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"depthenable",_jit_sym_char,
+										  attrflags,(method)NULL,(method)NULL,calcoffset(t_jit_freenect_grab,depth_enable));
+	jit_attr_addfilterset_clip(attr,0,1,TRUE,TRUE);
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"rgbenable",_jit_sym_char,
+										  attrflags,(method)NULL,(method)NULL,calcoffset(t_jit_freenect_grab,rgb_enable));
+	jit_attr_addfilterset_clip(attr,0,1,TRUE,TRUE);
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	//IR, and raw depth in mode 0 with depth16 1, are output in place, valid until the next frame is taken
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"passthrough",_jit_sym_char,
+										  attrflags,(method)NULL,(method)NULL,calcoffset(t_jit_freenect_grab,passthrough));
+	jit_attr_addfilterset_clip(attr,0,1,TRUE,TRUE);
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	//Little-endian 16-bit values across planes 0 and 1 of a char matrix, for texture upload.
+	//uint16 is refused in mode 3, metres would truncate to 0-10, use mode 5 for millimetres
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"depth16",_jit_sym_long,
+										  attrflags,(method)NULL,(method)jit_freenect_grab_set_depth16,calcoffset(t_jit_freenect_grab,depth16));
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	//x, y, width, height of the depth output in the frame, not applied to the cloud or registered depth
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset_array,"roi",_jit_sym_long,4,
+										  attrflags,(method)NULL,(method)jit_freenect_grab_set_roi,
+										  calcoffset(t_jit_freenect_grab,roicount),calcoffset(t_jit_freenect_grab,roi));
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	//At most CONVERT_MAX_FACTOR, mean pooling sums a block's rows in 16 bits
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"decimate",_jit_sym_long,
+										  attrflags,(method)NULL,(method)NULL,calcoffset(t_jit_freenect_grab,decimate));
+	jit_attr_addfilterset_clip(attr,1,CONVERT_MAX_FACTOR,TRUE,TRUE);
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	//0: skip, 1: mean, 2: min (nearest)
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"pooling",_jit_sym_long,
+										  attrflags,(method)NULL,(method)NULL,calcoffset(t_jit_freenect_grab,pooling));
+	jit_attr_addfilterset_clip(attr,CONVERT_SKIP,CONVERT_MIN,TRUE,TRUE);
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"threads",_jit_sym_long,
+										  attrflags,(method)NULL,(method)jit_freenect_grab_set_threads,calcoffset(t_jit_freenect_grab,threads));
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"profile",_jit_sym_char,
+										  attrflags,(method)NULL,(method)jit_freenect_grab_set_profile,calcoffset(t_jit_freenect_grab,profile));
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
 	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"tilt",_jit_sym_long,
 										  attrflags,(method)jit_freenect_grab_get_tilt,(method)jit_freenect_grab_set_tilt,
 										  calcoffset(t_jit_freenect_grab,tilt));
@@ -480,6 +1445,12 @@ t_jit_err jit_freenect_grab_init(void)
 										  attrflags,(method)jit_freenect_grab_get_ndevices,(method)NULL,calcoffset(t_jit_freenect_grab,ndevices));
 	jit_class_addattr(_jit_freenect_grab_class,attr);
 	
+	//fps, latency p50 p95 p99, conversion time p50 p95 p99 (ms), dropped depth and video frames
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset_array, "stats", _jit_sym_float64, STATS_COUNT, 
+										  attrflags, (method)jit_freenect_grab_get_stats,(method)NULL, 
+										  calcoffset(t_jit_freenect_grab, stats.count),calcoffset(t_jit_freenect_grab,stats.values));
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
 	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset_array, "accel", _jit_sym_float64, 3, 
 										  attrflags, (method)jit_freenect_grab_get_accel,(method)NULL, 
 										  calcoffset(t_jit_freenect_grab, accelcount),calcoffset(t_jit_freenect_grab,mks_accel));
@@ -492,15 +1463,7 @@ t_jit_err jit_freenect_grab_init(void)
 	
 	jit_class_register(_jit_freenect_grab_class);
 	
-	//Prepare lut for OpenGL output
-	
-	for(i=0;i<640;i++){
-		xlut[i] = 0.542955699638437f * (((float)i - 319.5f) / 319.5f);
-	}
-	
-	for(i=0;i<480;i++){
-		ylut[i] = -0.393910475614942f * (((float)i - 239.5f) / 239.5f);
-	}
+	convert_select_kernels();
 			
 	return JIT_ERR_NONE;
 }
@@ -525,11 +1488,62 @@ t_jit_freenect_grab *jit_freenect_grab_new(void)
 		x->cloud.points = NULL;
 		x->cloud.count = 0;
 		x->cloud.size = 0;
+		x->cloud_layout = CLOUD_FULL;
+		x->registration_mode = REGISTER_NONE;
+		x->calibration_file = _jit_sym_nothing;
+		x->calibration = registration_defaults;
+		memset(&x->registration, 0, sizeof(t_registration));
 		x->type = NULL;
 		x->threshold = 2.f;
-		x->rgb = NULL;
-        
-        pthread_mutex_init(&x->cb_mutex, NULL);
+		x->rgb_data = NULL;
+		x->depth_data = NULL;
+		x->rgb_timestamp = 0;
+		x->depth_timestamp = 0;
+		memset(&x->rgb_buffer, 0, sizeof(t_frame_buffer));
+		memset(&x->depth_buffer, 0, sizeof(t_frame_buffer));
+		x->threads = 1;
+		worker_pool_init(&x->pool);
+		memset(&x->recorder, 0, sizeof(t_recorder));
+		memset(&x->playback, 0, sizeof(t_playback));
+		x->realtime = 1;
+		x->loop = 1;
+		x->scene = SCENE_PLANES;
+		x->holes = 0.f;
+		x->rate = 30.f;
+		x->profile = 0;
+		memset(&x->stats, 0, sizeof(t_stats));
+		x->resolution = 0;
+		x->video_width = RGB_WIDTH;
+		x->video_height = RGB_HEIGHT;
+		x->depthformat = 0;
+		x->depth_bits = 16;
+		x->depth_unpacked = NULL;
+		x->depth_stale = 0;
+		x->spatial = 0;
+		x->temporal = 0;
+		x->smoothing = 0.5f;
+		x->motion = 64;
+		x->hold = 3;
+		memset(&x->temporal_state, 0, sizeof(t_convert_temporal));
+		x->filter_pending = 0;
+		x->depth_filtered = 0;
+		memset(&x->background, 0, sizeof(t_background));
+		x->bg_deviation = 3.f;
+		x->bg_margin = 4;
+		x->roicount = 4;
+		x->roi[0] = 0;
+		x->roi[1] = 0;
+		x->roi[2] = DEPTH_WIDTH;
+		x->roi[3] = DEPTH_HEIGHT;
+		x->decimate = 1;
+		x->pooling = CONVERT_SKIP;
+		x->depth16 = 0;
+		x->depth_enable = 1;
+		x->rgb_enable = 1;
+		x->depth_streaming = 0;
+		x->rgb_streaming = 0;
+		x->passthrough = 0;
+		
 		jit_atom_setsym(&x->format, s_rgb);
 		
 	} else {
@@ -541,12 +1555,19 @@ t_jit_freenect_grab *jit_freenect_grab_new(void)
 void jit_freenect_grab_free(t_jit_freenect_grab *x)
 {
 	jit_freenect_grab_close(x, NULL, 0, NULL);
+	recorder_stop(&x->recorder);
 			
 	if(x->lut.f_ptr){
 		free(x->lut.f_ptr);
 	}
 	
-	//release_cloud(&x->cloud);
+	worker_pool_free(&x->pool);
+	
+	cloud_release(&x->cloud);
+	registration_release(&x->registration);
+	release_temporal(&x->temporal_state);
+	release_background(&x->background);
+	free(x->depth_unpacked);
 }
 
 t_jit_err jit_freenect_grab_get_ndevices(t_jit_freenect_grab *x, void *attr, long *ac, t_atom **av){
@@ -688,46 +1709,442 @@ t_jit_err jit_freenect_grab_set_mode(t_jit_freenect_grab *x, void *attr, long ac
 	if(x->mode != jit_atom_getlong(av)){
 		long mode = jit_atom_getlong(av);
 		
-		CLIP(mode, 0, 3);  // <-- See explanation in build_geometry implementation as to why I'm blocking point cloud output for now - jmp 2011-01-11
-		/*
+		CLIP(mode, 0, 5);
+		
+		if((mode == 3) && (x->depth16 == 1)){
+			error("jit.freenect.grab: mode 3 cannot be output as uint16, set depth16 to 0 or 2, or use mode 5 for millimetres.");
+			return JIT_ERR_NONE;
+		}
+		
 		if(mode == 4){
-			if(!x->cloud.points){
-				allocate_cloud(&x->cloud);
-			}
-			if(!x->rgb){
-				x->rgb = malloc(DEPTH_WIDTH*DEPTH_HEIGHT*3*sizeof(float));
-				if(!x->rgb){
-					return JIT_ERR_OUT_OF_MEM;
-				}
+			//The cloud buffer is released by matrix_calc once the output no longer references it
+			if(allocate_cloud(&x->cloud)){
+				return JIT_ERR_OUT_OF_MEM;
 			}
 		}
+		
+		if((x->lut_type == s_uint16) && ((mode == 3) || (mode == 4))){
+			//Left from depth16 1, matrix_calc builds the type the new mode outputs
+			x->lut_type = NULL;
+		}
 		else{
-			release_cloud(&x->cloud);
-			if(x->rgb){
-				free(x->rgb);
-				x->rgb = NULL;
-			}
+			calculate_lut(&x->lut, x->lut_type, mode, &x->calibration);
+		}
+		
+		x->mode = mode;
+	}
+	
+    return JIT_ERR_NONE;
+}
+
+t_jit_err jit_freenect_grab_set_threads(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av){
+	long threads;
+	
+	if(ac < 1){
+		return JIT_ERR_NONE;
+	}
+	
+	threads = jit_atom_getlong(av);
+	CLIP(threads, 1, MAX_THREADS);
+	
+	if(threads != x->threads){
+		x->threads = worker_pool_resize(&x->pool, threads);
+		if(x->threads < threads){
+			error("Could not create worker thread, using %ld threads.", x->threads);
+		}
+	}
+	
+	return JIT_ERR_NONE;
+}
+
+t_jit_err jit_freenect_grab_set_resolution(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av){
+	long resolution;
+	
+	if(ac < 1){
+		return JIT_ERR_NONE;
+	}
+	
+	resolution = jit_atom_getlong(av);
+	CLIP(resolution, 0, 1);
+	if(resolution == x->resolution){
+		return JIT_ERR_NONE;
+	}
+	x->resolution = resolution;
+	
+	if(x->device || x->playback.running){
+		post("jit.freenect.grab: Cannot change resolution while running. Please close and re-open device to activate change.");
+	}
+	
+	return JIT_ERR_NONE;
+}
+
+t_jit_err jit_freenect_grab_set_depthformat(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av){
+	long depthformat;
+	
+	if(ac < 1){
+		return JIT_ERR_NONE;
+	}
+	
+	depthformat = jit_atom_getlong(av);
+	CLIP(depthformat, 0, 2);
+	if(depthformat == x->depthformat){
+		return JIT_ERR_NONE;
+	}
+	x->depthformat = depthformat;
+	
+	if(x->device){
+		post("jit.freenect.grab: Cannot change depth format while running. Please close and re-open device to activate change.");
+	}
+	
+	return JIT_ERR_NONE;
+}
+
+t_jit_err jit_freenect_grab_set_depth16(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av){
+	long depth16;
+	
+	if(ac < 1){
+		return JIT_ERR_NONE;
+	}
+	
+	depth16 = jit_atom_getlong(av);
+	CLIP(depth16, 0, 2);
+	if((depth16 == 1) && (x->mode == 3)){
+		error("jit.freenect.grab: mode 3 cannot be output as uint16, use depth16 2 for float16, or mode 5 for millimetres.");
+		return JIT_ERR_NONE;
+	}
+	x->depth16 = depth16;
+	
+	return JIT_ERR_NONE;
+}
+
+t_jit_err jit_freenect_grab_set_temporal(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av){
+	char temporal;
+	
+	if(ac < 1){
+		return JIT_ERR_NONE;
+	}
+	
+	temporal = jit_atom_getlong(av) ? 1 : 0;
+	if(temporal && !x->temporal){
+		//Start from the next frame, not from whatever was seen when the filter was last on
+		clear_temporal(&x->temporal_state);
+		x->filter_pending = 0;
+		x->depth_filtered = 0;
+		x->depth_stale = 1;
+	}
+	x->temporal = temporal;
+	
+	return JIT_ERR_NONE;
+}
+
+t_jit_err jit_freenect_grab_set_roi(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av){
+	long roi[4] = {0, 0, DEPTH_WIDTH, DEPTH_HEIGHT};
+	long i;
+	
+	for(i=0;(i<ac)&&(i<4);i++){
+		roi[i] = jit_atom_getlong(av + i);
+	}
+	
+	//Keep at least one pixel inside the frame
+	CLIP(roi[0], 0, DEPTH_WIDTH - 1);
+	CLIP(roi[1], 0, DEPTH_HEIGHT - 1);
+	CLIP(roi[2], 1, DEPTH_WIDTH - roi[0]);
+	CLIP(roi[3], 1, DEPTH_HEIGHT - roi[1]);
+	
+	for(i=0;i<4;i++){
+		x->roi[i] = roi[i];
+	}
+	x->roicount = 4;
+	
+	return JIT_ERR_NONE;
+}
+
+t_jit_err jit_freenect_grab_set_profile(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av){
+	char profile;
+	
+	if(ac < 1){
+		return JIT_ERR_NONE;
+	}
+	
+	profile = jit_atom_getlong(av) ? 1 : 0;
+	if(profile && !x->profile){
+		reset_stats(&x->stats, &x->depth_buffer, &x->rgb_buffer);
+	}
+	x->profile = profile;
+	
+	return JIT_ERR_NONE;
+}
+
+t_jit_err jit_freenect_grab_get_stats(t_jit_freenect_grab *x, void *attr, long *ac, t_atom **av){
+	t_stats *stats = &x->stats;
+	long n = MIN(stats->noutput, STATS_WINDOW);
+	uint64_t first, last;
+	int i;
+	
+	if ((*ac)&&(*av)) {
+		
+	} else {
+		*ac = STATS_COUNT;
+		if (!(*av = jit_getbytes(sizeof(t_atom)*(*ac)))) {
+			*ac = 0;
+			return JIT_ERR_OUT_OF_MEM;
+		}
+	}
+	
+	stats->values[0] = 0.;
+	if(n > 1){
+		last = stats->output[(stats->noutput - 1) % STATS_WINDOW];
+		first = stats->output[(stats->noutput - n) % STATS_WINDOW];
+		if(last > first){
+			stats->values[0] = (n - 1) * 1000000. / (double)(last - first);
+		}
+	}
+	percentiles(stats->latency, stats->nlatency, stats->values + 1);
+	percentiles(stats->copy, stats->noutput, stats->values + 4);
+	stats->values[7] = x->depth_buffer.dropped - stats->depth_dropped;
+	stats->values[8] = x->rgb_buffer.dropped - stats->rgb_dropped;
+	
+	for(i=0;i<STATS_COUNT;i++){
+		jit_atom_setfloat(*av + i, stats->values[i]);
+	}
+	
+	return JIT_ERR_NONE;
+}
+
+t_jit_err jit_freenect_grab_set_calibration(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av){
+	t_symbol *file = ac ? jit_atom_getsym(av) : _jit_sym_nothing;
+	
+	//A file that cannot be used keeps the calibration and tables in use
+	if(file == _jit_sym_nothing){
+		x->calibration = registration_defaults;
+	}
+	else if(load_calibration(file, &x->calibration)){
+		return JIT_ERR_NONE;
+	}
+	x->calibration_file = file;
+	x->registration.valid = 0;
+	x->lut_type = NULL;  //matrix_calc rebuilds the table, millimetres depend on the calibration
+	
+	//Rebuild now if running, otherwise this happens at open. The synth thread reads the rays.
+	if((x->device || x->playback.running) && x->registration.table){
+		if(x->playback.running){
+			pthread_mutex_lock(&x->playback.mutex);
+		}
+		registration_build(&x->registration, &x->calibration);
+		if(x->playback.running){
+			pthread_mutex_unlock(&x->playback.mutex);
+		}
+	}
+	
+	return JIT_ERR_NONE;
+}
+
+void jit_freenect_grab_set_tilt(t_jit_freenect_grab *x,  void *attr, long argc, t_atom *argv)
+{
+	if(argv){
+		x->tilt = jit_atom_getlong(argv);
+		
+		CLIP(x->tilt, -30, 30);
+		
+		if(x->device){
+			freenect_set_tilt_degs(x->device,x->tilt);
+		}
+	}
+}
+
+//Recorded frames stay pinned in the frame buffers, which need their spare slots for that
+static void record_spares(t_jit_freenect_grab *x)
+{
+	if(x->recorder.active && x->depth_buffer.slots[0] &&
+	   (frame_buffer_add_spares(&x->depth_buffer) || frame_buffer_add_spares(&x->rgb_buffer))){
+		error("Out of memory, could not allocate record buffers.");
+	}
+}
+
+//Allocate buffers for a virtual device and start its thread
+static int start_virtual_device(t_jit_freenect_grab *x, void *(*threadfunc)(void *), long depth_bits,
+								long video_planes, long video_width, long video_height)
+{
+	t_playback *pb = &x->playback;
+	
+	x->depth_bits = depth_bits;
+	x->video_width = video_width;
+	x->video_height = video_height;
+	if(allocate_frame_buffer(&x->depth_buffer, DEPTH_FRAME_BYTES(DEPTH_WIDTH * DEPTH_HEIGHT, depth_bits)) ||
+	   allocate_frame_buffer(&x->rgb_buffer, video_width * video_height * video_planes)){
+		frame_buffer_release(&x->depth_buffer);
+		return 1;
+	}
+	if(allocate_registration(&x->registration)){
+		frame_buffer_release(&x->depth_buffer);
+		frame_buffer_release(&x->rgb_buffer);
+		return 1;
+	}
+	registration_build(&x->registration, &x->calibration);
+	record_spares(x);
+	
+	pb->stop = 0;
+	pthread_mutex_init(&pb->mutex, NULL);
+	pthread_cond_init(&pb->cond, NULL);
+	if(pthread_create(&pb->thread, NULL, threadfunc, x)){
+		error("Failed to create playback thread.");
+		pthread_mutex_destroy(&pb->mutex);
+		pthread_cond_destroy(&pb->cond);
+		frame_buffer_release(&x->depth_buffer);
+		frame_buffer_release(&x->rgb_buffer);
+		return 1;
+	}
+	pb->running = 1;
+	return 0;
+}
+
+//Point an output at the frame in a buffer's front slot. Only the next frame_buffer_acquire
+//hands that slot back to the capture thread, so the data holds until the next matrix_calc.
+static void reference_frame(void *matrix, t_jit_matrix_info *info, uint8_t *data, long stride, t_symbol **name)
+{
+	*name = (t_symbol *)jit_object_method(matrix,_jit_sym_getname);
+	info->dimstride[0] = info->planecount;
+	info->dimstride[1] = stride;
+	info->flags = JIT_MATRIX_DATA_REFERENCE | JIT_MATRIX_DATA_FLAGS_USE;
+	jit_object_method(matrix,_jit_sym_setinfo_ex,info);
+	jit_object_method(matrix,_jit_sym_data,data);
+}
+
+//Give an output that referenced a frame its own data again
+static void own_matrix_data(void *matrix)
+{
+	t_jit_matrix_info info;
+	
+	jit_object_method(matrix,_jit_sym_getinfo,&info);
+	if(info.flags & JIT_MATRIX_DATA_REFERENCE){
+		info.flags = 0L;
+		jit_object_method(matrix,_jit_sym_setinfo_ex,&info);
+		jit_object_method(matrix,_jit_sym_clear);
+	}
+}
+
+//Before the buffers go away, give outputs that still reference them their own data. Outputs are
+//found by name, so ones freed since, like the MOP's before this object, are skipped.
+static void release_references(t_jit_freenect_grab *x)
+{
+	void *matrix;
+	int i;
+	
+	for(i=0;i<2;i++){
+		if(x->referenced[i] && (matrix = jit_object_findregistered(x->referenced[i]))){
+			own_matrix_data(matrix);
+		}
+		x->referenced[i] = NULL;
+	}
+}
+
+static void close_virtual_device(t_jit_freenect_grab *x)
+{
+	t_playback *pb = &x->playback;
+	
+	pthread_mutex_lock(&pb->mutex);
+	pb->stop = 1;
+	pthread_cond_signal(&pb->cond);
+	pthread_mutex_unlock(&pb->mutex);
+	pthread_join(pb->thread, NULL);
+	pthread_mutex_destroy(&pb->mutex);
+	pthread_cond_destroy(&pb->cond);
+	pb->running = 0;
+	
+	recorder_flush(&x->recorder);
+	release_references(x);
+	frame_buffer_release(&x->depth_buffer);
+	frame_buffer_release(&x->rgb_buffer);
+	x->depth_data = NULL;
+	x->rgb_data = NULL;
+	clear_temporal(&x->temporal_state);
+	playback_unmap(pb);
+}
+
+static void open_playback(t_jit_freenect_grab *x, const char *file)
+{
+	t_playback *pb = &x->playback;
+	
+	if(playback_map(pb, file) || !pb->count){
+		if(pb->map && !pb->count){
+			error("jit.freenect.grab: recording %s has no frames", file);
+		}
+		playback_unmap(pb);
+		return;
+	}
+	if(start_virtual_device(x, playback_threadfunc, pb->header->depth_bits,
+							pb->header->video_planes, pb->header->video_width, pb->header->video_height)){
+		playback_unmap(pb);
+	}
+}
+
+//open synth, or synth:planes, synth:spheres, synth:noise to pick the scene
+static void open_synthetic(t_jit_freenect_grab *x, const char *scene)
+{
+	if(*scene == ':'){
+		scene++;
+		if(!strcmp(scene, "planes")){
+			x->scene = SCENE_PLANES;
+		}
+		else if(!strcmp(scene, "spheres")){
+			x->scene = SCENE_SPHERES;
+		}
+		else if(!strcmp(scene, "noise")){
+			x->scene = SCENE_NOISE;
+		}
+		else{
+			error("jit.freenect.grab: unknown scene %s", scene);
+			return;
 		}
-		*/
-		
-		calculate_lut(&x->lut, x->lut_type, mode);
-		
-		x->mode = mode;
 	}
-	
-    return JIT_ERR_NONE;
+	else if(*scene){
+		error("jit.freenect.grab: cannot open synth%s", scene);
+		return;
+	}
+	start_virtual_device(x, synth_threadfunc, 16, (x->format.a_w.w_sym == s_ir) ? 1 : 3,
+						 x->resolution ? RGB_HIGH_WIDTH : RGB_WIDTH, x->resolution ? RGB_HIGH_HEIGHT : RGB_HEIGHT);
 }
 
-void jit_freenect_grab_set_tilt(t_jit_freenect_grab *x,  void *attr, long argc, t_atom *argv)
+//The depth stream also feeds registered colour, and recordings take both streams
+static char depth_needed(t_jit_freenect_grab *x)
 {
-	if(argv){
-		x->tilt = jit_atom_getlong(argv);
-		
-		CLIP(x->tilt, -30, 30);
-		
-		if(x->device){
-			freenect_set_tilt_degs(x->device,x->tilt);
+	return x->depth_enable || (x->rgb_enable && (x->registration_mode == REGISTER_RGB)) || x->recorder.active;
+}
+
+static char rgb_needed(t_jit_freenect_grab *x)
+{
+	return x->rgb_enable || x->recorder.active;
+}
+
+//Start or stop the device's streams to follow what is needed, unused ones cost USB bandwidth.
+//Frames of a stream matrix_calc leaves alone, like a virtual device's, are not counted as dropped.
+static void update_streams(t_jit_freenect_grab *x)
+{
+	char depth = depth_needed(x);
+	char rgb = rgb_needed(x);
+	
+	x->depth_buffer.watched = depth;
+	x->rgb_buffer.watched = rgb;
+	if(!x->device){
+		return;
+	}
+	if(depth != x->depth_streaming){
+		if(depth){
+			freenect_start_depth(x->device);
+		}
+		else{
+			freenect_stop_depth(x->device);
+		}
+		x->depth_streaming = depth;
+	}
+	if(rgb != x->rgb_streaming){
+		if(rgb){
+			freenect_start_video(x->device);
+		}
+		else{
+			freenect_stop_video(x->device);
 		}
+		x->rgb_streaming = rgb;
 	}
 }
 
@@ -736,19 +2153,35 @@ void jit_freenect_grab_open(t_jit_freenect_grab *x,  t_symbol *s, long argc, t_a
 	int ndevices, devices_left, dev_ndx;
 	t_jit_freenect_grab *y;
 	freenect_device *dev;
+	freenect_frame_mode video_mode, depth_mode;
+	freenect_video_format video_format;
+	freenect_depth_format depth_format;
 
-	if(x->device){
+	if(x->device || x->playback.running){
 		post("A device is already open.");
 		return;
 	}
 	
-	if(!f_ctx){
-		if (pthread_create(&capture_thread, NULL, capture_threadfunc, NULL)) {
-			error("Failed to create capture thread.");
+	if(argc && (argv->a_type == A_SYM) && !strncmp(jit_atom_getsym(argv)->s_name, "file:", 5)){
+		open_playback(x, jit_atom_getsym(argv)->s_name + 5);
+		return;
+	}
+	if(argc && (argv->a_type == A_SYM) && !strncmp(jit_atom_getsym(argv)->s_name, "synth", 5)){
+		open_synthetic(x, jit_atom_getsym(argv)->s_name + 5);
+		return;
+	}
+	
+	//Once event processing has failed the context is dead, it is shut down with its last device and rebuilt here
+	if(f_ctx && capture.failed){
+		if(f_ctx->first){
+			error("jit.freenect.grab: device events stopped, close all devices before opening one.");
 			return;
 		}
-		while(!f_ctx){
-			sleep(0);
+		stop_capture_thread();
+	}
+	if(!f_ctx){
+		if(start_capture_thread()){
+			return;
 		}
 	}
 	
@@ -820,20 +2253,45 @@ void jit_freenect_grab_open(t_jit_freenect_grab *x,  t_symbol *s, long argc, t_a
 		error("Could not open Kinect device %d", dev_ndx);
 		x->index = 0;
 		x->device = NULL;
+		return;
 	}
 	
 	freenect_set_depth_callback(x->device, depth_callback);
 	freenect_set_video_callback(x->device, rgb_callback);
-	if(x->format.a_w.w_sym == s_ir){
-		freenect_set_video_mode(x->device, freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_IR_8BIT));
+	video_format = (x->format.a_w.w_sym == s_ir) ? FREENECT_VIDEO_IR_8BIT : FREENECT_VIDEO_RGB;
+	video_mode = freenect_find_video_mode(x->resolution ? FREENECT_RESOLUTION_HIGH : FREENECT_RESOLUTION_MEDIUM, video_format);
+	if(!video_mode.is_valid){
+		post("jit.freenect.grab: resolution not supported by this device, using 640x480.");
+		video_mode = freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, video_format);
 	}
-	else{
-		freenect_set_video_mode(x->device, freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_RGB));
+	x->video_width = video_mode.width;
+	x->video_height = video_mode.height;
+	//Packed depth is unpacked by matrix_calc during the conversion instead of by libfreenect
+	depth_format = (x->depthformat == 1) ? FREENECT_DEPTH_11BIT_PACKED :
+				   ((x->depthformat == 2) ? FREENECT_DEPTH_10BIT_PACKED : FREENECT_DEPTH_11BIT);
+	depth_mode = freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM, depth_format);
+	if(!depth_mode.is_valid){
+		post("jit.freenect.grab: depth format not supported by this device, using 11-bit.");
+		depth_mode = freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_11BIT);
 	}
+	x->depth_bits = depth_mode.data_bits_per_pixel + depth_mode.padding_bits_per_pixel;
 	
+	freenect_set_video_mode(x->device, video_mode);
+	freenect_set_depth_mode(x->device, depth_mode);
+	
+	//libfreenect writes frames directly into our triple buffers, see depth_callback and rgb_callback
+	if(allocate_frame_buffer(&x->depth_buffer, depth_mode.bytes) || allocate_frame_buffer(&x->rgb_buffer, video_mode.bytes)){
+		jit_freenect_grab_close(x, NULL, 0, NULL);
+		return;
+	}
+	//Camera tables only depend on the calibration, they are kept across close/open
+	if(!allocate_registration(&x->registration)){
+		registration_build(&x->registration, &x->calibration);
+	}
+	record_spares(x);
 	
-	freenect_set_depth_mode(x->device, freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_11BIT));
-	//freenect_set_video_buffer(x->device, rgb_back);
+	freenect_set_depth_buffer(x->device, x->depth_buffer.slots[x->depth_buffer.back]);
+	freenect_set_video_buffer(x->device, x->rgb_buffer.slots[x->rgb_buffer.back]);
 	
 	//Store a pointer to this object in the freenect device struct (for use in callbacks)
 	freenect_set_user(x->device, x);  
@@ -842,18 +2300,252 @@ void jit_freenect_grab_open(t_jit_freenect_grab *x,  t_symbol *s, long argc, t_a
 	
 	//freenect_set_tilt_degs(x->device,x->tilt);
 	
-	freenect_start_depth(x->device);
-	freenect_start_video(x->device);
+	x->depth_streaming = 0;
+	x->rgb_streaming = 0;
+	update_streams(x);
+	
+	capture_post(&capture, OPEN);
 }
 
 void jit_freenect_grab_close(t_jit_freenect_grab *x,  t_symbol *s, long argc, t_atom *argv)
 {
+	if(x->playback.running){
+		close_virtual_device(x);
+		return;
+	}
 	if(!x->device)return;
 	freenect_set_led(x->device,LED_BLINK_GREEN);
+	if(x->depth_streaming){
+		freenect_stop_depth(x->device);
+	}
+	if(x->rgb_streaming){
+		freenect_stop_video(x->device);
+	}
+	x->depth_streaming = 0;
+	x->rgb_streaming = 0;
 	freenect_close_device(x->device);
 	x->device = NULL;
+	
+	//Streams are stopped, nothing writes to the buffers anymore
+	recorder_flush(&x->recorder);
+	release_references(x);
+	frame_buffer_release(&x->depth_buffer);
+	frame_buffer_release(&x->rgb_buffer);
+	x->depth_data = NULL;
+	x->rgb_data = NULL;
+	clear_temporal(&x->temporal_state);
 	if(!f_ctx->first){
-		terminate_thread = 1;
+		stop_capture_thread();
+	}
+	else{
+		capture_post(&capture, CLOSE);
+	}
+}
+
+void jit_freenect_grab_record(t_jit_freenect_grab *x,  t_symbol *s, long argc, t_atom *argv)
+{
+	if(x->recorder.active){
+		post("Already recording, send stop first.");
+		return;
+	}
+	if(!argc || argv->a_type != A_SYM){
+		error("jit.freenect.grab: record needs a file name");
+		return;
+	}
+	if(x->device || x->playback.running){
+		if(!recorder_start(&x->recorder, jit_atom_getsym(argv), x->depth_bits, video_planes(x), x->video_width, x->video_height)){
+			record_spares(x);
+		}
+		update_streams(x);
+	}
+	else{
+		recorder_start(&x->recorder, jit_atom_getsym(argv), (x->depthformat == 2) ? 10 : 11, video_planes(x),
+					   x->resolution ? RGB_HIGH_WIDTH : RGB_WIDTH, x->resolution ? RGB_HIGH_HEIGHT : RGB_HEIGHT);
+	}
+}
+
+void jit_freenect_grab_stop(t_jit_freenect_grab *x,  t_symbol *s, long argc, t_atom *argv)
+{
+	recorder_stop(&x->recorder);
+}
+
+//Learn the background from the next frames, BACKGROUND_FRAMES unless given
+void jit_freenect_grab_learnbg(t_jit_freenect_grab *x,  t_symbol *s, long argc, t_atom *argv)
+{
+	t_background *bg = &x->background;
+	long frames = argc ? jit_atom_getlong(argv) : BACKGROUND_FRAMES;
+	
+	CLIP(frames, 1, BACKGROUND_MAX_FRAMES);
+	if(allocate_background(bg)){
+		return;
+	}
+	memset(bg->nearest, 0xFF, DEPTH_WIDTH * DEPTH_HEIGHT * sizeof(uint16_t));
+	memset(bg->sum, 0, DEPTH_WIDTH * DEPTH_HEIGHT * sizeof(uint32_t));
+	memset(bg->sumsq, 0, DEPTH_WIDTH * DEPTH_HEIGHT * sizeof(uint64_t));
+	memset(bg->count, 0, DEPTH_WIDTH * DEPTH_HEIGHT * sizeof(uint16_t));
+	bg->frames = frames;
+	bg->learnt = 0;
+	bg->clear = 1;
+}
+
+void jit_freenect_grab_clearbg(t_jit_freenect_grab *x,  t_symbol *s, long argc, t_atom *argv)
+{
+	release_background(&x->background);
+	x->background.clear = 1;
+}
+
+//Filters for the depth frame, the temporal one once prepare_temporal has set it up
+static void depth_filters(t_jit_freenect_grab *x, t_convert_depth *conv)
+{
+	conv->spatial = (int)x->spatial;
+	conv->height = DEPTH_HEIGHT;
+	conv->temporal = (x->temporal && x->temporal_state.history) ? &x->temporal_state : NULL;
+}
+
+//Latest depth frame as uint16_t values. Packed frames are unpacked once, on first use,
+//and with filters on these are the filtered values.
+static const uint16_t *depth_frame(t_jit_freenect_grab *x)
+{
+	t_convert_depth conv;
+	
+	if(!x->depth_data || ((x->depth_bits == 16) && !x->filter_pending && !x->depth_filtered)){
+		return (const uint16_t *)x->depth_data;
+	}
+	if(!x->depth_unpacked){
+		x->depth_unpacked = (uint16_t *)malloc(DEPTH_WIDTH * DEPTH_HEIGHT * sizeof(uint16_t));
+		if(!x->depth_unpacked){
+			error("Out of memory, could not unpack depth.");
+			return NULL;
+		}
+		x->depth_stale = 1;
+	}
+	memset(&conv, 0, sizeof(t_convert_depth));
+	depth_filters(x, &conv);
+	if(x->filter_pending){
+		convert_filter(x->depth_data, x->depth_unpacked, DEPTH_WIDTH, DEPTH_HEIGHT, (int)x->depth_bits, &conv);
+		x->filter_pending = 0;
+		x->depth_filtered = 1;
+		x->depth_stale = 0;
+	}
+	else if(x->depth_stale){
+		//Filtered during conversion: the temporal filter's history holds the result, a median alone is run again
+		if(x->depth_filtered && conv.temporal){
+			convert_temporal_output(conv.temporal, x->depth_unpacked, DEPTH_WIDTH * DEPTH_HEIGHT);
+		}
+		else if(x->depth_filtered){
+			convert_filter(x->depth_data, x->depth_unpacked, DEPTH_WIDTH, DEPTH_HEIGHT, (int)x->depth_bits, &conv);
+		}
+		else{
+			convert_unpack_depth(x->depth_data, x->depth_unpacked, DEPTH_WIDTH * DEPTH_HEIGHT, x->depth_bits);
+		}
+		x->depth_stale = 0;
+	}
+	return x->depth_unpacked;
+}
+
+//Take the filter settings for a new depth frame, 0 when it can run
+static int prepare_temporal(t_jit_freenect_grab *x)
+{
+	t_convert_temporal *temporal = &x->temporal_state;
+	
+	if(allocate_temporal(temporal)){
+		return 1;
+	}
+	temporal->alpha = (int)lrintf((1.f - x->smoothing) * 256.f);
+	CLIP(temporal->alpha, 1, 256);
+	temporal->gain = ((256 - temporal->alpha) << 12) / MAX(x->motion, 16);  //motion in 1/16 raw units, at most 65280
+	temporal->hold = (int)x->hold;
+	return 0;
+}
+
+//Input of the depth conversion. The filters run inside it unless registration or the cloud already filtered this frame.
+static void depth_source(t_jit_freenect_grab *x, t_convert_depth *conv, uint8_t **data, int *bits)
+{
+	*data = x->depth_data;
+	*bits = (int)x->depth_bits;
+	conv->spatial = 0;
+	conv->temporal = NULL;
+	if(x->filter_pending){
+		depth_filters(x, conv);
+		x->filter_pending = 0;
+		x->depth_filtered = 1;
+	}
+	else if(x->depth_filtered){
+		*data = (uint8_t *)depth_frame(x);
+		*bits = 16;
+	}
+}
+
+//Learn from a new depth frame, and set up the conversion to mask it once there is a background
+static void update_background(t_jit_freenect_grab *x, t_convert_depth *conv, char *mask_bp, t_jit_matrix_info *mask_info)
+{
+	t_background *bg = &x->background;
+	const uint16_t *depth;
+	
+	conv->background = NULL;
+	if(bg->frames){
+		depth = depth_frame(x);
+		if(!depth){
+			return;
+		}
+		learn_background(bg, depth);
+		bg->learnt++;
+		if(--bg->frames){
+			return;
+		}
+		calculate_background(bg, x->bg_deviation, x->bg_margin);
+		post("jit.freenect.grab: Background learnt from %ld frames.", bg->learnt);
+	}
+	if(!bg->learnt){
+		return;
+	}
+	if((bg->deviation != x->bg_deviation) || (bg->margin != x->bg_margin)){
+		calculate_background(bg, x->bg_deviation, x->bg_margin);
+	}
+	conv->background = bg->threshold;
+	conv->mask_bp = mask_bp;
+	conv->mask_stride = mask_info->dimstride[1];
+}
+
+//Part of the depth frame the plain conversion outputs, 1 when it is not the whole frame at full size
+static int depth_region(t_jit_freenect_grab *x, t_convert_region *region)
+{
+	region->x = 0;
+	region->y = 0;
+	region->width = DEPTH_WIDTH;
+	region->height = DEPTH_HEIGHT;
+	region->factor = 1;
+	region->pooling = (int)x->pooling;
+	if((x->mode == 4) || (x->registration_mode == REGISTER_DEPTH)){
+		return 0;  //Those always cover the whole frame
+	}
+	region->factor = MAX(MIN(MIN(x->decimate, CONVERT_MAX_FACTOR), MIN(x->roi[2], x->roi[3])), 1);
+	region->x = x->roi[0];
+	region->y = x->roi[1];
+	region->width = x->roi[2] / region->factor;
+	region->height = x->roi[3] / region->factor;
+	return (region->factor > 1) || (region->width != DEPTH_WIDTH) || (region->height != DEPTH_HEIGHT);
+}
+
+//Outputs whose frames are already what they show: raw uint16 depth and 8-bit IR, unfiltered and whole
+static int depth_passthrough(t_jit_freenect_grab *x, int reduced)
+{
+	return x->passthrough && x->depth_enable && x->depth_data && (x->depth_bits == 16) && (x->mode == 0) &&
+		   (x->depth16 == 1) && !x->spatial && !x->temporal && !reduced && (x->registration_mode == REGISTER_NONE);
+}
+
+static int rgb_passthrough(t_jit_freenect_grab *x)
+{
+	return x->passthrough && x->rgb_enable && x->rgb_data && (video_planes(x) == 1) && (x->registration_mode != REGISTER_RGB);
+}
+
+//Mask for outputs that do not convert depth row by row
+static void mask_depth_data(t_jit_freenect_grab *x, const t_convert_depth *conv)
+{
+	const uint16_t *depth;
+	
+	if(conv->background && (depth = depth_frame(x))){
+		convert_mask_rows(depth, conv->background, conv->mask_bp, conv->mask_stride, DEPTH_WIDTH, DEPTH_HEIGHT);
 	}
 }
 
@@ -861,32 +2553,55 @@ t_jit_err jit_freenect_grab_matrix_calc(t_jit_freenect_grab *x, void *inputs, vo
 {
 	t_jit_err err=JIT_ERR_NONE;
 	long depth_savelock=0,rgb_savelock=0;
-	t_jit_matrix_info depth_minfo,rgb_minfo;
-	void *depth_matrix,*rgb_matrix;
-	char *depth_bp, *rgb_bp;
+	long mask_savelock=0;
+	t_jit_matrix_info depth_minfo,rgb_minfo,mask_minfo;
+	void *depth_matrix,*rgb_matrix,*mask_matrix;
+	char *depth_bp, *rgb_bp, *mask_bp;
+	uint8_t *rgb_data, *depth_data, *depth_in;
+	t_symbol *lut_type, *depth_type;
+	t_convert_depth conv;
+	t_convert_region region;
+	uint64_t calc_start = 0;
+	long rgb_width, rgb_height;
+	int fused, reduced, depth_bits;
+	
+	if(x && x->profile){
+		calc_start = monotonic_us();
+	}
 			
 	depth_matrix = jit_object_method(outputs,_jit_sym_getindex,0);
 	rgb_matrix = jit_object_method(outputs,_jit_sym_getindex,1); 
+	mask_matrix = jit_object_method(outputs,_jit_sym_getindex,2);
 	
-	if (x && depth_matrix && rgb_matrix) {
+	if (x && depth_matrix && rgb_matrix && mask_matrix) {
 		
 		depth_savelock = (long) jit_object_method(depth_matrix,_jit_sym_lock,1);
 		rgb_savelock = (long) jit_object_method(rgb_matrix,_jit_sym_lock,1);
+		mask_savelock = (long) jit_object_method(mask_matrix,_jit_sym_lock,1);
+		
+		//Closing released the buffers outputs may reference
+		reduced = depth_region(x, &region);
+		if(!depth_passthrough(x, reduced) && (x->mode != 4)){
+			own_matrix_data(depth_matrix);
+		}
+		if(!rgb_passthrough(x)){
+			own_matrix_data(rgb_matrix);
+		}
 		
-		if(!x->device){
+		if(!x->device && !x->playback.running){
 			goto out;
 		}
 		
 		jit_object_method(depth_matrix,_jit_sym_getinfo,&depth_minfo);
 		jit_object_method(rgb_matrix,_jit_sym_getinfo,&rgb_minfo);
 		
-		if ((depth_minfo.type == _jit_sym_char) || (rgb_minfo.type != _jit_sym_char)) 
+		if (((depth_minfo.type == _jit_sym_char) && (depth_minfo.planecount == 1) && !x->depth16) || (rgb_minfo.type != _jit_sym_char)) 
 		{
 			err=JIT_ERR_MISMATCH_TYPE;
 			goto out;
 		}
 		
-		if(x->device->video_format == FREENECT_VIDEO_IR_8BIT){
+		if(video_planes(x) == 1){
 			if(rgb_minfo.planecount != 1){
 				rgb_minfo.planecount = 1;
 				jit_object_method(rgb_matrix, _jit_sym_setinfo, &rgb_minfo);
@@ -901,6 +2616,16 @@ t_jit_err jit_freenect_grab_matrix_calc(t_jit_freenect_grab *x, void *inputs, vo
 			}
 		}
 		
+		//Registered colour is seen from the depth camera, otherwise the output follows the video stream
+		rgb_width = (x->registration_mode == REGISTER_RGB) ? DEPTH_WIDTH : x->video_width;
+		rgb_height = (x->registration_mode == REGISTER_RGB) ? DEPTH_HEIGHT : x->video_height;
+		if((rgb_minfo.dim[0] != rgb_width) || (rgb_minfo.dim[1] != rgb_height)){
+			rgb_minfo.dim[0] = rgb_width;
+			rgb_minfo.dim[1] = rgb_height;
+			jit_object_method(rgb_matrix, _jit_sym_setinfo, &rgb_minfo);
+			jit_object_method(rgb_matrix, _jit_sym_getinfo, &rgb_minfo);
+		}
+		
 		/*
 		if (rgb_minfo.planecount != 4) //overkill, but you can never be too sure
 		{
@@ -913,18 +2638,24 @@ t_jit_err jit_freenect_grab_matrix_calc(t_jit_freenect_grab *x, void *inputs, vo
 			x->type = depth_minfo.type;
 		}
 		
-		if((depth_minfo.planecount != 1)&&(x->mode < 4)){
-			depth_minfo.planecount = 1;
-			depth_minfo.type = x->type;
+		//Plain depth shrinks to the roi and decimation, 16-bit depth is carried in two char planes
+		if(((depth_minfo.planecount != (x->depth16 ? 2 : 1)) || (x->depth16 && (depth_minfo.type != _jit_sym_char)) ||
+			(depth_minfo.dim[0] != region.width) || (depth_minfo.dim[1] != region.height))&&(x->mode != 4)){
+			depth_minfo.planecount = x->depth16 ? 2 : 1;
+			depth_minfo.type = x->depth16 ? _jit_sym_char : x->type;
 			depth_minfo.dimcount = 2;
-			depth_minfo.dim[0] = DEPTH_WIDTH;
-			depth_minfo.dim[1] = DEPTH_HEIGHT;
+			depth_minfo.dim[0] = region.width;
+			depth_minfo.dim[1] = region.height;
 			depth_minfo.flags = 0L;
 			jit_object_method(depth_matrix,_jit_sym_setinfo_ex,&depth_minfo);
 			jit_object_method(depth_matrix,_jit_sym_getinfo,&depth_minfo);
 		}
 		
-		if((x->mode < 4)&&(x->type != depth_minfo.type)){
+		if((x->mode != 4)&&(x->cloud.points)){
+			cloud_release(&x->cloud);  //The matrix owns its data again
+		}
+		
+		if((x->mode != 4)&&!x->depth16&&(x->type != depth_minfo.type)){
 			x->type = depth_minfo.type;
 		}
 		
@@ -934,35 +2665,123 @@ t_jit_err jit_freenect_grab_matrix_calc(t_jit_freenect_grab *x, void *inputs, vo
 		jit_object_method(rgb_matrix,_jit_sym_getdata,&rgb_bp);
 		if (!rgb_bp) { err=JIT_ERR_INVALID_OUTPUT; goto out;}
 		
-		if((depth_minfo.type != x->lut_type) || !x->lut.f_ptr){
-			calculate_lut(&x->lut, depth_minfo.type, x->mode);
-			x->lut_type = depth_minfo.type;
+		jit_object_method(mask_matrix,_jit_sym_getinfo,&mask_minfo);
+		jit_object_method(mask_matrix,_jit_sym_getdata,&mask_bp);
+		if (!mask_bp) { err=JIT_ERR_INVALID_OUTPUT; goto out;}
+		if(x->background.clear){
+			jit_object_method(mask_matrix, _jit_sym_clear);
+			x->background.clear = 0;
+		}
+		
+		depth_type = (x->depth16 && (x->mode != 4)) ? ((x->depth16 == 1) ? s_uint16 : s_float16) : depth_minfo.type;
+		lut_type = (x->mode == 4) ? _jit_sym_float32 : depth_type;  //Geometry is always built in float
+		if((lut_type != x->lut_type) || !x->lut.f_ptr){
+			calculate_lut(&x->lut, lut_type, x->mode, &x->calibration);
+			x->lut_type = lut_type;
 		}
+		conv.lut = &x->lut;
+		conv.type = convert_type(depth_type);
+		conv.mode = x->mode;
+		conv.scale = (float)x->calibration.disparity_scale;
+		conv.offset = (float)x->calibration.disparity_offset;
+		conv.spatial = 0;
+		conv.height = DEPTH_HEIGHT;
+		conv.temporal = NULL;
+		conv.background = NULL;
 		 
 		//Grab and copy matrices
 		x->has_frames = 0;  //Assume there are no new frames
 		
-		if(x->have_rgb_frames || x->have_depth_frames){
+		//Frames nothing uses are left in the buffer, unconverted
+		update_streams(x);
+		rgb_data = rgb_needed(x) ? frame_buffer_acquire(&x->rgb_buffer, &x->rgb_timestamp) : NULL;
+		depth_data = depth_needed(x) ? frame_buffer_acquire(&x->depth_buffer, &x->depth_timestamp) : NULL;
+		
+		if(rgb_data || depth_data){
 			x->timestamp = MAX(x->rgb_timestamp,x->depth_timestamp);
 			
-			if(x->have_rgb_frames){
-				copy_rgb_data(x->rgb_data, rgb_bp, &rgb_minfo);
-				x->have_rgb_frames = 0;
+			//Update both frames first, registering colour needs the latest depth
+			if(rgb_data){
+				x->rgb_data = rgb_data;
+			}
+			if(depth_data){
+				x->depth_data = depth_data;
+				x->depth_stale = 1;
+				x->depth_filtered = 0;
+				x->filter_pending = (x->temporal && !prepare_temporal(x)) || x->spatial;
+				if(x->depth_enable){
+					update_background(x, &conv, mask_bp, &mask_minfo);
+				}
 			}
 			
-			if(x->have_depth_frames){
-				//if(x->mode == 4){
-				//	build_geometry(x, depth_matrix, depth_bp, &depth_minfo);
-				//}
-				//else{
-					copy_depth_data(x->depth_data, depth_bp, &depth_minfo, &x->lut);
-				//}
-				x->have_depth_frames = 0;
+			//Both frames are new and need plain conversion of the whole frame, do them in a single pass.
+			//That only pays off with 1280x1024 video and unpacked depth, at 640x480 or with packed depth
+			//the fused benchmark shows it no faster than two passes, or slower.
+			fused = rgb_data && depth_data && x->rgb_enable && x->depth_enable && !reduced && (x->mode != 4) &&
+					(x->video_width > DEPTH_WIDTH) && (x->depth_bits == 16) &&
+					(x->registration_mode == REGISTER_NONE) && !depth_passthrough(x, reduced) && !rgb_passthrough(x);
+			
+			if(fused){
+				depth_source(x, &conv, &depth_in, &depth_bits);
+				copy_frames(depth_in, depth_bits, depth_bp, &depth_minfo, x->rgb_data, rgb_bp, &rgb_minfo, &conv, &x->pool);
 				x->has_frames = 1;
 			}
-			else if((x->clear_depth)&&((x->rgb_timestamp - x->depth_timestamp)>3000000)){
-				jit_object_method(depth_matrix, _jit_sym_clear);
-				x->has_frames = 1;
+			else{
+				if(rgb_data && x->rgb_enable){
+					if(x->registration_mode == REGISTER_RGB){
+						register_rgb_data(x, rgb_bp, &rgb_minfo);  //Nothing until the first depth frame
+					}
+					else if(rgb_passthrough(x)){
+						reference_frame(rgb_matrix, &rgb_minfo, x->rgb_data, x->video_width, &x->referenced[1]);
+					}
+					else{
+						copy_rgb_data(x->rgb_data, rgb_bp, &rgb_minfo, &x->pool);
+					}
+					if(!x->depth_enable){
+						x->has_frames = 1;  //New depth normally decides, without it colour does
+					}
+				}
+				
+				if(depth_data && x->depth_enable){
+					if(x->mode == 4){
+						build_geometry(x, depth_matrix, &depth_minfo);
+						mask_depth_data(x, &conv);
+					}
+					else if(x->registration_mode == REGISTER_DEPTH){
+						register_depth_data(x, depth_bp, &depth_minfo);
+						mask_depth_data(x, &conv);
+					}
+					else if(depth_passthrough(x, reduced)){
+						reference_frame(depth_matrix, &depth_minfo, x->depth_data, DEPTH_WIDTH * sizeof(uint16_t),
+										&x->referenced[0]);
+						mask_depth_data(x, &conv);
+					}
+					else if(reduced){
+						//Filtered first over the whole frame, the history and mask need every pixel
+						if(x->filter_pending || x->depth_filtered){
+							copy_depth_region((uint8_t *)depth_frame(x), 16, depth_bp, &depth_minfo, &region, &conv, &x->pool);
+						}
+						else{
+							copy_depth_region(x->depth_data, (int)x->depth_bits, depth_bp, &depth_minfo, &region, &conv, &x->pool);
+						}
+						mask_depth_data(x, &conv);
+					}
+					else{
+						depth_source(x, &conv, &depth_in, &depth_bits);
+						copy_depth_data(depth_in, depth_bits, depth_bp, &depth_minfo, &conv, &x->pool);
+					}
+					x->has_frames = 1;
+				}
+				else if((x->clear_depth)&&x->depth_enable&&((x->rgb_timestamp - x->depth_timestamp)>3000000)){
+					own_matrix_data(depth_matrix);  //Not the frame in the buffer
+					jit_object_method(depth_matrix, _jit_sym_clear);
+					x->has_frames = 1;
+				}
+			}
+			
+			if(x->profile && calc_start){
+				update_stats(&x->stats, calc_start, rgb_data ? x->rgb_buffer.arrivals[x->rgb_buffer.front] : 0,
+							 depth_data ? x->depth_buffer.arrivals[x->depth_buffer.front] : 0);
 			}
 		}
 		
@@ -973,14 +2792,19 @@ t_jit_err jit_freenect_grab_matrix_calc(t_jit_freenect_grab *x, void *inputs, vo
 out:
 	jit_object_method(depth_matrix,gensym("lock"),depth_savelock);
 	jit_object_method(rgb_matrix,gensym("lock"),rgb_savelock);
+	jit_object_method(mask_matrix,gensym("lock"),mask_savelock);
 	return err;
 }
 
-void copy_depth_data(uint16_t *source, char *out_bp, t_jit_matrix_info *dest_info, t_lookup *lut)
+static void copy_depth_rows(t_copy_job *job, long start, long end)
 {
-	int i,j;
-	uint16_t *in;
-	
+	convert_depth_rows((uint8_t *)job->source + start * DEPTH_WIDTH * job->bits / 8, job->out_bp + job->dest_info->dimstride[1] * start,
+					   job->dest_info->dimstride[1], DEPTH_WIDTH, end - start, start, job->bits, &job->conv);
+}
+
+void copy_depth_data(uint8_t *source, int bits, char *out_bp, t_jit_matrix_info *dest_info, const t_convert_depth *conv, t_worker_pool *pool)
+{
+	t_copy_job job;
 	
 	if(!source){
 		return;	
@@ -991,248 +2815,208 @@ void copy_depth_data(uint16_t *source, char *out_bp, t_jit_matrix_info *dest_inf
 		return;
 	}
 	
-	in = source;
+	job.source = source;
+	job.out_bp = out_bp;
+	job.dest_info = dest_info;
+	job.conv = *conv;
+	job.bits = bits;
 	
-	if(dest_info->type == _jit_sym_float32){
-		float *out;
-		for(i=0;i<DEPTH_HEIGHT;i++){
-			out = (float *)(out_bp + dest_info->dimstride[1] * i);
-			for(j=0;j<DEPTH_WIDTH;j++){
-				out[j] = lut->f_ptr[*in];
-				in++;
-			}
-		}
-	}
-	else if(dest_info->type == _jit_sym_float64){
-		double *out;
-		for(i=0;i<DEPTH_HEIGHT;i++){
-			out = (double *)(out_bp + dest_info->dimstride[1] * i);
-			for(j=0;j<DEPTH_WIDTH;j++){
-				out[j] = lut->d_ptr[*in];
-				in++;
-			}
-		}
-	}
-	else if(dest_info->type == _jit_sym_long){
-		long *out;
-		for(i=0;i<DEPTH_HEIGHT;i++){
-			out = (long *)(out_bp + dest_info->dimstride[1] * i);
-			for(j=0;j<DEPTH_WIDTH;j++){
-				out[j] = lut->l_ptr[*in];
-				in++;
-			}
-		}
-	}
+	worker_pool_run(pool, (t_band_func)copy_depth_rows, &job, DEPTH_HEIGHT, DEPTH_WIDTH * DEPTH_HEIGHT);
 }
 
-/*
- 
- Note: The code below works but frame rate in Max is devilishly slow. Shark reports significant load from
- jit_matrix_frommatrix_2d_float32. Frame rate on the OpenGL side is also sluggish, more than it should be.
- It would be better to have a separate external write directly to OpenGL instead of bothering with this
- point cloud matrix. This is why, for the moment I'm leaving the code, but leaving it unaccessible, as it's
- near useless as it is. jmp - 2011-01-10
-*/
-/*
-void build_geometry(t_jit_freenect_grab *x, void *matrix, char *out_bp, t_jit_matrix_info *dest_info){
-	int i,i2,j;
-	uint16_t *in, *in2;
-	float d=0, d2, pd=0, dd;
-	int valid = 0;
-	uint16_t *source = x->depth_data;
-	uint8_t *c, *rgb = x->rgb_data;
-	t_lookup *lut = &x->lut;
-	t_cloud *cloud = &x->cloud;
-	float threshold = x->threshold;
-	float *f, *f2, *frgb = x->rgb;
-	float4 vec;
-	
-	const float xscale = 1.f/DEPTH_WIDTH;
-	const float yscale = 1.f/DEPTH_HEIGHT;
-	const float colscale = 1.f / 255.f;
+static void copy_region_rows(t_copy_job *job, long start, long end)
+{
+	convert_region_rows(job->source, job->out_bp, job->dest_info->dimstride[1], DEPTH_WIDTH, start, end, job->bits, &job->region, &job->conv);
+}
+
+void copy_depth_region(uint8_t *source, int bits, char *out_bp, t_jit_matrix_info *dest_info, const t_convert_region *region,
+					   const t_convert_depth *conv, t_worker_pool *pool)
+{
+	t_copy_job job;
 	
 	if(!source){
 		return;	
 	}
 	
 	if(!out_bp || !dest_info){
-		error("Invalid pointer in copy_depth_data.");
+		error("Invalid pointer in copy_depth_region.");
 		return;
 	}
 	
-	in = source;
-	in2 = source + DEPTH_WIDTH;
-	
-	cloud->count = 0;
+	job.source = source;
+	job.out_bp = out_bp;
+	job.dest_info = dest_info;
+	job.conv = *conv;
+	job.region = *region;
+	job.bits = bits;
 	
-	threshold *= threshold;
-	
-	c = rgb;
-	f = frgb;
+	worker_pool_run(pool, (t_band_func)copy_region_rows, &job, region->height,
+					region->width * region->height * region->factor * region->factor);
+}
+
+void register_depth_data(t_jit_freenect_grab *x, char *out_bp, t_jit_matrix_info *dest_info)
+{
+	const uint16_t *in = depth_frame(x);
 	
+	if(in && x->registration.valid){
+		//16-bit outputs are char matrices, the table knows which
+		registration_depth(&x->registration, in, out_bp, dest_info->dimstride[1], &x->lut, convert_type(x->lut_type));
+	}
+}
+
+//Nothing until the first depth frame
+void register_rgb_data(t_jit_freenect_grab *x, char *out_bp, t_jit_matrix_info *dest_info)
+{
+	const uint16_t *in = depth_frame(x);
 	
-	for(i=0;i<DEPTH_HEIGHT;i++){
-		for(j=0;j<(DEPTH_WIDTH*3);j+=4){
-			vec[0] = (float)c[0];
-			vec[1] = (float)c[1];
-			vec[2] = (float)c[2];
-			vec[3] = (float)c[3];
-			mult_scalar_float4(vec, colscale, f);
-			c+=4;
-			f+=4;
-		}
+	if(in && x->rgb_data && x->registration.valid){
+		registration_rgb(&x->registration, in, x->rgb_data, x->video_width, out_bp, dest_info->dimstride[1],
+						 dest_info->planecount);
 	}
+}
+
+void build_geometry(t_jit_freenect_grab *x, void *matrix, t_jit_matrix_info *dest_info){
+	t_cloud *cloud = &x->cloud;
+	t_cloud_source source;
 	
-	f = frgb;
-	f2 = frgb + (3 * DEPTH_WIDTH);
-		
-	for(i=0,i2=1;i<(DEPTH_HEIGHT-1);i++,i2++){
-		
-		valid = 0;
-		
-		for(j=0;j<DEPTH_WIDTH;j++){
-			
-			if(*in != 0x7FF){
-				pd = d;
-				d = lut->f_ptr[*in];
-				if(valid){
-					dd = pd - d; dd*=dd;
-					if(dd < threshold){
-						push_cloud_point(cloud, xlut[j] * d, ylut[i] * d, d * -1.f, 
-										 (float)j*xscale, (float)i*yscale,
-										 0.f,0.f,-1.f,
-										 f[0],f[1],f[2],1.f);
-					}
-					else{
-						terminate_cloud_point(cloud);
-						start_cloud_point(cloud, xlut[j] * d, ylut[i] * d, d * -1.f, 
-										  (float)j*xscale, (float)i*yscale,
-										  0.f,0.f,-1.f,
-										  f[0],f[1],f[2],1.f);
-					}
-				}
-				else{
-					start_cloud_point(cloud, xlut[j] * d, ylut[i] * d, d * -1.f, 
-									  (float)j*xscale, (float)i*yscale,
-									  0.f,0.f,-1.f,
-									  f[0],f[1],f[2],1.f);
-					valid = 1;
-				}
-				if(*in2 != 0x7FF){
-					d2 = lut->f_ptr[*in2];
-					dd = d2 - d; dd*=dd;
-					if(dd < threshold){
-						push_cloud_point(cloud, xlut[j] * d2, ylut[i2] * d2, d2 * -1.f, 
-										 (float)j*xscale, (float)i*yscale,
-										 0.f,0.f,-1.f,
-										 f2[0],f2[1],f2[2],1.f);
-					}
-					else{
-						terminate_cloud_point(cloud);
-					}
-				}
-				else{
-					terminate_cloud_point(cloud);
-				}
-			}
-			else if(valid){
-				terminate_cloud_point(cloud);
-				valid = 0;
-			}
-			in++;
-			in2++;
-			f+=3;
-			f2+=3;
-		}
-		
-		if(cloud->count && valid)terminate_cloud_point(cloud);
+	source.depth = depth_frame(x);
+	if(!source.depth || !cloud->points || !x->lut.f_ptr || !x->registration.valid){
+		return;
 	}
-	 	
+	source.lut = x->lut.f_ptr;
+	source.rays = x->registration.rays;
+	source.rgb = x->rgb_data;
+	source.rgb_planes = video_planes(x);
+	source.rgb_width = x->video_width;
+	source.threshold = x->threshold;
+	cloud_build(cloud, &source, x->cloud_layout);
+	
 	dest_info->type = _jit_sym_float32;
-	dest_info->planecount = 12;
 	dest_info->dimcount = 1;
+	
+	switch(x->cloud_layout){
+		case CLOUD_COMPACT:
+			dest_info->planecount = CLOUD_COMPACT_PLANES;
+			dest_info->dimstride[0] = CLOUD_COMPACT_PLANES * sizeof(float);
+			break;
+		case CLOUD_PLANES:
+			//One row per component, rows are CLOUD_SIZE floats apart
+			dest_info->planecount = 1;
+			dest_info->dimcount = 2;
+			dest_info->dim[1] = CLOUD_COMPACT_PLANES;
+			dest_info->dimstride[0] = sizeof(float);
+			dest_info->dimstride[1] = CLOUD_SIZE * sizeof(float);
+			break;
+		default:
+			dest_info->planecount = 12;
+			dest_info->dimstride[0] = sizeof(t_point3D);
+			break;
+	}
+	
 	dest_info->dim[0] = cloud->count;
-	dest_info->dimstride[0] = sizeof(t_point3D);
 	dest_info->flags = JIT_MATRIX_DATA_REFERENCE | JIT_MATRIX_DATA_FLAGS_USE;
 	jit_object_method(matrix,_jit_sym_setinfo_ex,dest_info);
 	jit_object_method(matrix,_jit_sym_data,cloud->points);
-	
 }
-*/
 
-void copy_rgb_data(uint8_t *source, char *out_bp, t_jit_matrix_info *dest_info)
+//The output matrix has the size of the video frame, see matrix_calc
+static void copy_rgb_rows(t_copy_job *job, long start, long end)
 {
-	int i,j;
+	long planes = (job->dest_info->planecount == 4) ? 3 : 1;
+	long width = job->dest_info->dim[0];
 	
-	char *out;
-	uint8_t *in;
+	convert_rgb_rows((uint8_t *)job->source + start * width * planes, job->out_bp + job->dest_info->dimstride[1] * start,
+					 job->dest_info->dimstride[1], width, end - start, job->dest_info->planecount);
+}
+
+void copy_rgb_data(uint8_t *source, char *out_bp, t_jit_matrix_info *dest_info, t_worker_pool *pool)
+{
+	t_copy_job job;
 	
 	if(!source){
 		return;
 	}
 	
 	if(!out_bp || !dest_info){
-		error("Invalid pointer in copy_depth_data.");
+		error("Invalid pointer in copy_rgb_data.");
 		return;
 	}
 	
-	in = source;
+	job.source = source;
+	job.out_bp = out_bp;
+	job.dest_info = dest_info;
+	job.bits = 8;
 	
-	if(dest_info->planecount == 4){
-		for(i=0;i<RGB_HEIGHT;i++){
-			out = out_bp + dest_info->dimstride[1] * i;
-			for(j=0;j<RGB_WIDTH;j++){
-				out[0] = 0xFF;
-				out[1] = in[0];
-				out[2] = in[1];
-				out[3] = in[2];
-				
-				out += 4;
-				in += 3;
-			}
-		}
-	}
-	else if(dest_info->planecount == 1){
-		for(i=0;i<RGB_HEIGHT;i++){
-			out = out_bp + dest_info->dimstride[1] * i;
-			for(j=0;j<RGB_WIDTH;j++){
-				*out = *in;
-				
-				out ++;
-				in ++;
-			}
-		}
+	worker_pool_run(pool, (t_band_func)copy_rgb_rows, &job, dest_info->dim[1], dest_info->dim[0] * dest_info->dim[1]);
+}
+
+static void copy_frame_rows(t_fused_job *job, long start, long end)
+{
+	convert_fused_rows(&job->depth, &job->video, start, end, &job->conv);
+}
+
+void copy_frames(uint8_t *depth, int depth_bits, char *depth_bp, t_jit_matrix_info *depth_info, uint8_t *rgb, char *rgb_bp,
+				 t_jit_matrix_info *rgb_info, const t_convert_depth *conv, t_worker_pool *pool)
+{
+	t_fused_job job;
+	
+	if(!depth_bp || !depth_info || !rgb_bp || !rgb_info){
+		error("Invalid pointer in copy_frames.");
+		return;
 	}
+	
+	job.depth.in = depth;
+	job.depth.out_bp = depth_bp;
+	job.depth.stride = depth_info->dimstride[1];
+	job.depth.width = DEPTH_WIDTH;
+	job.depth.height = DEPTH_HEIGHT;
+	job.depth.planecount = 1;
+	job.depth.bits = depth_bits;
+	job.video.in = rgb;
+	job.video.out_bp = rgb_bp;
+	job.video.stride = rgb_info->dimstride[1];
+	job.video.width = rgb_info->dim[0];
+	job.video.height = rgb_info->dim[1];
+	job.video.planecount = rgb_info->planecount;
+	job.video.bits = 8;
+	job.conv = *conv;
+	
+	//Each band converts depth and video rows, both count towards the pool threshold
+	worker_pool_run(pool, (t_band_func)copy_frame_rows, &job, DEPTH_HEIGHT,
+					DEPTH_WIDTH * DEPTH_HEIGHT + job.video.width * job.video.height);
 }
 
 void rgb_callback(freenect_device *dev, void *pixels, uint32_t timestamp){
 	t_jit_freenect_grab *x;
+	uint64_t arrival;
 	
 	x = freenect_get_user(dev);
 	
 	if(!x)return;
-    
-    pthread_mutex_lock(&x->cb_mutex);
 	
-	x->rgb_data = pixels;
-	x->rgb_timestamp = timestamp;
-	x->have_rgb_frames++;
-    
-    pthread_mutex_unlock(&x->cb_mutex);
+	arrival = x->profile ? monotonic_us() : 0;
+	
+	if(x->recorder.active){
+		recorder_push(&x->recorder, RECORD_VIDEO, &x->rgb_buffer, timestamp);
+	}
+	
+	//pixels is x->rgb_buffer's back slot, publish it and let libfreenect fill the slot we get back
+	freenect_set_video_buffer(dev, frame_buffer_publish(&x->rgb_buffer, timestamp, arrival));
 }
 
 void depth_callback(freenect_device *dev, void *pixels, uint32_t timestamp){
 	t_jit_freenect_grab *x;
+	uint64_t arrival;
 	
 	x = freenect_get_user(dev);
 	
 	if(!x)return;
-    
-    pthread_mutex_lock(&x->cb_mutex);
-	
-	x->depth_data = pixels;
-	x->depth_timestamp = timestamp;
-	x->have_depth_frames++;
-    
-    pthread_mutex_unlock(&x->cb_mutex);
+	
+	arrival = x->profile ? monotonic_us() : 0;
+	
+	if(x->recorder.active){
+		recorder_push(&x->recorder, RECORD_DEPTH, &x->depth_buffer, timestamp);
+	}
+	
+	freenect_set_depth_buffer(dev, frame_buffer_publish(&x->depth_buffer, timestamp, arrival));
 }
@@ -137,6 +137,9 @@ void *max_jit_freenect_grab_new(t_symbol *s, long argc, t_atom *argv)
 						void *output = max_jit_mop_getoutput(x, 1);
 						jit_attr_setsym(output, _jit_sym_type, s);
 					}
+					else if((s == gensym("uint16"))||(s == gensym("float16"))){
+						jit_attr_setlong(o, gensym("depth16"), (s == gensym("uint16")) ? 1 : 2);
+					}
 					else{
 						error("Invalid type argument: %s", argv[0].a_w.w_sym->s_name);
 					}
@@ -0,0 +1,215 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth 
+ jmp@jmpelletier.com
+ 
+ This file is part of jit.freenect.grab.
+  
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ 
+ http://www.apache.org/licenses/LICENSE-2.0
+ 
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ 
+ */
+
+/*
+ Stress test of the frame buffer. A producer thread plays the libfreenect callbacks, writing
+ frames as fast as it can and pinning some for a writer thread like the recorder does, while the
+ main thread plays matrix_calc. Every word of frame n is n, so a frame that was written while
+ being read, or handed out before it was complete, shows up as a mix.
+   freenect.buffer.test [seconds]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "freenect.buffer.h"
+
+#define FRAME_WORDS (640 * 480 / 2)  //The size of an unpacked depth frame
+#define DEFAULT_SECONDS 2
+
+typedef struct _test{
+	t_frame_buffer   buf;
+	volatile long    stop;
+	volatile long    recording;
+	long             produced;
+	long             pinned;
+	//Pinned frames, single producer single consumer like the recorder's ring
+	long             queue_index[BUFFER_SPARES];
+	uint32_t         queue_frame[BUFFER_SPARES];
+	volatile long    head;
+	volatile long    tail;
+	volatile long    written;
+	volatile long    torn;
+} t_test;
+
+static uint32_t xorshift32(uint32_t *state){
+	uint32_t v = *state;
+	v ^= v << 13;
+	v ^= v >> 17;
+	v ^= v << 5;
+	return *state = v;
+}
+
+//Number of words of a frame that are not n
+static long check_frame(const uint8_t *data, uint32_t n){
+	const uint32_t *words = (const uint32_t *)data;
+	long i, bad = 0;
+	
+	for(i=0;i<FRAME_WORDS;i++){
+		bad += (words[i] != n);
+	}
+	return bad;
+}
+
+static void *producer_threadfunc(void *arg){
+	t_test *t = (t_test *)arg;
+	uint8_t *slot = t->buf.slots[t->buf.back];
+	uint32_t n = 0;
+	long i, index;
+	
+	while(!t->stop){
+		n++;
+		for(i=0;i<FRAME_WORDS;i++){
+			((volatile uint32_t *)slot)[i] = n;
+		}
+		//Every other frame is recorded, as long as the writer keeps up
+		if(t->recording && (n & 1) && (t->head - t->tail < BUFFER_SPARES)){
+			index = frame_buffer_pin(&t->buf);
+			if(index >= 0){
+				t->queue_index[t->head % BUFFER_SPARES] = index;
+				t->queue_frame[t->head % BUFFER_SPARES] = n;
+				__sync_synchronize();
+				t->head++;
+				t->pinned++;
+			}
+		}
+		slot = frame_buffer_publish(&t->buf, n, 0);
+		t->produced++;
+	}
+	return NULL;
+}
+
+static void *writer_threadfunc(void *arg){
+	t_test *t = (t_test *)arg;
+	uint32_t seed = 7;
+	long index;
+	uint32_t n;
+	
+	while(!t->stop || (t->tail != t->head)){
+		if(t->tail == t->head){
+			usleep(100);
+			continue;
+		}
+		__sync_synchronize();
+		index = t->queue_index[t->tail % BUFFER_SPARES];
+		n = t->queue_frame[t->tail % BUFFER_SPARES];
+		usleep(xorshift32(&seed) % 2000);  //Slower than the producer, so slots get retired
+		if(check_frame(t->buf.slots[index], n)){
+			printf("recorded frame %u was overwritten while the writer held it\n", n);
+			t->torn++;
+		}
+		frame_buffer_unpin(&t->buf, index);
+		__sync_synchronize();
+		t->tail++;
+		t->written++;
+	}
+	return NULL;
+}
+
+//Play matrix_calc for a while, returns the number of frames taken
+static long consume(t_test *t, double seconds, uint32_t *last){
+	struct timespec start, now;
+	uint32_t seed = 3, n;
+	const uint8_t *data;
+	long taken = 0;
+	
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do{
+		data = frame_buffer_acquire(&t->buf, &n);
+		if(data){
+			if(check_frame(data, n)){
+				printf("frame %u was torn when acquired\n", n);
+				t->torn++;
+			}
+			if(n <= *last){
+				printf("frame %u acquired after frame %u\n", n, *last);
+				t->torn++;
+			}
+			*last = n;
+			taken++;
+			//Hold the front slot for a while like a slow patch, it must not change meanwhile
+			usleep(xorshift32(&seed) % 500);
+			if(check_frame(data, n)){
+				printf("frame %u changed while matrix_calc held it\n", n);
+				t->torn++;
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	}while((now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) * 1e-9 < seconds);
+	return taken;
+}
+
+int main(int argc, char **argv){
+	t_test t;
+	pthread_t producer, writer;
+	double seconds = (argc > 1) ? atof(argv[1]) : DEFAULT_SECONDS;
+	uint32_t last = 0, n;
+	long taken, dropped;
+	
+	memset(&t, 0, sizeof(t));
+	if(frame_buffer_allocate(&t.buf, FRAME_WORDS * sizeof(uint32_t)) || frame_buffer_add_spares(&t.buf)){
+		printf("out of memory\n");
+		return 1;
+	}
+	if(pthread_create(&producer, NULL, producer_threadfunc, &t) || pthread_create(&writer, NULL, writer_threadfunc, &t)){
+		printf("could not start the threads\n");
+		return 1;
+	}
+	
+	//Half the time plain, half the time recording
+	taken = consume(&t, seconds / 2, &last);
+	t.recording = 1;
+	taken += consume(&t, seconds / 2, &last);
+	
+	t.stop = 1;
+	pthread_join(producer, NULL);
+	pthread_join(writer, NULL);
+	if(frame_buffer_acquire(&t.buf, &n)){
+		taken++;
+	}
+	
+	printf("%ld frames produced, %ld taken, %ld dropped, %ld recorded\n", t.produced, taken, t.buf.dropped, t.written);
+	if(t.produced != taken + t.buf.dropped){
+		printf("frames were lost: %ld produced, %ld taken or dropped\n", t.produced, taken + t.buf.dropped);
+		t.torn++;
+	}
+	if(t.written != t.pinned){
+		printf("%ld frames pinned, %ld recorded\n", t.pinned, t.written);
+		t.torn++;
+	}
+	
+	//A stream matrix_calc does not take, like a disabled output, drops nothing
+	t.buf.watched = 0;
+	dropped = t.buf.dropped;
+	for(n=0;n<10;n++){
+		frame_buffer_publish(&t.buf, n, 0);
+	}
+	if(t.buf.dropped != dropped){
+		printf("%ld unwatched frames counted as dropped\n", t.buf.dropped - dropped);
+		t.torn++;
+	}
+	frame_buffer_release(&t.buf);
+	
+	printf("%s\n", t.torn ? "FAILED" : "passed");
+	return t.torn ? 1 : 0;
+}
@@ -0,0 +1,729 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth 
+ jmp@jmpelletier.com
+ 
+ This file is part of jit.freenect.grab.
+  
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ 
+ http://www.apache.org/licenses/LICENSE-2.0
+ 
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ 
+ */
+
+/*
+ Depth conversion kernels against the lookup table, which stays the reference. For every output
+ type and mode, each raw value is converted in the body of a row, where kernels take whole
+ vectors, in rows narrower than a vector, where it goes through the tail, and packed in 11 bits.
+ Packed 10-bit values must convert like their 11-bit doubles, and their hole 0x3FF like 0x7FF.
+ Kernels match the table exactly except for mode 3 reciprocals, within CONVERT_RCP_TOLERANCE
+ relative for float32 and one unit in the last place for half floats, and a value converts to
+ the same bits wherever it sits in a row. Video rows must match the loop copy_rgb_data used
+ before the kernels byte for byte, row padding included. Decimated regions must pool each block
+ exactly as computed from the block directly, and the spatial filter give the median of a
+ sorted window, for random frames and for every window of zeros and ones. The temporal filter's
+ output, history and hold ages must follow a plain restatement of it frame after frame, and the
+ foreground mask mark exactly the values below their background threshold.
+   freenect.convert.test
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "freenect.convert.h"
+
+#define VALUES 0x800
+#define VALUES10 0x400
+#define BODY_WIDTH (VALUES + 3)  //Leaves a tail after any vector width
+#define TAIL_WIDTH 5             //Narrower than a vector
+#define TAIL_ROWS ((VALUES + TAIL_WIDTH - 1) / TAIL_WIDTH)
+#define MODES 6
+#define REPORT_MAX 8             //Mismatches printed per case
+#define VIDEO_ROWS 6
+#define PADDING 0xA5             //Fills the output, bytes between rows must keep it
+#define REGION_FRAME_WIDTH 640
+#define REGION_FRAME_HEIGHT 41   //Leaves rows below the last block of most factors
+#define MEDIAN_ROWS 7            //More than a 5x5 window, so rows away from the edges too
+#define TEMPORAL_ROWS 3
+#define TEMPORAL_FRAMES 40
+#define MASK_WIDTH 632           //A multiple of 8 for packing that still leaves a tail after 16
+#define MASK_ROWS 3
+#define MASK_PADDING 5
+
+static const int types[] = {CONVERT_LONG, CONVERT_FLOAT32, CONVERT_FLOAT64, CONVERT_UINT16, CONVERT_FLOAT16};
+static const char *type_names[] = {"none", "char", "long", "float32", "float64", "uint16", "float16"};
+
+//The factory disparity model, as jit.freenect.grab.c uses without a calibration file
+static const float disparity_scale = -0.0030711016f;
+static const float disparity_offset = 3.3309495161f;
+
+static double value(const char *p, int type){
+	switch(type){
+		case CONVERT_LONG: return (double)*(const long *)p;
+		case CONVERT_FLOAT32: return *(const float *)p;
+		case CONVERT_FLOAT64: return *(const double *)p;
+		default: return (double)*(const uint16_t *)p;
+	}
+}
+
+//Whether a kernel value a is close enough to the table's b
+static int matches(const char *a, const char *b, int type, int mode){
+	int size = convert_size(type);
+	
+	if(!memcmp(a, b, size)){
+		return 1;
+	}
+	if((mode != 3) && (mode != 4)){
+		return 0;
+	}
+	if(type == CONVERT_FLOAT32){
+		float fa = *(const float *)a, fb = *(const float *)b;
+		return fabs((double)fa - (double)fb) <= CONVERT_RCP_TOLERANCE * fabs((double)fb);
+	}
+	if(type == CONVERT_FLOAT16){
+		uint16_t ha = *(const uint16_t *)a, hb = *(const uint16_t *)b;
+		return ((ha ^ hb) < 0x8000) && (abs((int)ha - (int)hb) <= 1);
+	}
+	return 0;
+}
+
+//Compare count values converted from raw against the table, or exactly against other when given
+static long check(const char *name, const uint16_t *raw, const char *out, const char *other, long count,
+				  const t_lookup *lut, int type, int mode){
+	int size = convert_size(type);
+	char table[8];
+	long i, bad = 0;
+	
+	for(i=0;i<count;i++){
+		const char *p = out + i * size;
+		int ok;
+		
+		if(other){
+			ok = !memcmp(p, other + raw[i] * size, size);
+			memcpy(table, other + raw[i] * size, size);
+		}
+		else{
+			switch(type){
+				case CONVERT_LONG: memcpy(table, lut->l_ptr + raw[i], size); break;
+				case CONVERT_FLOAT32: memcpy(table, lut->f_ptr + raw[i], size); break;
+				case CONVERT_FLOAT64: memcpy(table, lut->d_ptr + raw[i], size); break;
+				default: memcpy(table, lut->s_ptr + raw[i], size); break;
+			}
+			ok = matches(p, table, type, mode);
+		}
+		if(!ok){
+			if(bad < REPORT_MAX){
+				printf("%s %s mode %d: raw %d gives %.9g, expected %.9g\n", name, type_names[type], mode, raw[i],
+					   value(p, type), value(table, type));
+			}
+			bad++;
+		}
+	}
+	return bad;
+}
+
+//Most significant bit first, like FREENECT_DEPTH_11BIT_PACKED
+static void pack_depth(const uint16_t *in, uint8_t *out, long count, int bits){
+	uint32_t acc = 0;
+	int nbits = 0;
+	long i;
+	
+	for(i=0;i<count;i++){
+		acc = (acc << bits) | (in[i] & ((1 << bits) - 1));
+		nbits += bits;
+		while(nbits >= 8){
+			nbits -= 8;
+			*out++ = (uint8_t)(acc >> nbits);
+		}
+	}
+	if(nbits){
+		*out = (uint8_t)(acc << (8 - nbits));
+	}
+}
+
+//Every case once with the kernels selected so far, returns the number of mismatches
+static long run(int selected, const uint16_t *body, const uint16_t *tail, const uint8_t *packed, const uint8_t *packed10,
+				const uint16_t *widened, char *out, char *row){
+	t_lookup lut = {NULL};
+	t_convert_depth conv;
+	long bad = 0;
+	int t, m, size, err;
+	
+	for(t=0;t<(int)(sizeof(types) / sizeof(types[0]));t++){
+		for(m=0;m<MODES;m++){
+			err = convert_lut(&lut, types[t], m, disparity_scale, disparity_offset);
+			if((types[t] == CONVERT_UINT16) && ((m == 3) || (m == 4))){
+				//Metres would clip to 0-10, refused rather than built
+				if(err != CONVERT_ERR_TYPE){
+					printf("the %s mode %d table was built\n", type_names[types[t]], m);
+					bad++;
+				}
+				continue;
+			}
+			if(err != CONVERT_ERR_NONE){
+				printf("could not build the %s mode %d table\n", type_names[types[t]], m);
+				return bad + 1;
+			}
+			size = convert_size(types[t]);
+			memset(&conv, 0, sizeof(conv));
+			conv.lut = &lut;
+			conv.type = types[t];
+			conv.mode = m;
+			conv.scale = disparity_scale;
+			conv.offset = disparity_offset;
+			
+			conv.height = 1;
+			convert_depth_rows(body, row, BODY_WIDTH * size, BODY_WIDTH, 1, 0, 16, &conv);
+			bad += check(selected ? "body" : "scalar", body, row, NULL, BODY_WIDTH, &lut, types[t], m);
+			
+			//Packed rows unpack through the kernel, then its tail through the scalar loop
+			convert_depth_rows(packed, out, VALUES * size, VALUES, 1, 0, 11, &conv);
+			bad += check("packed against body", body, out, row, VALUES, &lut, types[t], m);
+			convert_depth_rows(packed10, out, VALUES10 * size, VALUES10, 1, 0, 10, &conv);
+			bad += check("10-bit packed against body", widened, out, row, VALUES10, &lut, types[t], m);
+			if(!selected){
+				continue;
+			}
+			
+			conv.height = TAIL_ROWS;
+			convert_depth_rows(tail, out, TAIL_WIDTH * size, TAIL_WIDTH, TAIL_ROWS, 0, 16, &conv);
+			bad += check("tail", tail, out, NULL, TAIL_WIDTH * TAIL_ROWS, &lut, types[t], m);
+			bad += check("tail against body", tail, out, row, TAIL_WIDTH * TAIL_ROWS, &lut, types[t], m);
+		}
+	}
+	convert_lut(&lut, CONVERT_NONE, 0, 0.f, 0.f);
+	return bad;
+}
+
+//copy_rgb_data before the kernels, RGB24 to ARGB32 with opaque alpha or IR copied
+static void copy_rgb_reference(const uint8_t *in, char *out_bp, long stride, long width, long rows, long planecount){
+	char *out;
+	long i, j;
+	
+	if(planecount == 4){
+		for(i=0;i<rows;i++){
+			out = out_bp + stride * i;
+			for(j=0;j<width;j++){
+				out[0] = 0xFF;
+				out[1] = in[0];
+				out[2] = in[1];
+				out[3] = in[2];
+				
+				out += 4;
+				in += 3;
+			}
+		}
+	}
+	else if(planecount == 1){
+		for(i=0;i<rows;i++){
+			out = out_bp + stride * i;
+			for(j=0;j<width;j++){
+				*out = *in;
+				
+				out ++;
+				in ++;
+			}
+		}
+	}
+}
+
+//Video rows of the Kinect's widths and odd ones that leave kernel tails, packed and padded
+static long run_video(int selected){
+	static const long widths[] = {640, 1280, 637, 5};
+	static const long paddings[] = {0, 3, 64};
+	static const long planecounts[] = {4, 1};
+	uint32_t seed = 1;
+	uint8_t *in;
+	char *out, *expected;
+	long w, p, c, i, stride, bytes, bad = 0;
+	
+	in = (uint8_t *)malloc(1280 * VIDEO_ROWS * 3);
+	out = (char *)malloc((1280 * 4 + 64) * VIDEO_ROWS);
+	expected = (char *)malloc((1280 * 4 + 64) * VIDEO_ROWS);
+	if(!in || !out || !expected){
+		printf("out of memory\n");
+		return 1;
+	}
+	for(i=0;i<1280 * VIDEO_ROWS * 3;i++){
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		in[i] = (uint8_t)seed;
+	}
+	
+	for(w=0;w<(long)(sizeof(widths) / sizeof(widths[0]));w++){
+		for(p=0;p<(long)(sizeof(paddings) / sizeof(paddings[0]));p++){
+			for(c=0;c<(long)(sizeof(planecounts) / sizeof(planecounts[0]));c++){
+				stride = widths[w] * planecounts[c] + paddings[p];
+				bytes = stride * VIDEO_ROWS;
+				memset(out, PADDING, bytes);
+				memset(expected, PADDING, bytes);
+				convert_rgb_rows(in, out, stride, widths[w], VIDEO_ROWS, planecounts[c]);
+				copy_rgb_reference(in, expected, stride, widths[w], VIDEO_ROWS, planecounts[c]);
+				for(i=0;i<bytes;i++){
+					if(out[i] != expected[i]){
+						if(bad < REPORT_MAX){
+							printf("%s video %s %ldx%d stride %ld: byte %ld is %d, expected %d\n", selected ? "kernel" : "scalar",
+								   (planecounts[c] == 4) ? "rgb" : "ir", widths[w], VIDEO_ROWS, stride, i,
+								   (uint8_t)out[i], (uint8_t)expected[i]);
+						}
+						bad++;
+					}
+				}
+			}
+		}
+	}
+	free(in);
+	free(out);
+	free(expected);
+	return bad;
+}
+
+static uint32_t xorshift(uint32_t *seed){
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 17;
+	*seed ^= *seed << 5;
+	return *seed;
+}
+
+//Raw values below 0x7FF with holes one in holes, 0 for none
+static void random_depth(uint16_t *out, long count, uint32_t *seed, int holes){
+	long i;
+	
+	for(i=0;i<count;i++){
+		out[i] = (holes && !(xorshift(seed) % holes)) ? 0x7FF : (uint16_t)(xorshift(seed) % 0x7FF);
+	}
+}
+
+//Output value of region pixel (x, y), computed directly from its block
+static uint16_t pool_reference(const uint16_t *frame, const t_convert_region *region, long x, long y){
+	const uint16_t *block = frame + (region->y + y * region->factor) * REGION_FRAME_WIDTH + region->x + x * region->factor;
+	unsigned long sum = 0, n = 0;
+	uint16_t v = 0x7FF;
+	long i, j;
+	
+	if(region->pooling == CONVERT_SKIP){
+		return block[0];
+	}
+	for(i=0;i<region->factor;i++){
+		for(j=0;j<region->factor;j++){
+			uint16_t raw = block[i * REGION_FRAME_WIDTH + j];
+			
+			if(raw < 0x7FF){
+				sum += raw;
+				n++;
+				v = (raw < v) ? raw : v;
+			}
+		}
+	}
+	if(region->pooling == CONVERT_MIN){
+		return v;
+	}
+	return n ? (uint16_t)((sum + n / 2) / n) : 0x7FF;
+}
+
+//Regions of every pooling and factor, unpacked and packed, from an odd corner so rows end in
+//kernel tails. The frame has a band of the largest raw value, where the mean's sums peak, and a
+//block of holes only.
+static long run_region(int selected){
+	static const long factors[] = {1, 2, 3, 5, CONVERT_MAX_FACTOR};
+	static const int poolings[] = {CONVERT_SKIP, CONVERT_MEAN, CONVERT_MIN};
+	static const char *pooling_names[] = {"skip", "mean", "min"};
+	static const int bits[] = {16, 11};
+	uint16_t *frame, *out;
+	uint8_t *packed;
+	uint32_t seed = 7;
+	t_convert_depth conv;
+	t_convert_region region;
+	long f, p, b, i, x, y, bad = 0;
+	uint16_t expected;
+	
+	frame = (uint16_t *)malloc(REGION_FRAME_WIDTH * REGION_FRAME_HEIGHT * sizeof(uint16_t));
+	out = (uint16_t *)malloc(REGION_FRAME_WIDTH * REGION_FRAME_HEIGHT * sizeof(uint16_t));
+	packed = (uint8_t *)malloc(REGION_FRAME_WIDTH * REGION_FRAME_HEIGHT * 11 / 8);
+	if(!frame || !out || !packed){
+		printf("out of memory\n");
+		return 1;
+	}
+	random_depth(frame, REGION_FRAME_WIDTH * REGION_FRAME_HEIGHT, &seed, 8);
+	for(y=0;y<REGION_FRAME_HEIGHT;y++){
+		for(x=96;x<160;x++){
+			frame[y * REGION_FRAME_WIDTH + x] = 0x7FE;
+		}
+		for(x=320;x<352;x++){
+			frame[y * REGION_FRAME_WIDTH + x] = 0x7FF;
+		}
+	}
+	pack_depth(frame, packed, REGION_FRAME_WIDTH * REGION_FRAME_HEIGHT, 11);
+	
+	//Pooled raw values come out unconverted
+	memset(&conv, 0, sizeof(conv));
+	conv.type = CONVERT_NONE;
+	conv.height = REGION_FRAME_HEIGHT;
+	for(b=0;b<(long)(sizeof(bits) / sizeof(bits[0]));b++){
+		for(p=0;p<(long)(sizeof(poolings) / sizeof(poolings[0]));p++){
+			for(f=0;f<(long)(sizeof(factors) / sizeof(factors[0]));f++){
+				region.x = 3;
+				region.y = 1;
+				region.factor = factors[f];
+				region.pooling = poolings[p];
+				region.width = (REGION_FRAME_WIDTH - region.x) / region.factor;
+				region.height = (REGION_FRAME_HEIGHT - region.y) / region.factor;
+				convert_region_rows((bits[b] == 16) ? (const void *)frame : (const void *)packed, (char *)out,
+									region.width * sizeof(uint16_t), REGION_FRAME_WIDTH, 0, region.height, bits[b], &region, &conv);
+				for(i=0;i<region.width * region.height;i++){
+					expected = pool_reference(frame, &region, i % region.width, i / region.width);
+					if(out[i] != expected){
+						if(bad < REPORT_MAX){
+							printf("%s region %s factor %ld %d-bit: (%ld, %ld) is %d, expected %d\n", selected ? "kernel" : "scalar",
+								   pooling_names[poolings[p]], factors[f], bits[b], i % region.width, i / region.width, out[i], expected);
+						}
+						bad++;
+					}
+				}
+			}
+		}
+	}
+	free(frame);
+	free(out);
+	free(packed);
+	return bad;
+}
+
+static int compare_raw(const void *a, const void *b){
+	return (int)*(const uint16_t *)a - (int)*(const uint16_t *)b;
+}
+
+//Median of the window around (x, y) by sorting it, the frame's edge values repeated past it
+static uint16_t median_reference(const uint16_t *frame, long width, long height, long x, long y, int radius){
+	uint16_t window[25];
+	long i, j, u, v, n = 0;
+	
+	for(i=-radius;i<=radius;i++){
+		for(j=-radius;j<=radius;j++){
+			v = (y + i < 0) ? 0 : ((y + i >= height) ? height - 1 : y + i);
+			u = (x + j < 0) ? 0 : ((x + j >= width) ? width - 1 : x + j);
+			window[n++] = frame[v * width + u];
+		}
+	}
+	qsort(window, n, sizeof(uint16_t), compare_raw);
+	return window[n / 2];
+}
+
+//3x3 and 5x5 medians of random frames with clustered holes, at the Kinect's width, odd widths
+//that leave kernel tails and widths narrower than a window, unpacked and 11-bit packed
+static long run_median(int selected){
+	static const long widths[] = {640, 637, 19, 3, 1};
+	uint16_t *frame, *out;
+	uint8_t *packed;
+	uint32_t seed = 11;
+	t_convert_depth conv;
+	long w, i, width, bad = 0;
+	int spatial, bits;
+	uint16_t expected;
+	
+	frame = (uint16_t *)malloc(640 * MEDIAN_ROWS * sizeof(uint16_t));
+	out = (uint16_t *)malloc(640 * MEDIAN_ROWS * sizeof(uint16_t));
+	packed = (uint8_t *)malloc(640 * MEDIAN_ROWS * 11 / 8);
+	if(!frame || !out || !packed){
+		printf("out of memory\n");
+		return 1;
+	}
+	memset(&conv, 0, sizeof(conv));
+	conv.type = CONVERT_NONE;
+	conv.height = MEDIAN_ROWS;
+	for(w=0;w<(long)(sizeof(widths) / sizeof(widths[0]));w++){
+		width = widths[w];
+		random_depth(frame, width * MEDIAN_ROWS, &seed, 4);
+		for(i=0;i<width * MEDIAN_ROWS;i+=37){
+			frame[i] = 0x7FE;  //Next to the holes
+		}
+		pack_depth(frame, packed, width * MEDIAN_ROWS, 11);
+		for(bits=16;bits>=11;bits-=5){
+			if((bits == 11) && (width % 8)){
+				continue;
+			}
+			for(spatial=1;spatial<=2;spatial++){
+				conv.spatial = spatial;
+				convert_filter((bits == 16) ? (const void *)frame : (const void *)packed, out, width, MEDIAN_ROWS, bits, &conv);
+				for(i=0;i<width * MEDIAN_ROWS;i++){
+					expected = median_reference(frame, width, MEDIAN_ROWS, i % width, i / width, spatial);
+					if(out[i] != expected){
+						if(bad < REPORT_MAX){
+							printf("%s median %s %ldx%d %d-bit: (%ld, %ld) is %d, expected %d\n", selected ? "kernel" : "scalar",
+								   (spatial == 2) ? "5x5" : "3x3", width, MEDIAN_ROWS, bits, i % width, i / width, out[i], expected);
+						}
+						bad++;
+					}
+				}
+			}
+		}
+	}
+	free(frame);
+	free(out);
+	free(packed);
+	return bad;
+}
+
+//Every window of zeros and ones, which by the 0-1 principle proves the median networks for any
+//values. Window columns are sorted first, so a window is set by the count of ones in each column.
+//The windows sit side by side across the middle of frames of size rows, one per size columns.
+static long run_median_network(int selected){
+	uint16_t frame[5 * 640], out[5 * 640];
+	t_convert_depth conv;
+	long combos, combo, first, c, k, x, y, ones, n, bad = 0;
+	int spatial, size;
+	
+	memset(&conv, 0, sizeof(conv));
+	conv.type = CONVERT_NONE;
+	for(spatial=1;spatial<=2;spatial++){
+		size = spatial * 2 + 1;
+		conv.spatial = spatial;
+		conv.height = size;
+		for(combos=1,c=0;c<size;c++){
+			combos *= size + 1;
+		}
+		for(first=0;first<combos;first+=640 / size){
+			n = (combos - first < 640 / size) ? combos - first : 640 / size;
+			memset(frame, 0, sizeof(frame));
+			for(k=0;k<n;k++){
+				for(combo=first+k,c=0;c<size;c++,combo/=size+1){
+					for(y=0;y<combo%(size+1);y++){
+						frame[y * n * size + k * size + c] = 1;
+					}
+				}
+			}
+			convert_filter(frame, out, n * size, size, 16, &conv);
+			for(k=0;k<n;k++){
+				for(ones=0,combo=first+k,c=0;c<size;c++,combo/=size+1){
+					ones += combo % (size + 1);
+				}
+				x = k * size + spatial;
+				if(out[spatial * n * size + x] != (ones > size * size / 2)){
+					if(bad < REPORT_MAX){
+						printf("%s median %dx%d network: window %ld with %ld ones gives %d\n", selected ? "kernel" : "scalar",
+							   size, size, first + k, ones, out[spatial * n * size + x]);
+					}
+					bad++;
+				}
+			}
+		}
+	}
+	return bad;
+}
+
+//One frame of the temporal filter on one pixel, restating t_convert_temporal
+static uint16_t temporal_reference(uint16_t raw, uint16_t *history, uint8_t *age, const t_convert_temporal *temporal){
+	long d = raw, h = *history, w;
+	
+	if(d == 0x7FF){
+		if((h != CONVERT_NO_HISTORY) && (*age < temporal->hold)){
+			(*age)++;
+		}
+		else{
+			*history = CONVERT_NO_HISTORY;
+		}
+	}
+	else{
+		d *= 16;
+		if(h == CONVERT_NO_HISTORY){
+			*history = (uint16_t)d;
+		}
+		else{
+			w = temporal->alpha + (((d > h) ? d - h : h - d) * temporal->gain >> 16);
+			w = (w > 256) ? 256 : w;
+			*history = (uint16_t)((h * (256 - w) + d * w + 128) >> 8);
+		}
+		*age = 0;
+	}
+	return (*history == CONVERT_NO_HISTORY) ? 0x7FF : (*history + 8) >> 4;
+}
+
+//Frames of a scene that drifts, jumps, and loses pixels for single frames and for runs longer
+//than the hold, through the filter and the reference side by side. Output, history and age must
+//match exactly after every frame, at odd widths so rows end in kernel tails.
+static long run_temporal(int selected){
+	static const long widths[] = {637, 13};
+	static const int settings[][3] = {{32, 3000, 3}, {256, 0, 0}, {1, 65535, 255}, {96, 800, 1}};
+	uint16_t scene[637 * TEMPORAL_ROWS], frame[637 * TEMPORAL_ROWS], out[637 * TEMPORAL_ROWS];
+	uint16_t history[637 * TEMPORAL_ROWS], expected_history[637 * TEMPORAL_ROWS];
+	uint8_t age[637 * TEMPORAL_ROWS], expected_age[637 * TEMPORAL_ROWS];
+	uint32_t seed = 13;
+	t_convert_temporal temporal;
+	t_convert_depth conv;
+	long w, s, f, i, count, bad = 0;
+	uint16_t expected;
+	uint32_t r;
+	
+	memset(&conv, 0, sizeof(conv));
+	conv.type = CONVERT_NONE;
+	conv.height = TEMPORAL_ROWS;
+	conv.temporal = &temporal;
+	for(w=0;w<(long)(sizeof(widths) / sizeof(widths[0]));w++){
+		count = widths[w] * TEMPORAL_ROWS;
+		for(s=0;s<(long)(sizeof(settings) / sizeof(settings[0]));s++){
+			temporal.history = history;
+			temporal.age = age;
+			temporal.alpha = settings[s][0];
+			temporal.gain = settings[s][1];
+			temporal.hold = settings[s][2];
+			memset(history, 0xFF, sizeof(history));
+			memset(age, 0, sizeof(age));
+			memset(expected_history, 0xFF, sizeof(expected_history));
+			memset(expected_age, 0, sizeof(expected_age));
+			random_depth(scene, count, &seed, 0);
+			for(f=0;f<TEMPORAL_FRAMES;f++){
+				for(i=0;i<count;i++){
+					r = xorshift(&seed);
+					if(!(r % 16)){
+						scene[i] = (uint16_t)(xorshift(&seed) % 0x7FF);  //Something moved
+					}
+					else if(scene[i] > 4 && scene[i] < 0x7FA){
+						scene[i] += (uint16_t)((r >> 8) % 9) - 4;
+					}
+					//Every 7th pixel drops out for 6 frames in 12, longer than most holds
+					if(((i % 7 == 0) && ((f + i) % 12 < 6)) || !((r >> 16) % 6)){
+						frame[i] = 0x7FF;
+					}
+					else{
+						frame[i] = scene[i];
+					}
+				}
+				convert_filter(frame, out, widths[w], TEMPORAL_ROWS, 16, &conv);
+				for(i=0;i<count;i++){
+					expected = temporal_reference(frame[i], expected_history + i, expected_age + i, &temporal);
+					if((out[i] != expected) || (history[i] != expected_history[i]) || (age[i] != expected_age[i])){
+						if(bad < REPORT_MAX){
+							printf("%s temporal %ld wide, alpha %d gain %d hold %d, frame %ld pixel %ld: raw %d gives %d history %d age %d, "
+								   "expected %d history %d age %d\n", selected ? "kernel" : "scalar", widths[w], temporal.alpha,
+								   temporal.gain, temporal.hold, f, i, frame[i], out[i], history[i], age[i], expected,
+								   expected_history[i], expected_age[i]);
+						}
+						bad++;
+					}
+				}
+			}
+		}
+	}
+	return bad;
+}
+
+//Foreground of raw values against thresholds around them: equal, one either side, the extremes
+//and random, holes included. Rows go through convert_mask_rows with values and thresholds across
+//the whole uint16_t range, compared unsigned, then through conversions, unpacked and packed.
+static long run_mask(int selected){
+	static const char *pass_names[] = {"rows", "16-bit conversion", "11-bit conversion"};
+	uint16_t in[MASK_WIDTH * MASK_ROWS], background[MASK_WIDTH * MASK_ROWS], wide[MASK_WIDTH * MASK_ROWS];
+	uint16_t out[MASK_WIDTH * MASK_ROWS];
+	uint8_t packed[MASK_WIDTH * MASK_ROWS * 11 / 8];
+	uint8_t mask[(MASK_WIDTH + MASK_PADDING) * MASK_ROWS];
+	uint32_t seed = 17;
+	t_convert_depth conv;
+	const uint16_t *raw;
+	long i, x, y, pass, stride = MASK_WIDTH + MASK_PADDING, bad = 0;
+	uint8_t expected;
+	
+	random_depth(in, MASK_WIDTH * MASK_ROWS, &seed, 6);
+	for(i=0;i<MASK_WIDTH * MASK_ROWS;i++){
+		switch(xorshift(&seed) % 8){
+			case 0: background[i] = in[i]; break;
+			case 1: background[i] = in[i] + 1; break;
+			case 2: background[i] = (in[i] > 0) ? in[i] - 1 : 0; break;
+			case 3: background[i] = 0; break;
+			case 4: background[i] = 0x7FF; break;
+			default: background[i] = (uint16_t)(xorshift(&seed) % 0x800); break;
+		}
+	}
+	memcpy(wide, in, sizeof(wide));
+	for(i=0;i<MASK_WIDTH * MASK_ROWS;i+=3){
+		wide[i] = (uint16_t)xorshift(&seed);
+	}
+	pack_depth(in, packed, MASK_WIDTH * MASK_ROWS, 11);
+	
+	memset(&conv, 0, sizeof(conv));
+	conv.type = CONVERT_NONE;
+	conv.height = MASK_ROWS;
+	conv.mask_bp = (char *)mask;
+	conv.mask_stride = stride;
+	for(pass=0;pass<3;pass++){
+		memset(mask, PADDING, sizeof(mask));
+		if(pass == 0){
+			raw = wide;
+			for(i=0;i<MASK_WIDTH * MASK_ROWS;i+=7){
+				background[i] = (uint16_t)xorshift(&seed);
+			}
+			convert_mask_rows(raw, background, (char *)mask, stride, MASK_WIDTH, MASK_ROWS);
+		}
+		else{
+			raw = in;
+			for(i=0;i<MASK_WIDTH * MASK_ROWS;i+=7){
+				background[i] &= 0x7FF;
+			}
+			conv.background = background;
+			convert_depth_rows((pass == 1) ? (const void *)in : (const void *)packed, (char *)out, MASK_WIDTH * sizeof(uint16_t),
+							   MASK_WIDTH, MASK_ROWS, 0, (pass == 1) ? 16 : 11, &conv);
+		}
+		for(y=0;y<MASK_ROWS;y++){
+			for(x=0;x<stride;x++){
+				i = y * MASK_WIDTH + x;
+				expected = (x >= MASK_WIDTH) ? PADDING : ((raw[i] < background[i]) ? 255 : 0);
+				if(mask[y * stride + x] != expected){
+					if(bad < REPORT_MAX){
+						printf("%s mask %s: (%ld, %ld) is %d, expected %d\n", selected ? "kernel" : "scalar", pass_names[pass], x, y,
+							   mask[y * stride + x], expected);
+					}
+					bad++;
+				}
+			}
+		}
+	}
+	return bad;
+}
+
+int main(void){
+	uint16_t body[BODY_WIDTH], tail[TAIL_WIDTH * TAIL_ROWS];
+	uint16_t narrow[VALUES10], widened[VALUES10];
+	uint8_t packed[VALUES * 11 / 8], packed10[VALUES10 * 10 / 8];
+	char *out, *row;
+	long i, bad;
+	
+	for(i=0;i<BODY_WIDTH;i++){
+		body[i] = (uint16_t)(i % VALUES);
+	}
+	for(i=0;i<TAIL_WIDTH * TAIL_ROWS;i++){
+		tail[i] = (uint16_t)(i % VALUES);
+	}
+	pack_depth(body, packed, VALUES, 11);
+	for(i=0;i<VALUES10;i++){
+		narrow[i] = (uint16_t)i;
+		widened[i] = (i == 0x3FF) ? 0x7FF : (uint16_t)(i * 2);
+	}
+	pack_depth(narrow, packed10, VALUES10, 10);
+	out = (char *)malloc(TAIL_WIDTH * TAIL_ROWS * sizeof(double));
+	row = (char *)malloc(BODY_WIDTH * sizeof(double));
+	if(!out || !row){
+		printf("out of memory\n");
+		return 1;
+	}
+	
+	//Scalar first, then whatever this CPU selects
+	bad = run(0, body, tail, packed, packed10, widened, out, row) + run_video(0) + run_region(0) + run_median(0) + run_median_network(0) + run_temporal(0) + run_mask(0);
+	convert_select_kernels();
+	bad += run(1, body, tail, packed, packed10, widened, out, row) + run_video(1) + run_region(1) + run_median(1) + run_median_network(1) + run_temporal(1) + run_mask(1);
+	
+	free(out);
+	free(row);
+	if(bad){
+		printf("%ld mismatches\n", bad);
+	}
+	printf("%s\n", bad ? "FAILED" : "passed");
+	return bad ? 1 : 0;
+}
@@ -0,0 +1,479 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth 
+ jmp@jmpelletier.com
+ 
+ This file is part of jit.freenect.grab.
+  
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ 
+ http://www.apache.org/licenses/LICENSE-2.0
+ 
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ 
+ */
+
+/*
+ Registration of synthetic depth planes against a pinhole projection worked out in doubles.
+ Colour is registered from a frame of a flat wall, where each depth pixel must fetch the colour
+ pixel that sees the same 3D point, and holes come out black. Depth is registered from a wall
+ with a nearer square in front of it, where each colour pixel must hold the nearest raw value
+ seen there and 0x7FF where nothing lands, which also puts the square's parallax against the
+ wall to the test. Landings within REPORT_MARGIN of a rounding boundary could go either way in
+ the fixed-point tables and are not checked.
+ Calibration files are checked by loading one with lens distortion and projecting known 3D points
+ into both cameras: undistorting the pixel a point is seen at must give back its ray, and the
+ tables the colour pixel it is seen at, within tolerance. Every pixel's ray must also distort
+ back onto the pixel. A partial file takes the defaults for what it leaves out, while malformed
+ files and ones with a zero focal length must fail, keeping the calibration as it was, so that
+ the tables rebuilt from it do not change.
+   freenect.registration.test
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "freenect.registration.h"
+
+#define WALL 800                 //Raw depth of the plane, about 1.2m
+#define NEAR 600                 //Raw depth of the square in front of it, about 0.67m
+#define SQUARE_X 280             //Depth pixels the square covers
+#define SQUARE_Y 200
+#define SQUARE_SIZE 80
+#define HOLE_STEP 7              //Every 7th depth pixel is a hole in the colour case
+#define REPORT_MARGIN 0.01       //Landings this close to x.5 round either way, the tables are within 2/256
+#define REPORT_MAX 8             //Mismatches printed per case
+#define MIN_CHECKED 0.9          //Share of the pixels that must be checked
+#define POINT_TOLERANCE 1e-4     //Metres, interpolating the rays between pixels
+#define COLOUR_TOLERANCE 0.02    //Colour pixels, the tables have 8 fraction bits
+#define PIXEL_TOLERANCE 1e-3     //Depth pixels, rays are floats
+#define MIN_POINTS 1000          //Known points that must fall inside the frame
+#define CALIBRATION_FILE "freenect.registration.test.txt"  //Written to the working directory
+
+static const int types[] = {CONVERT_LONG, CONVERT_FLOAT32, CONVERT_FLOAT64, CONVERT_UINT16};
+static const char *type_names[] = {"none", "char", "long", "float32", "float64", "uint16", "float16"};
+
+//No lens distortion, the colour camera sits 25mm to the side and 5mm below. Colour rows then see
+//the square in earlier depth rows than the wall behind it, so the z-buffer has to keep it.
+static const t_calibration calibration = {
+	580., 580., 319.5, 239.5,
+	0., 0., 0., 0., 0.,
+	525., 525., 328., 267.,
+	0.025, 0.005, 0.,
+	-0.0030711016, 3.3309495161
+};
+
+//Distortion in a file, the last translation must be 0 as the tables do not model it
+static const char *calibration_text =
+	"# Known intrinsics with lens distortion\n"
+	"depth_intrinsics 594.21 591.04 339.5 242.7\n"
+	"depth_distortion -0.12 0.2 0.001 -0.002 -0.05\n"
+	"\n"
+	"rgb_intrinsics 529.2 525.6 328.9 267.5\n"
+	"  translation\t0.025 -0.0007 0\n"
+	"depth_disparity -0.0030711016 3.3309495161\n";
+
+static const t_calibration calibration_loaded = {
+	594.21, 591.04, 339.5, 242.7,
+	-0.12, 0.2, 0.001, -0.002, -0.05,
+	529.2, 525.6, 328.9, 267.5,
+	0.025, -0.0007, 0.,
+	-0.0030711016, 3.3309495161
+};
+
+//Files that must not load, the error they give and the line it is on
+typedef struct _bad_file{
+	const char *text;
+	int        err;
+	long       line;
+} t_bad_file;
+
+static const t_bad_file bad_files[] = {
+	{"depth_intrinsics 600 600 320 240\nrgb_intrinsics 529.2 525.6 328.9\n", REGISTRATION_ERR_FORMAT, 2},
+	{"# comment\n\ndepth_intrinsic 600 600 320 240\n", REGISTRATION_ERR_FORMAT, 3},
+	{"translation 0.025 abc 0\n", REGISTRATION_ERR_FORMAT, 1},
+	{"depth_disparity -0.003 3.3 1\n", REGISTRATION_ERR_FORMAT, 1},
+	{"depth_distortion -0.12\n", REGISTRATION_ERR_FORMAT, 1},
+	{"rgb_intrinsics 0 525.6 328.9 267.5\n", REGISTRATION_ERR_FOCAL, 0},
+	{"depth_intrinsics nan 600 320 240\n", REGISTRATION_ERR_FOCAL, 0}
+};
+
+#define BAD_FILES (sizeof(bad_files) / sizeof(bad_files[0]))
+
+//Where in the colour image the point a depth pixel sees at a raw depth is
+static void project(const t_calibration *cal, long u, long v, uint16_t raw, double *ex, double *ey){
+	double z = 1. / (raw * cal->disparity_scale + cal->disparity_offset);
+	double x = (u - cal->depth_cx) / cal->depth_fx * z;
+	double y = (v - cal->depth_cy) / cal->depth_fy * z;
+	
+	*ex = (x + cal->tx) / z * cal->rgb_fx + cal->rgb_cx;
+	*ey = (y + cal->ty) / z * cal->rgb_fy + cal->rgb_cy;
+}
+
+//Colour pixels a landing may round to, from first to last. Returns 1 when that is a single one.
+static int candidates(double e, long *first, long *last){
+	*first = (long)floor(e - REPORT_MARGIN + 0.5);
+	*last = (long)floor(e + REPORT_MARGIN + 0.5);
+	return *first == *last;
+}
+
+//Colour pixel a depth pixel lands on, returns 0 if it is ambiguous
+static int land(long u, long v, uint16_t raw, long *rx, long *ry){
+	double ex, ey;
+	long x1, y1;
+	
+	project(&calibration, u, v, raw, &ex, &ey);
+	return candidates(ex, rx, &x1) & candidates(ey, ry, &y1);
+}
+
+static int inside(long x, long y){
+	return (x >= 0) && (x < REG_WIDTH) && (y >= 0) && (y < REG_HEIGHT);
+}
+
+static double value(const char *p, int type){
+	switch(type){
+		case CONVERT_LONG: return (double)*(const long *)p;
+		case CONVERT_FLOAT32: return *(const float *)p;
+		case CONVERT_FLOAT64: return *(const double *)p;
+		default: return *(const uint16_t *)p;
+	}
+}
+
+static long run_rgb(t_registration *reg, uint16_t *depth){
+	uint8_t *rgb = (uint8_t *)malloc(REG_WIDTH * REG_HEIGHT * 3);
+	uint8_t *out = (uint8_t *)malloc(REG_WIDTH * REG_HEIGHT * 4);
+	long u, v, p, rx, ry, x, y, bad = 0, checked = 0;
+	const uint8_t *o;
+	int sure;
+	
+	if(!rgb || !out){
+		printf("out of memory\n");
+		free(rgb);
+		return 1;
+	}
+	//Each colour pixel holds its own coordinates
+	for(y=0,p=0;y<REG_HEIGHT;y++){
+		for(x=0;x<REG_WIDTH;x++,p++){
+			rgb[p*3] = (uint8_t)x;
+			rgb[p*3+1] = (uint8_t)y;
+			rgb[p*3+2] = (uint8_t)((x >> 8) | ((y >> 8) << 4));
+		}
+	}
+	for(p=0;p<REG_WIDTH*REG_HEIGHT;p++){
+		depth[p] = (p % HOLE_STEP) ? WALL : 0x7FF;
+	}
+	
+	registration_rgb(reg, depth, rgb, REG_WIDTH, (char *)out, REG_WIDTH * 4, 4);
+	
+	for(v=0,p=0;v<REG_HEIGHT;v++){
+		for(u=0;u<REG_WIDTH;u++,p++){
+			o = out + p * 4;
+			if(depth[p] == 0x7FF){
+				sure = 1;
+				rx = ry = -1;
+			}
+			else{
+				sure = land(u, v, depth[p], &rx, &ry);
+			}
+			if(!sure){
+				continue;
+			}
+			checked++;
+			if(!inside(rx, ry)){
+				if(o[0] || o[1] || o[2] || o[3]){
+					if(bad++ < REPORT_MAX){
+						printf("rgb: (%ld, %ld) lands outside but is %d %d %d %d\n", u, v, o[0], o[1], o[2], o[3]);
+					}
+				}
+				continue;
+			}
+			x = o[1] | ((o[3] & 0xF) << 8);
+			y = o[2] | ((o[3] >> 4) << 8);
+			if((o[0] != 0xFF) || (x != rx) || (y != ry)){
+				if(bad++ < REPORT_MAX){
+					printf("rgb: (%ld, %ld) fetched (%ld, %ld) alpha %d, expected (%ld, %ld)\n", u, v, x, y, o[0], rx, ry);
+				}
+			}
+		}
+	}
+	if(checked < MIN_CHECKED * REG_WIDTH * REG_HEIGHT){
+		printf("rgb: only %ld pixels checked\n", checked);
+		bad++;
+	}
+	free(rgb);
+	free(out);
+	return bad;
+}
+
+static long run_depth(t_registration *reg, uint16_t *depth){
+	uint16_t *nearest = (uint16_t *)malloc(REG_WIDTH * REG_HEIGHT * sizeof(uint16_t));
+	char *ambiguous = (char *)calloc(REG_WIDTH * REG_HEIGHT, 1);
+	char *out = (char *)malloc(REG_WIDTH * REG_HEIGHT * sizeof(double));
+	t_lookup lut = {NULL};
+	long u, v, p, x0, y0, x1, y1, x, y, bad = 0, checked = 0;
+	double got, ex, ey;
+	int t, size;
+	
+	if(!nearest || !ambiguous || !out){
+		printf("out of memory\n");
+		free(nearest);
+		free(ambiguous);
+		return 1;
+	}
+	for(v=0,p=0;v<REG_HEIGHT;v++){
+		for(u=0;u<REG_WIDTH;u++,p++){
+			depth[p] = ((u >= SQUARE_X) && (u < SQUARE_X + SQUARE_SIZE) && (v >= SQUARE_Y) && (v < SQUARE_Y + SQUARE_SIZE)) ? NEAR : WALL;
+		}
+	}
+	
+	//Nearest value landing on each colour pixel. Either neighbour of an ambiguous landing may get it.
+	for(p=0;p<REG_WIDTH*REG_HEIGHT;p++){
+		nearest[p] = 0x7FF;
+	}
+	for(v=0,p=0;v<REG_HEIGHT;v++){
+		for(u=0;u<REG_WIDTH;u++,p++){
+			project(&calibration, u, v, depth[p], &ex, &ey);
+			if(candidates(ex, &x0, &x1) & candidates(ey, &y0, &y1)){
+				if(inside(x0, y0) && (depth[p] < nearest[y0 * REG_WIDTH + x0])){
+					nearest[y0 * REG_WIDTH + x0] = depth[p];
+				}
+				continue;
+			}
+			for(y=y0;y<=y1;y++){
+				for(x=x0;x<=x1;x++){
+					if(inside(x, y)){
+						ambiguous[y * REG_WIDTH + x] = 1;
+					}
+				}
+			}
+		}
+	}
+	
+	for(t=0;t<(int)(sizeof(types)/sizeof(types[0]));t++){
+		if(convert_lut(&lut, types[t], 0, 0.f, 0.f) != CONVERT_ERR_NONE){
+			printf("could not build the %s table\n", type_names[types[t]]);
+			bad++;
+			continue;
+		}
+		size = convert_size(types[t]);
+		memset(out, 0, REG_WIDTH * REG_HEIGHT * sizeof(double));
+		registration_depth(reg, depth, out, REG_WIDTH * size, &lut, types[t]);
+		
+		checked = 0;
+		for(p=0;p<REG_WIDTH*REG_HEIGHT;p++){
+			if(ambiguous[p]){
+				continue;
+			}
+			checked++;
+			got = value(out + p * size, types[t]);
+			if(got != nearest[p]){
+				if(bad++ < REPORT_MAX){
+					printf("depth %s: (%ld, %ld) is %g, expected %d\n", type_names[types[t]], p % REG_WIDTH, p / REG_WIDTH,
+						   got, nearest[p]);
+				}
+			}
+		}
+		if(checked < MIN_CHECKED * REG_WIDTH * REG_HEIGHT){
+			printf("depth %s: only %ld pixels checked\n", type_names[types[t]], checked);
+			bad++;
+		}
+	}
+	
+	convert_lut(&lut, CONVERT_NONE, 0, 0.f, 0.f);
+	free(nearest);
+	free(ambiguous);
+	free(out);
+	return bad;
+}
+
+static int write_file(const char *text){
+	FILE *f = fopen(CALIBRATION_FILE, "w");
+	
+	if(!f){
+		printf("could not write %s\n", CALIBRATION_FILE);
+		return 1;
+	}
+	fputs(text, f);
+	fclose(f);
+	return 0;
+}
+
+//Pixel the ideal normalised coordinates of a point are seen at through the depth lens
+static void distort(const t_calibration *cal, double x, double y, double *u, double *v){
+	double r2 = x*x + y*y;
+	double radial = 1. + r2 * (cal->depth_k1 + r2 * (cal->depth_k2 + r2 * cal->depth_k3));
+	double xd = x * radial + 2. * cal->depth_p1 * x * y + cal->depth_p2 * (r2 + 2. * x * x);
+	double yd = y * radial + cal->depth_p1 * (r2 + 2. * y * y) + 2. * cal->depth_p2 * x * y;
+	
+	*u = xd * cal->depth_fx + cal->depth_cx;
+	*v = yd * cal->depth_fy + cal->depth_cy;
+}
+
+//Bilinear interpolation between pixels of a ray (0, 1) or table (2, 3) component
+static double bilinear(const t_registration *reg, double u, double v, int component){
+	long x = (long)u, y = (long)v, p, i, j;
+	double a[4];
+	
+	for(j=0;j<2;j++){
+		for(i=0;i<2;i++){
+			p = ((y + j) * REG_WIDTH + x + i) * 2 + (component & 1);
+			a[j*2+i] = (component < 2) ? reg->rays[p] : reg->table[p] / (double)(1 << REG_SHIFT);
+		}
+	}
+	u -= x;
+	v -= y;
+	return (a[0] * (1. - u) + a[1] * u) * (1. - v) + (a[2] * (1. - u) + a[3] * u) * v;
+}
+
+static long run_points(t_registration *reg, const t_calibration *cal){
+	static const uint16_t raws[] = {500, 700, 900};
+	double xn, yn, z, u, v, x, y, cx, cy, e;
+	long p, points = 0, bad = 0;
+	int r;
+	
+	//Known points seen by the depth camera
+	for(r=0;r<3;r++){
+		z = 1. / (raws[r] * cal->disparity_scale + cal->disparity_offset);
+		for(yn=-0.4;yn<=0.4;yn+=0.02){
+			for(xn=-0.6;xn<=0.6;xn+=0.02){
+				distort(cal, xn, yn, &u, &v);
+				if((u < 0.) || (u >= REG_WIDTH - 1) || (v < 0.) || (v >= REG_HEIGHT - 1)){
+					continue;
+				}
+				points++;
+				x = bilinear(reg, u, v, 0) * z;
+				y = -bilinear(reg, u, v, 1) * z;
+				cx = bilinear(reg, u, v, 2) + reg->shift_x[raws[r]] / (double)(1 << REG_SHIFT);
+				cy = bilinear(reg, u, v, 3) + reg->shift_y[raws[r]] / (double)(1 << REG_SHIFT);
+				e = (xn * z + cal->tx) / z * cal->rgb_fx + cal->rgb_cx;
+				if((fabs(x - xn * z) > POINT_TOLERANCE) || (fabs(y - yn * z) > POINT_TOLERANCE) ||
+				   (fabs(cx - e) > COLOUR_TOLERANCE) || (fabs(cy - ((yn * z + cal->ty) / z * cal->rgb_fy + cal->rgb_cy)) > COLOUR_TOLERANCE)){
+					if(bad++ < REPORT_MAX){
+						printf("points: (%g, %g, %g) seen at (%g, %g) gives (%g, %g) and colour (%g, %g), expected colour x %g\n",
+							   xn * z, yn * z, z, u, v, x, y, cx, cy, e);
+					}
+				}
+			}
+		}
+	}
+	if(points < MIN_POINTS){
+		printf("points: only %ld inside the frame\n", points);
+		bad++;
+	}
+	
+	//Every ray back onto its pixel
+	for(p=0;p<REG_WIDTH*REG_HEIGHT;p++){
+		distort(cal, reg->rays[p*2], -reg->rays[p*2+1], &u, &v);
+		if((fabs(u - p % REG_WIDTH) > PIXEL_TOLERANCE) || (fabs(v - p / REG_WIDTH) > PIXEL_TOLERANCE)){
+			if(bad++ < REPORT_MAX){
+				printf("rays: (%ld, %ld) distorts back to (%g, %g)\n", p % REG_WIDTH, p / REG_WIDTH, u, v);
+			}
+		}
+	}
+	return bad;
+}
+
+static long run_calibration(void){
+	t_registration reg, kept;
+	t_calibration cal, partial;
+	long line, bad = 0;
+	int err;
+	unsigned int i;
+	
+	memset(&reg, 0, sizeof(reg));
+	memset(&kept, 0, sizeof(kept));
+	if(registration_allocate(&reg) || registration_allocate(&kept)){
+		printf("out of memory\n");
+		registration_release(&reg);
+		return 1;
+	}
+	
+	cal = registration_defaults;
+	if(write_file(calibration_text) || (err = registration_load(CALIBRATION_FILE, &cal, &line))){
+		printf("calibration: could not load the file\n");
+		bad++;
+		goto out;
+	}
+	if(memcmp(&cal, &calibration_loaded, sizeof(cal))){
+		printf("calibration: the file loaded different values\n");
+		bad++;
+	}
+	registration_build(&reg, &cal);
+	bad += run_points(&reg, &cal);
+	
+	//What a partial file leaves out is the default, not the value before
+	partial = cal;
+	if(write_file("depth_intrinsics 600 600 320 240\ndepth_distortion -0.12 0.2\n") ||
+	   (err = registration_load(CALIBRATION_FILE, &partial, &line)) ||
+	   (partial.depth_fx != 600.) || (partial.depth_k1 != -0.12) || (partial.depth_p1 != 0.) || (partial.depth_k3 != 0.) ||
+	   memcmp(&partial.rgb_fx, &registration_defaults.rgb_fx, sizeof(double) * 9)){
+		printf("calibration: the partial file did not load over the defaults\n");
+		bad++;
+	}
+	
+	//Files that cannot be used keep what was loaded before
+	for(i=0;i<BAD_FILES;i++){
+		partial = cal;
+		line = -1;
+		if(write_file(bad_files[i].text)){
+			bad++;
+			continue;
+		}
+		err = registration_load(CALIBRATION_FILE, &partial, &line);
+		if((err != bad_files[i].err) || (line != bad_files[i].line) || memcmp(&partial, &cal, sizeof(cal))){
+			printf("calibration: bad file %u gave error %d on line %ld, expected %d on line %ld%s\n", i, err, line,
+				   bad_files[i].err, bad_files[i].line, memcmp(&partial, &cal, sizeof(cal)) ? ", and changed the calibration" : "");
+			bad++;
+		}
+	}
+	remove(CALIBRATION_FILE);
+	partial = cal;
+	if(registration_load(CALIBRATION_FILE, &partial, &line) != REGISTRATION_ERR_FILE || memcmp(&partial, &cal, sizeof(cal))){
+		printf("calibration: a missing file did not fail\n");
+		bad++;
+	}
+	
+	//So the tables rebuilt after the failures are the ones built before them
+	registration_build(&kept, &partial);
+	if(memcmp(kept.rays, reg.rays, REG_WIDTH * REG_HEIGHT * 2 * sizeof(float)) ||
+	   memcmp(kept.table, reg.table, REG_WIDTH * REG_HEIGHT * 2 * sizeof(int32_t)) ||
+	   memcmp(kept.shift_x, reg.shift_x, sizeof(reg.shift_x)) || memcmp(kept.shift_y, reg.shift_y, sizeof(reg.shift_y))){
+		printf("calibration: the tables changed after the bad files\n");
+		bad++;
+	}
+	
+out:
+	remove(CALIBRATION_FILE);
+	registration_release(&reg);
+	registration_release(&kept);
+	return bad;
+}
+
+int main(void){
+	t_registration reg;
+	uint16_t *depth = (uint16_t *)malloc(REG_WIDTH * REG_HEIGHT * sizeof(uint16_t));
+	long bad;
+	
+	memset(&reg, 0, sizeof(reg));
+	if(!depth || registration_allocate(&reg)){
+		printf("out of memory\n");
+		return 1;
+	}
+	registration_build(&reg, &calibration);
+	
+	bad = run_rgb(&reg, depth) + run_depth(&reg, depth) + run_calibration();
+	
+	registration_release(&reg);
+	free(depth);
+	if(bad){
+		printf("%ld mismatches\n", bad);
+	}
+	printf("%s\n", bad ? "FAILED" : "passed");
+	return bad ? 1 : 0;
+}